@@ -0,0 +1,4 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+int main(void) { static unsigned int f; return syscall(SYS_futex, &f, FUTEX_WAKE, 1, 0, 0, 0); }
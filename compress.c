@@ -5,6 +5,7 @@
  * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,7 +22,371 @@ size_t (*fread_wrapper)(void *ptr, size_t size, size_t nmemb, FILE *stream) = fr
 size_t (*fwrite_wrapper)(const void *ptr, size_t size, size_t nmemb, FILE *stream) = fwrite;
 int    (*fclose_wrapper)(FILE *fp) = fclose;
 
-static long compress_level = -1;
+static int fskip(FILE *stream, size_t len);
+int    (*fskip_wrapper)(FILE *stream, size_t len) = fskip;
+
+static long            compress_level = -1;
+static compress_mode_t compress_mode  = COMPRESS_NONE;
+
+struct reader
+{
+    FILE            *fp;
+    compress_mode_t mode;
+#ifdef HAVE_zstd
+    ZstdReader      *zstd;
+#endif
+};
+
+struct writer
+{
+    FILE            *fp;
+    compress_mode_t mode;
+#ifdef HAVE_zstd
+    ZstdWriter      *zstd;
+#endif
+};
+
+/*
+ * Skip len bytes of an uncompressed stream, returns 0 on success, -1 on EOF or error.
+ * We seek when we can, and read through otherwise (pipes).
+ */
+static int fskip(FILE *stream, size_t len)
+{
+    char buf[BUFSIZ];
+
+    if ((len <= LONG_MAX) && (fseek(stream, (long)len, SEEK_CUR) == 0))
+    {
+        return 0;
+    }
+    while (len > 0)
+    {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        if (fread(buf, 1, chunk, stream) != chunk)
+        {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+
+/*
+ * Returns NULL if the compression mode isn't supported, or on allocation failure.
+ * The reader takes ownership of fp, which is closed by reader_close().
+ */
+Reader *reader_new(FILE *fp, compress_mode_t cm)
+{
+    Reader *r;
+
+    if (cm != COMPRESS_NONE)
+    {
+#ifdef HAVE_zstd
+        if (cm != COMPRESS_ZSTD)
+#endif
+        {
+            fprintf(stderr, "ttyrec: unsupported compression mode\r\n");
+            return NULL;
+        }
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+    {
+        return NULL;
+    }
+    r->fp   = fp;
+    r->mode = cm;
+#ifdef HAVE_zstd
+    if (cm == COMPRESS_ZSTD)
+    {
+        r->zstd = zstd_reader_new();
+        if (r->zstd == NULL)
+        {
+            free(r);
+            return NULL;
+        }
+    }
+#endif
+    return r;
+}
+
+
+/* returns 1 if we got all of the len bytes, 0 on EOF or error */
+int reader_read(Reader *r, void *ptr, size_t len)
+{
+#ifdef HAVE_zstd
+    if (r->mode == COMPRESS_ZSTD)
+    {
+        return zstd_reader_read(r->zstd, ptr, len, r->fp);
+    }
+#endif
+    return fread(ptr, 1, len, r->fp) == len;
+}
+
+
+/* returns the number of bytes we got, less than len only on EOF or error */
+size_t reader_fill(Reader *r, void *ptr, size_t len)
+{
+#ifdef HAVE_zstd
+    if (r->mode == COMPRESS_ZSTD)
+    {
+        return zstd_reader_fill(r->zstd, ptr, len, r->fp);
+    }
+#endif
+    return fread(ptr, 1, len, r->fp);
+}
+
+
+/* returns 0 on success, -1 on EOF or error */
+int reader_skip(Reader *r, size_t len)
+{
+#ifdef HAVE_zstd
+    if (r->mode == COMPRESS_ZSTD)
+    {
+        return zstd_reader_read(r->zstd, NULL, len, r->fp) ? 0 : -1;
+    }
+#endif
+    return fskip(r->fp, len);
+}
+
+
+/*
+ * Don't give up on corrupt compressed data, skip to where we can decompress again
+ * instead. Uncompressed streams are read as they are anyway.
+ */
+void reader_salvage(Reader *r)
+{
+#ifdef HAVE_zstd
+    if (r->mode == COMPRESS_ZSTD)
+    {
+        zstd_reader_salvage(r->zstd);
+    }
+#else
+    (void)r;
+#endif
+}
+
+
+/* why the reader stopped: 0 on EOF, 1 on corrupt compressed data, -1 on read error */
+int reader_error(Reader *r)
+{
+    if (ferror(r->fp))
+    {
+        return -1;
+    }
+#ifdef HAVE_zstd
+    if ((r->mode == COMPRESS_ZSTD) && zstd_reader_error(r->zstd))
+    {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+
+void reader_damage(Reader *r, ReaderDamage *damage)
+{
+    memset(damage, 0, sizeof(*damage));
+#ifdef HAVE_zstd
+    if (r->mode == COMPRESS_ZSTD)
+    {
+        zstd_reader_damage(r->zstd, damage);
+    }
+#else
+    (void)r;
+#endif
+}
+
+
+int reader_close(Reader *r)
+{
+    int ret = fclose(r->fp);
+
+#ifdef HAVE_zstd
+    zstd_reader_free(r->zstd);
+#endif
+    free(r);
+    return ret;
+}
+
+
+/*
+ * Returns NULL if the compression mode isn't supported, or on allocation failure.
+ * The writer takes ownership of fp, which is closed by writer_close().
+ */
+Writer *writer_new(FILE *fp, compress_mode_t cm)
+{
+    Writer *w;
+
+    if (cm != COMPRESS_NONE)
+    {
+#ifdef HAVE_zstd
+        if (cm != COMPRESS_ZSTD)
+#endif
+        {
+            fprintf(stderr, "ttyrec: unsupported compression mode\r\n");
+            return NULL;
+        }
+    }
+
+    w = calloc(1, sizeof(*w));
+    if (w == NULL)
+    {
+        return NULL;
+    }
+    w->fp   = fp;
+    w->mode = cm;
+#ifdef HAVE_zstd
+    if (cm == COMPRESS_ZSTD)
+    {
+        w->zstd = zstd_writer_new();
+        if (w->zstd == NULL)
+        {
+            free(w);
+            return NULL;
+        }
+    }
+#endif
+    return w;
+}
+
+
+/* compression level of this stream, rather than the global one */
+void writer_set_level(Writer *w, long level)
+{
+#ifdef HAVE_zstd
+    if (w->mode == COMPRESS_ZSTD)
+    {
+        zstd_writer_set_level(w->zstd, level);
+    }
+#else
+    (void)w;
+    (void)level;
+#endif
+}
+
+
+/* compress better data that repeats from far away, returns -1 if it isn't supported */
+int writer_set_long_distance(Writer *w)
+{
+#ifdef HAVE_zstd
+    if (w->mode == COMPRESS_ZSTD)
+    {
+        return zstd_writer_set_long(w->zstd);
+    }
+#else
+    (void)w;
+#endif
+    return -1;
+}
+
+
+/* returns 0 on success, -1 on error */
+int writer_write(Writer *w, const void *ptr, size_t len)
+{
+#ifdef HAVE_zstd
+    if (w->mode == COMPRESS_ZSTD)
+    {
+        // the number of bytes zstd wrote to the file doesn't tell us anything
+        (void)zstd_writer_write(w->zstd, ptr, len, w->fp);
+        return ferror(w->fp) || zstd_writer_error(w->zstd) ? -1 : 0;
+    }
+#endif
+    return fwrite(ptr, 1, len, w->fp) == len ? 0 : -1;
+}
+
+
+/*
+ * Hand all that was written so far to the kernel, compressed data included (without
+ * ending the current frame), returns 0 on success, -1 on error.
+ */
+int writer_flush(Writer *w)
+{
+#ifdef HAVE_zstd
+    if ((w->mode == COMPRESS_ZSTD) && (zstd_writer_flush(w->zstd, w->fp) != 0))
+    {
+        return -1;
+    }
+#endif
+    return fflush(w->fp) == 0 ? 0 : -1;
+}
+
+
+/*
+ * In how many seconds writer_flush() should be called, if nothing is written to w
+ * meanwhile, for readers following the file to get all that was written so far:
+ * -1 if it needn't be, see zstd_writer_flush_due().
+ */
+long writer_flush_due(Writer *w)
+{
+#ifdef HAVE_zstd
+    if (w->mode == COMPRESS_ZSTD)
+    {
+        return zstd_writer_flush_due(w->zstd);
+    }
+#else
+    (void)w;
+#endif
+    return -1;
+}
+
+
+/* end the current compressed frame, so that what's written to the file next is out of it */
+void writer_end_frame(Writer *w)
+{
+#ifdef HAVE_zstd
+    if (w->mode == COMPRESS_ZSTD)
+    {
+        zstd_writer_end(w->zstd, w->fp);
+    }
+#else
+    (void)w;
+#endif
+}
+
+
+FILE *writer_file(Writer *w)
+{
+    return w->fp;
+}
+
+
+int writer_close(Writer *w)
+{
+    int ret;
+
+    writer_end_frame(w);
+    ret = fclose(w->fp);
+#ifdef HAVE_zstd
+    zstd_writer_free(w->zstd);
+#endif
+    free(w);
+    return ret;
+}
+
+
+/*
+ * Guess how a file is compressed: from its .zst suffix, or from the zstd magic
+ * number at its start (which, as a ttyrec header, would be a timestamp in 2104).
+ * fp is rewound.
+ */
+compress_mode_t detect_compress_mode(const char *filename, FILE *fp)
+{
+    static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+    size_t                     namelen       = strlen(filename);
+    unsigned char              magic[sizeof(zstd_magic)];
+    int                        found;
+
+    if ((namelen >= 4) && (strcmp(filename + namelen - 4, ".zst") == 0))
+    {
+        return COMPRESS_ZSTD;
+    }
+    found = (fread(magic, 1, sizeof(magic), fp) == sizeof(magic)) && (memcmp(magic, zstd_magic, sizeof(magic)) == 0);
+    rewind(fp);
+    return found ? COMPRESS_ZSTD : COMPRESS_NONE;
+}
+
 
 int set_compress_mode(compress_mode_t cm)
 {
@@ -31,6 +396,7 @@ int set_compress_mode(compress_mode_t cm)
         fread_wrapper  = fread;
         fwrite_wrapper = fwrite;
         fclose_wrapper = fclose;
+        fskip_wrapper  = fskip;
         break;
 
 #ifdef HAVE_zstd
@@ -38,6 +404,7 @@ int set_compress_mode(compress_mode_t cm)
         fread_wrapper  = fread_wrapper_zstd;
         fwrite_wrapper = fwrite_wrapper_zstd;
         fclose_wrapper = fclose_wrapper_zstd;
+        fskip_wrapper  = fskip_wrapper_zstd;
         break;
 #endif
 
@@ -45,10 +412,17 @@ int set_compress_mode(compress_mode_t cm)
         fprintf(stderr, "ttyrec: unsupported compression mode\r\n");
         return 1;
     }
+    compress_mode = cm;
     return 0;
 }
 
 
+compress_mode_t get_compress_mode(void)
+{
+    return compress_mode;
+}
+
+
 void set_compress_level(long level)
 {
     compress_level = level;
@@ -7,6 +7,7 @@
 extern size_t (*fwrite_wrapper)(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 extern size_t (*fread_wrapper)(void *ptr, size_t size, size_t nmemb, FILE *stream);
 extern int    (*fclose_wrapper)(FILE *fp);
+extern int    (*fskip_wrapper)(FILE *stream, size_t len);
 
 typedef enum
 {
@@ -14,7 +15,45 @@ typedef enum
     COMPRESS_ZSTD = 1,
 } compress_mode_t;
 
+/*
+ * Per-stream reader, for when several files are read at once (possibly from
+ * several threads), which the global wrappers above can't do.
+ */
+typedef struct reader Reader;
+
+// what a reader in salvage mode had to skip, see reader_salvage()
+typedef struct reader_damage
+{
+    unsigned long      regions;   // damaged parts of the file
+    unsigned long long skipped;   // bytes skipped in the file because of them
+    int                truncated; // the file ends in the middle of a compressed frame
+} ReaderDamage;
+
+Reader *reader_new(FILE *fp, compress_mode_t cm);
+int reader_read(Reader *r, void *ptr, size_t len);
+size_t reader_fill(Reader *r, void *ptr, size_t len);
+int reader_skip(Reader *r, size_t len);
+void reader_salvage(Reader *r);
+int reader_error(Reader *r);
+void reader_damage(Reader *r, ReaderDamage *damage);
+int reader_close(Reader *r);
+
+// same, for writing
+typedef struct writer Writer;
+
+Writer *writer_new(FILE *fp, compress_mode_t cm);
+void writer_set_level(Writer *w, long level);
+int writer_set_long_distance(Writer *w);
+int writer_write(Writer *w, const void *ptr, size_t len);
+int writer_flush(Writer *w);
+long writer_flush_due(Writer *w);
+void writer_end_frame(Writer *w);
+FILE *writer_file(Writer *w);
+int writer_close(Writer *w);
+
+compress_mode_t detect_compress_mode(const char *filename, FILE *fp);
 int set_compress_mode(compress_mode_t cm);
+compress_mode_t get_compress_mode(void);
 void set_compress_level(long level);
 long get_compress_level(void);
 
@@ -8,16 +8,65 @@
 #include "compress.h"
 #include "compress_zstd.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <zstd.h>
 
-static ZSTD_CStream *cstream    = NULL;
-static size_t       buffOutSize = 0;
-static void         *buffOut;
-static long         zstd_max_flush_seconds = ZSTD_MAX_FLUSH_SECONDS_DEFAULT;
+static long zstd_max_flush_seconds = ZSTD_MAX_FLUSH_SECONDS_DEFAULT;
+
+/*
+ * Compression state of a stream being written.
+ * frameInputSize: uncompressed bytes fed to the current frame
+ * dirtySince: when we first gave zstd data it still holds (not written out yet), 0 if none
+ * level, longDistance: parameters of this stream, see zstd_writer_set_level() and zstd_writer_set_long()
+ */
+struct zstd_writer
+{
+    ZSTD_CStream *cstream;
+    size_t       buffOutSize;
+    void         *buffOut;
+    size_t       frameInputSize;
+    time_t       dirtySince;
+    long         level;
+    int          longDistance;
+    int          error;        // see zstd_writer_fail()
+};
+
+/*
+ * Decompression state of a stream being read.
+ * input: compressed data read from file, ZSTD_READ_BUFFER_SIZE bytes at a time
+ * output: decompressed data from (a part of) input.src, unless it went right to the caller's buffer
+ * outPtr: pointing to decompressed not-yet-returned-to-caller data (remaining bytes is outPtrLen)
+ */
+struct zstd_reader
+{
+    ZSTD_DStream   *dstream;
+    ZSTD_inBuffer  input;
+    ZSTD_outBuffer output;
+    size_t         outSize;
+    char           *outPtr;
+    size_t         outPtrLen; // number of valid not-yet-returned bytes after outPtr
+    int            outPending;  // the last output buffer given to zstd was filled up, it may hold more
+    // what ZSTD_decompressStream() last returned, 0 once a frame is fully decoded
+    size_t         toRead;
+    int            inFrame;     // the last input given to zstd didn't end a frame
+    // only kept up to date in salvage mode, see zstd_reader_salvage()
+    int            salvage;
+    long           inputOffset; // offset in the file of input.src
+    long           frameStart;  // offset in the file of the current frame
+    ReaderDamage   damage;
+    int            error;       // see zstd_reader_fail()
+};
+
+// the writer behind fwrite_wrapper_zstd() and zstd_end_stream()
+static ZstdWriter default_writer;
+
+// the reader behind fread_wrapper_zstd() and fskip_wrapper_zstd()
+static ZstdReader default_reader;
+
 
 void zstd_set_max_flush(long seconds)
 {
@@ -25,210 +74,738 @@ void zstd_set_max_flush(long seconds)
 }
 
 
-size_t fwrite_wrapper_zstd(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+ZstdWriter *zstd_writer_new(void)
+{
+    return calloc(1, sizeof(ZstdWriter));
+}
+
+
+void zstd_writer_free(ZstdWriter *zw)
+{
+    if (zw != NULL)
+    {
+        ZSTD_freeCStream(zw->cstream);
+        free(zw->buffOut);
+        free(zw);
+    }
+}
+
+
+/* use this level rather than the global one, see set_compress_level() */
+void zstd_writer_set_level(ZstdWriter *zw, long level)
+{
+    zw->level = level;
+}
+
+
+/*
+ * Enable long distance matching, which finds repetitions up to 128 MB apart (the
+ * default maximum window of decoders). Returns -1 if our libzstd can't do it.
+ */
+int zstd_writer_set_long(ZstdWriter *zw)
+{
+#if ZSTD_VERSION_NUMBER >= 10400
+    zw->longDistance = 1;
+    return 0;
+#else
+    (void)zw;
+    return -1;
+#endif
+}
+
+
+/* returns 1 if the writer failed, after which it doesn't write anything anymore */
+int zstd_writer_error(ZstdWriter *zw)
+{
+    return zw->error;
+}
+
+
+/*
+ * Errors are fatal to the writer behind the global wrappers, as ttyrec has always
+ * expected. Per-stream writers report them to their caller instead (such as
+ * libttyrec, which must never exit() behind the back of its users).
+ */
+static void zstd_writer_fail(ZstdWriter *zw, int code, const char *what, size_t result)
 {
-    static time_t last_sync      = 0;
-    long          compress_level = get_compress_level();
+    if (zw == &default_writer)
+    {
+        if (result != 0)
+        {
+            fprintf(stderr, "%s error: %s\r\n", what, ZSTD_getErrorName(result));
+        }
+        else
+        {
+            fprintf(stderr, "%s error\r\n", what);
+        }
+        exit(code);
+    }
+    zw->error = 1;
+}
 
-    if (cstream == NULL)
+
+/*
+ * Compress len bytes of ptr to stream. Returns the number of bytes actually written to
+ * stream, which is 0 as long as zstd keeps the data buffered.
+ */
+size_t zstd_writer_write(ZstdWriter *zw, const void *ptr, size_t len, FILE *stream)
+{
+    long compress_level = zw->level > 0 ? zw->level : get_compress_level();
+
+    if (zw->error)
     {
-        cstream = ZSTD_createCStream();
-        if (cstream == NULL)
+        return 0;
+    }
+    if (zw->cstream == NULL)
+    {
+        zw->cstream = ZSTD_createCStream();
+        if (zw->cstream == NULL)
         {
-            fprintf(stderr, "ZSTD_createCStream() error\r\n");
-            exit(10);
+            zstd_writer_fail(zw, 10, "ZSTD_createCStream()", 0);
+            return 0;
         }
 
         if (compress_level < 0)
         {
             compress_level = 3;
         }
-        size_t const initResult = ZSTD_initCStream(cstream, compress_level);
+        size_t const initResult = ZSTD_initCStream(zw->cstream, compress_level);
         if (ZSTD_isError(initResult))
         {
-            fprintf(stderr, "ZSTD_initCStream() error: %s\r\n", ZSTD_getErrorName(initResult));
-            exit(11);
+            zstd_writer_fail(zw, 11, "ZSTD_initCStream()", initResult);
+            return 0;
         }
-
-        if (buffOutSize == 0)
+#if ZSTD_VERSION_NUMBER >= 10400
+        if (zw->longDistance)
         {
-            buffOutSize = ZSTD_CStreamOutSize();
-            buffOut     = malloc(buffOutSize);
-            if (buffOut == NULL)
+            size_t const ldmResult = ZSTD_CCtx_setParameter(zw->cstream, ZSTD_c_enableLongDistanceMatching, 1);
+            if (ZSTD_isError(ldmResult))
             {
-                fprintf(stderr, "couldn't malloc() zstd out buffer\r\n");
-                exit(12);
+                zstd_writer_fail(zw, 11, "ZSTD_CCtx_setParameter()", ldmResult);
+                return 0;
             }
         }
+#endif
 
-        last_sync = time(NULL);
+        if (zw->buffOutSize == 0)
+        {
+            zw->buffOut = malloc(ZSTD_CStreamOutSize());
+            if (zw->buffOut == NULL)
+            {
+                zstd_writer_fail(zw, 12, "zstd out buffer malloc()", 0);
+                return 0;
+            }
+            zw->buffOutSize = ZSTD_CStreamOutSize();
+        }
     }
 
     size_t        written = 0;
-    ZSTD_inBuffer input   = { ptr, size * nmemb, 0 };
+    ZSTD_inBuffer input   = { ptr, len, 0 };
 
     while (input.pos < input.size)
     {
-        ZSTD_outBuffer output = { buffOut, buffOutSize, 0 };
-        size_t         toRead = ZSTD_compressStream(cstream, &output, &input); /* toRead is guaranteed to be <= ZSTD_CStreamInSize() */
+        ZSTD_outBuffer output = { zw->buffOut, zw->buffOutSize, 0 };
+        size_t         toRead = ZSTD_compressStream(zw->cstream, &output, &input); /* toRead is guaranteed to be <= ZSTD_CStreamInSize() */
         if (ZSTD_isError(toRead))
         {
-            fprintf(stderr, "ZSTD_compressStream() error: %s\r\n", ZSTD_getErrorName(toRead));
-            exit(13);
+            zstd_writer_fail(zw, 13, "ZSTD_compressStream()", toRead);
+            return written;
         }
-        size_t thisWritten = fwrite(buffOut, 1, output.pos, stream);
+        size_t thisWritten = fwrite(zw->buffOut, 1, output.pos, stream);
         if (thisWritten != output.pos)
         {
             return thisWritten;     // error or eof, pass to caller
         }
         written += thisWritten;
     }
+    zw->frameInputSize += input.size;
+
+    // once the current frame is big enough, close it: the next call will transparently
+    // start a new one. as we're always called with whole records (see write_record()),
+    // this gives readers such as ttyplay -p a nearby point to start decompressing from
+    if (zw->frameInputSize >= ZSTD_MAX_FRAME_INPUT_SIZE)
+    {
+        size_t remainingToFlush;
+        do
+        {
+            ZSTD_outBuffer output = { zw->buffOut, zw->buffOutSize, 0 };
+            remainingToFlush = ZSTD_endStream(zw->cstream, &output);
+            if (ZSTD_isError(remainingToFlush))
+            {
+                zstd_writer_fail(zw, 15, "ZSTD_endStream()", remainingToFlush);
+                return written;
+            }
+            size_t thisWritten = fwrite(zw->buffOut, 1, output.pos, stream);
+            if (thisWritten != output.pos)
+            {
+                return thisWritten;
+            }
+            written += thisWritten;
+        } while (remainingToFlush > 0);
+        zw->frameInputSize = 0;
+    }
     //fprintf(stderr, "[zstd:nbwr=%lu]", written);
-    // if we actually did write data to disk (instead of just compressing in memory),
-    // then we can reset last_sync
-    if (written > 0)
+    // zstd only writes out whole blocks, the end of the data stays buffered until more comes:
+    // flush it once it's been there for zstd_max_flush_seconds, we don't want to lose data
+    // from almost-idle sessions in case of server crash, and readers following the file
+    // (ttyplay -p) can't see it until then. see also zstd_writer_flush_due()
+    if (zw->frameInputSize == 0)
     {
-        last_sync = time(NULL);
-        //fprintf(stderr, "[zstd:rst]");
+        zw->dirtySince = 0;
     }
-    // otherwise, check for last sync time. if it's > X seconds, force zstd to flush its buffers
-    // and write to disk. we don't want to lose data from almost-idle sessions in case of server crash
-    else if (last_sync + zstd_max_flush_seconds < time(NULL))
+    else if (zw->dirtySince == 0)
     {
-        ZSTD_outBuffer output = { buffOut, buffOutSize, 0 };
-        written = ZSTD_flushStream(cstream, &output);
-        if (ZSTD_isError(written))
-        {
-            fprintf(stderr, "ZSTD_flushStream() error: %s\r\n", ZSTD_getErrorName(written));
-            exit(14);
-        }
-        //fprintf(stderr, "[zstd:tmoutflushed=%lu]", output.pos);
-        written = fwrite(buffOut, 1, output.pos, stream);
-        //fprintf(stderr, "[zstd:tmoutnbwr=%lu]", written);
-        last_sync = time(NULL);
+        zw->dirtySince = time(NULL);
+    }
+    else if (zw->dirtySince + zstd_max_flush_seconds <= time(NULL))
+    {
+        (void)zstd_writer_flush(zw, stream);
     }
     return written;
 }
 
 
-int fclose_wrapper_zstd(FILE *fp)
+/*
+ * How many seconds from now zstd_writer_write() would flush what zstd holds, if it got
+ * called then: 0 if it's overdue, -1 if there's nothing to flush. Callers that may not
+ * write anything for a while flush themselves then, so that readers get all the data
+ * within zstd_max_flush_seconds.
+ */
+long zstd_writer_flush_due(ZstdWriter *zw)
 {
-    if (cstream != NULL)
+    time_t due;
+
+    if (zw->error || (zw->dirtySince == 0))
     {
-        ZSTD_outBuffer output           = { buffOut, buffOutSize, 0 };
-        size_t const   remainingToFlush = ZSTD_endStream(cstream, &output);                     /* close frame */
+        return -1;
+    }
+    due = zw->dirtySince + zstd_max_flush_seconds - time(NULL);
+    return due > 0 ? (long)due : 0;
+}
+
+
+/*
+ * Write to fp all that zstd buffered so far, without ending the current frame:
+ * readers can then decompress everything given to zstd_writer_write() up to now.
+ * Returns 0 on success, -1 on error.
+ */
+int zstd_writer_flush(ZstdWriter *zw, FILE *fp)
+{
+    size_t remainingToFlush;
+
+    if (zw->error)
+    {
+        return -1;
+    }
+    if (zw->cstream == NULL)
+    {
+        return 0;
+    }
+    do
+    {
+        ZSTD_outBuffer output = { zw->buffOut, zw->buffOutSize, 0 };
+        remainingToFlush = ZSTD_flushStream(zw->cstream, &output);
+        if (ZSTD_isError(remainingToFlush))
+        {
+            zstd_writer_fail(zw, 14, "ZSTD_flushStream()", remainingToFlush);
+            return -1;
+        }
+        if (fwrite(zw->buffOut, 1, output.pos, fp) != output.pos)
+        {
+            return -1;
+        }
+    } while (remainingToFlush > 0);
+    zw->dirtySince = 0;
+    return 0;
+}
+
+
+/*
+ * End the zstd stream being written to fp, if any, without closing fp: whatever
+ * we write after that is outside of any zstd frame.
+ */
+void zstd_writer_end(ZstdWriter *zw, FILE *fp)
+{
+    if ((zw->cstream != NULL) && !zw->error)
+    {
+        ZSTD_outBuffer output           = { zw->buffOut, zw->buffOutSize, 0 };
+        size_t const   remainingToFlush = ZSTD_endStream(zw->cstream, &output);                 /* close frame */
         if (remainingToFlush)
         {
             fprintf(stderr, "error: zstd not fully flushed\r\n");
         }
-        fwrite(buffOut, 1, output.pos, fp);
+        fwrite(zw->buffOut, 1, output.pos, fp);
         //fprintf(stderr, "[closezstd:written=%lu]", output.pos);
-        ZSTD_freeCStream(cstream);
-        cstream = NULL;
+        ZSTD_freeCStream(zw->cstream);
+        zw->cstream        = NULL;
+        zw->frameInputSize = 0;
+        zw->dirtySince     = 0;
     }
-    return fclose(fp);
 }
 
 
-size_t fread_wrapper_zstd(void *ptr, size_t size, size_t nmemb, FILE *stream)
+size_t fwrite_wrapper_zstd(const void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
-    // input: compressed data read from file
-    // output: decompressed data from (a part of) input.src
-    // buffOutPtr: pointing to decompressed not-yet-returned-to-caller data (remaining bytes is buffOutPtrLen)
+    return zstd_writer_write(&default_writer, ptr, size * nmemb, stream);
+}
 
-    static ZSTD_inBuffer input = { NULL, 0, 0 };
 
-    static size_t         buffOutSize;
-    static ZSTD_outBuffer output = { NULL, 0, 0 };
+void zstd_end_stream(FILE *fp)
+{
+    zstd_writer_end(&default_writer, fp);
+}
 
-    static char   *buffOutPtr   = NULL;
-    static size_t buffOutPtrLen = 0;       // number of valid not-yet-returned bytes after ptr
 
-    static ZSTD_DStream *dstream = NULL;
-    // static because ZSTD_initDStream return the first recommended input size, we'll use ot for first fread()
-    static size_t toRead;
+// forget what was read so far, to read the file again from wherever it's been fseek()ed to
+void zstd_reset_stream(void)
+{
+    zstd_reader_reset(&default_reader);
+}
 
-    size_t remainingBytesToReturn = size * nmemb;
-    char   *returnData            = (char *)ptr;
 
-    // init dstream if needed (first call only)
-    if (dstream == NULL)
+int fclose_wrapper_zstd(FILE *fp)
+{
+    zstd_end_stream(fp);
+    // forget about this file, so that the next one can be read from its start
+    zstd_reader_reset(&default_reader);
+    return fclose(fp);
+}
+
+
+ZstdReader *zstd_reader_new(void)
+{
+    return calloc(1, sizeof(ZstdReader));
+}
+
+
+void zstd_reader_reset(ZstdReader *zr)
+{
+    if (zr->dstream != NULL)
     {
-        dstream = ZSTD_createDStream();
-        toRead  = ZSTD_initDStream(dstream);
+        ZSTD_freeDStream(zr->dstream);
+    }
+    free((void *)zr->input.src);
+    free(zr->output.dst);
+    memset(zr, 0, sizeof(*zr));
+}
 
-        input.src = malloc(ZSTD_DStreamInSize());
 
-        buffOutSize = ZSTD_DStreamOutSize();
-        output.dst  = malloc(buffOutSize);
+void zstd_reader_free(ZstdReader *zr)
+{
+    if (zr != NULL)
+    {
+        zstd_reader_reset(zr);
+        free(zr);
     }
+}
+
+
+/*
+ * In salvage mode, corrupt data no longer is a fatal error: we skip to the next
+ * frame, and keep count of what we had to skip, see zstd_reader_damage().
+ */
+void zstd_reader_salvage(ZstdReader *zr)
+{
+    zr->salvage     = 1;
+    zr->inputOffset = -1;
+}
+
+
+void zstd_reader_damage(ZstdReader *zr, ReaderDamage *damage)
+{
+    *damage = zr->damage;
+}
+
+
+/* returns 1 if the reader stopped on corrupt data (or couldn't start), rather than on EOF */
+int zstd_reader_error(ZstdReader *zr)
+{
+    return zr->error;
+}
+
 
-    // do we have remaining decompressed data from a previous call, ready to be returned?
-GOTDATA:
-    if (buffOutPtrLen > 0)
+/* same as zstd_writer_fail() */
+static void zstd_reader_fail(ZstdReader *zr, const char *what, size_t result)
+{
+    if (zr == &default_reader)
     {
-        if (buffOutPtrLen >= remainingBytesToReturn)
+        if (result != 0)
         {
-            // easy: we already have all the wanted data in the previous runs buffer
-            // so we'll just consume data from it and return
-            memcpy(returnData, buffOutPtr, remainingBytesToReturn);
-            buffOutPtrLen -= remainingBytesToReturn;
-            buffOutPtr    += remainingBytesToReturn;
-            return nmemb;
+            fprintf(stderr, "%s error: %s\r\n", what, ZSTD_getErrorName(result));
         }
         else
         {
-            // we have SOME data in the previous runs buffer, use it
-            memcpy(returnData, buffOutPtr, buffOutPtrLen);
-            returnData             += buffOutPtrLen;
-            remainingBytesToReturn -= buffOutPtrLen;
-            buffOutPtrLen           = 0;
-            buffOutPtr              = NULL;
+            fprintf(stderr, "%s error\r\n", what);
         }
+        exit(16);
     }
+    zr->error = 1;
+}
+
+
+static int is_frame_start(const unsigned char *p, size_t len)
+{
+    uint32_t magic = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
 
-    // if we're here, we don't have any data left in buffOutPtr, and the caller wants more data
-    // but maybe we still have not-yet-decompressed data from a previously read compressed chunk?
-DECOMPRESS:
-    if (input.pos < input.size)
+    // a zstd frame, or a skippable one (0x184D2A5?), with a header that makes sense
+    return ((magic == ZSTD_MAGICNUMBER) || ((magic & 0xFFFFFFF0U) == 0x184D2A50U)) &&
+           (ZSTD_getFrameContentSize(p, len) != ZSTD_CONTENTSIZE_ERROR);
+}
+
+
+/*
+ * The current frame is damaged: look for the next one, from right after the start
+ * of the current one, as what follows a truncated frame is usually a new one.
+ * Returns 0 if we found one, -1 if there's none, or if the stream can't be seeked.
+ */
+static int zstd_reader_resync(ZstdReader *zr, FILE *stream)
+{
+    unsigned char buf[ZSTD_SCAN_CHUNK_SIZE + ZSTD_FRAME_HEADER_MAX_SIZE];
+    long          damaged = zr->inputOffset + zr->input.pos;
+    long          pos     = zr->frameStart + 1;
+
+    zr->damage.regions++;
+    zr->outPtrLen  = 0;
+    zr->outPending = 0;
+    if (zr->inputOffset < 0)
     {
-        output.pos  = 0;
-        output.size = buffOutSize;
-        toRead      = ZSTD_decompressStream(dstream, &output, &input);      /* toRead: size of next compressed block */
-        if (ZSTD_isError(toRead))
+        return -1;
+    }
+
+    while (1)
+    {
+        if (fseek(stream, pos, SEEK_SET) != 0)
         {
-            fprintf(stderr, "ZSTD_decompressStream() error: %s\r\n", ZSTD_getErrorName(toRead));
-            exit(16);
+            return -1;
         }
-        buffOutPtr    = output.dst;      // aka buffOut
-        buffOutPtrLen = output.pos;
-        if (buffOutPtrLen == 0)
+        size_t got = fread(buf, 1, sizeof(buf), stream);
+        for (size_t i = 0; i < ZSTD_SCAN_CHUNK_SIZE && i + 4 <= got; i++)
+        {
+            if (is_frame_start(buf + i, got - i))
+            {
+                pos += i;
+                if (pos > damaged)
+                {
+                    zr->damage.skipped += pos - damaged;
+                }
+                if (fseek(stream, pos, SEEK_SET) != 0)
+                {
+                    return -1;
+                }
+                zr->toRead      = ZSTD_initDStream(zr->dstream);
+                zr->input.size  = 0;
+                zr->input.pos   = 0;
+                zr->inFrame     = 0;
+                zr->inputOffset = pos;
+                return 0;
+            }
+        }
+        if (got < sizeof(buf))
+        {
+            // no frame up to the end of the file
+            if (pos + (long)got > damaged)
+            {
+                zr->damage.skipped += pos + got - damaged;
+            }
+            return -1;
+        }
+        pos += ZSTD_SCAN_CHUNK_SIZE;
+    }
+}
+
+
+/*
+ * Get up to len decompressed bytes into ptr, or just drop them if ptr is NULL.
+ * Returns how many we got, which is less than len only on EOF or error.
+ */
+size_t zstd_reader_fill(ZstdReader *zr, void *ptr, size_t len, FILE *stream)
+{
+    size_t got         = 0;
+    char   *returnData = (char *)ptr;
+
+    if (zr->error)
+    {
+        return 0;
+    }
+    // init dstream if needed (first call only)
+    if (zr->dstream == NULL)
+    {
+        zr->dstream = ZSTD_createDStream();
+        zr->toRead  = ZSTD_initDStream(zr->dstream);
+
+        zr->input.src = malloc(ZSTD_READ_BUFFER_SIZE);
+
+        zr->outSize    = ZSTD_DStreamOutSize();
+        zr->output.dst = malloc(zr->outSize);
+        if ((zr->dstream == NULL) || (zr->input.src == NULL) || (zr->output.dst == NULL))
         {
-            // ok this is an empty frame (or beginning of zst stream), read again
-            goto DECOMPRESS;
+            zstd_reader_fail(zr, "zstd decompression setup", 0);
+            return 0;
         }
-        goto GOTDATA;
     }
-    // nope we don't, alright, decompress a new chunk then
-    else
+
+    while (got < len)
     {
-        if (toRead == 0)
+        // do we have remaining decompressed data from a previous call, ready to be returned?
+        if (zr->outPtrLen > 0)
+        {
+            size_t n = zr->outPtrLen >= len - got ? len - got : zr->outPtrLen;
+            if (returnData != NULL)
+            {
+                memcpy(returnData + got, zr->outPtr, n);
+            }
+            zr->outPtrLen -= n;
+            zr->outPtr    += n;
+            got           += n;
+            continue;
+        }
+
+        // maybe we still have not-yet-decompressed data from a previously read compressed chunk,
+        // or zstd still holds data that didn't fit in the output buffer last time?
+        if ((zr->input.pos < zr->input.size) || zr->outPending)
+        {
+            ZSTD_outBuffer direct = { returnData + got, len - got, 0 };
+            // when the caller wants a block's worth or more (large records), decompress right into
+            // their buffer: going through ours would only add a memcpy of everything. not when
+            // salvaging though, as what a failed call decoded before the damage would be lost
+            int            isDirect = (returnData != NULL) && !zr->salvage && (len - got >= zr->outSize);
+            ZSTD_outBuffer *output  = isDirect ? &direct : &zr->output;
+
+            if (!zr->inFrame)
+            {
+                zr->frameStart = zr->inputOffset + zr->input.pos;
+            }
+            zr->output.pos  = 0;
+            zr->output.size = zr->outSize;
+            zr->toRead      = ZSTD_decompressStream(zr->dstream, output, &zr->input); /* toRead: size of next compressed block */
+            if (ZSTD_isError(zr->toRead))
+            {
+                if (!zr->salvage)
+                {
+                    zstd_reader_fail(zr, "ZSTD_decompressStream()", zr->toRead);
+                    return got;
+                }
+                if (zstd_reader_resync(zr, stream) != 0)
+                {
+                    return got;
+                }
+                continue;
+            }
+            zr->inFrame    = zr->toRead != 0;
+            zr->outPending = output->pos == output->size;
+            zr->outPtr     = zr->output.dst;
+            zr->outPtrLen  = zr->output.pos;
+            got           += direct.pos;
+            // if that was an empty frame (or the beginning of the zst stream), just go on
+            continue;
+        }
+
+        // nope we don't, alright, decompress a new chunk then
+        if (zr->toRead == 0)
         {
             // the current stream is over, but maybe we have additional streams
             // concatenated back-to-back in the file, such as when --append is used?
-            ZSTD_freeDStream(dstream);
-            dstream = ZSTD_createDStream();
-            toRead  = ZSTD_initDStream(dstream);
+            ZSTD_freeDStream(zr->dstream);
+            zr->dstream = ZSTD_createDStream();
+            zr->toRead  = ZSTD_initDStream(zr->dstream);
         }
 
-        size_t read = fread((void *)input.src, 1, toRead, stream);
+        // when salvaging, stick to what zstd asks for: given one block at a time, it can't decode
+        // good ones along with a damaged one in the same call, and lose them with it on error
+        size_t want = ZSTD_READ_BUFFER_SIZE;
+        if (zr->salvage)
+        {
+            zr->inputOffset = ftell(stream);
+            want            = zr->toRead;
+        }
+        size_t read = fread((void *)zr->input.src, 1, want, stream);
         if (read == 0)
         {
-            // eof or error, return it
-            return 0;
+            // eof or error, return what we have
+            if (zr->inFrame)
+            {
+                zr->damage.truncated = 1;
+            }
+            return got;
         }
-        input.size = read;
-        input.pos  = 0;
-        goto DECOMPRESS;
+        zr->input.size = read;
+        zr->input.pos  = 0;
     }
+    return got;
+}
+
+
+/*
+ * Get the next len decompressed bytes into ptr, or just drop them if ptr is NULL.
+ * Returns 1 if we got them all, 0 on EOF or error.
+ */
+int zstd_reader_read(ZstdReader *zr, void *ptr, size_t len, FILE *stream)
+{
+    return zstd_reader_fill(zr, ptr, len, stream) == len;
+}
+
+
+// as fread(), a short count may come with a partial item, whose bytes are consumed all the same
+size_t fread_wrapper_zstd(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    return zstd_reader_fill(&default_reader, ptr, size * nmemb, stream) / size;
+}
+
+
+/*
+ * Skip len decompressed bytes: they're decompressed as usual (there's no other way to
+ * follow the stream), but never copied out of the decompression buffer.
+ */
+int fskip_wrapper_zstd(FILE *stream, size_t len)
+{
+    return zstd_reader_read(&default_reader, NULL, len, stream) ? 0 : -1;
+}
+
+
+long zstd_find_prev_frame(FILE *fp, long before)
+{
+    // scan backwards from 'before' for a zstd frame magic number, and confirm it's
+    // a frame start by having libzstd parse the frame header that follows it
+    unsigned char buf[ZSTD_SCAN_CHUNK_SIZE + ZSTD_FRAME_HEADER_MAX_SIZE];
+    long          end = before;
+
+    while (end > 0 && before - end < ZSTD_MAX_SCAN_DISTANCE)
+    {
+        long start = end > ZSTD_SCAN_CHUNK_SIZE ? end - ZSTD_SCAN_CHUNK_SIZE : 0;
+        if (fseek(fp, start, SEEK_SET) != 0)
+        {
+            return -1;
+        }
+
+        // also read a few bytes past 'end', to be able to parse a header starting right before it
+        size_t want = end - start + ZSTD_FRAME_HEADER_MAX_SIZE;
+        if ((long)want > before - start)
+        {
+            want = before - start;
+        }
+        size_t got = fread(buf, 1, want, fp);
+
+        for (long i = end - start - 1; i >= 0; i--)
+        {
+            if ((size_t)i + 4 > got)
+            {
+                continue;
+            }
+            if ((buf[i] == 0x28) && (buf[i + 1] == 0xb5) && (buf[i + 2] == 0x2f) && (buf[i + 3] == 0xfd) &&
+                (ZSTD_getFrameContentSize(buf + i, got - i) != ZSTD_CONTENTSIZE_ERROR))
+            {
+                return start + i;
+            }
+        }
+        end = start;
+    }
+    return -1;
+}
+
+
+size_t zstd_decompress_frame(FILE *fp, long offset, void *dst, size_t dstSize)
+{
+    // decompress the single frame starting at 'offset' into dst, stopping at the end
+    // of the frame, at EOF (frame still being written), or once dst is full
+    ZSTD_DStream   *ds    = ZSTD_createDStream();
+    void           *inBuf = malloc(ZSTD_DStreamInSize());
+    ZSTD_outBuffer output = { dst, dstSize, 0 };
+    size_t         ret    = 1;
+
+    if ((ds == NULL) || (inBuf == NULL) || (fseek(fp, offset, SEEK_SET) != 0))
+    {
+        goto out;
+    }
+    ZSTD_initDStream(ds);
+
+    while (ret != 0 && output.pos < output.size)
+    {
+        size_t read = fread(inBuf, 1, ZSTD_DStreamInSize(), fp);
+        if (read == 0)
+        {
+            break;
+        }
+        ZSTD_inBuffer input = { inBuf, read, 0 };
+        while (input.pos < input.size && output.pos < output.size)
+        {
+            ret = ZSTD_decompressStream(ds, &output, &input);
+            if (ZSTD_isError(ret) || (ret == 0))
+            {
+                // corrupt data, or end of frame: either way, we're done
+                goto out;
+            }
+        }
+    }
+
+out:
+    free(inBuf);
+    ZSTD_freeDStream(ds);
+    return output.pos;
+}
+
+
+/*
+ * Decompress the whole frame starting at 'offset', handing its content to cb as it comes.
+ * Returns the compressed size of the frame, so that the next one starts right after it;
+ * 0 if there's no frame there (EOF), or -1 if it's corrupt or truncated, in which case cb
+ * got whatever could be decompressed. Skippable frames have no content, but a size.
+ */
+long zstd_walk_frame(FILE *fp, long offset, ZstdFrameCallback cb, void *arg)
+{
+    ZSTD_DStream   *ds      = ZSTD_createDStream();
+    size_t         inSize   = ZSTD_DStreamInSize();
+    size_t         outSize  = ZSTD_DStreamOutSize();
+    void           *inBuf   = malloc(inSize);
+    void           *outBuf  = malloc(outSize);
+    long           consumed = 0;
+    long           ret      = -1;
+    ZSTD_inBuffer  input    = { inBuf, 0, 0 };
+    ZSTD_outBuffer output   = { outBuf, outSize, 0 };
+
+    if ((ds == NULL) || (inBuf == NULL) || (outBuf == NULL) || (fseek(fp, offset, SEEK_SET) != 0))
+    {
+        goto out;
+    }
+    ZSTD_initDStream(ds);
+
+    while (1)
+    {
+        if (input.pos == input.size)
+        {
+            consumed  += input.size;
+            input.size = fread(inBuf, 1, inSize, fp);
+            input.pos  = 0;
+            if (input.size == 0)
+            {
+                // the frame may still hold data that didn't fit in the output buffer last time
+                if (output.pos < output.size)
+                {
+                    ret = consumed == 0 ? 0 : -1;
+                    goto out;
+                }
+            }
+        }
+
+        output.pos = 0;
+        size_t hint = ZSTD_decompressStream(ds, &output, &input);
+        if (ZSTD_isError(hint))
+        {
+            goto out;
+        }
+        if (output.pos > 0)
+        {
+            cb(outBuf, output.pos, arg);
+        }
+        if (hint == 0)
+        {
+            ret = consumed + input.pos;
+            goto out;
+        }
+    }
+
+out:
+    free(outBuf);
+    free(inBuf);
+    ZSTD_freeDStream(ds);
+    return ret;
 }
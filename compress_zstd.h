@@ -3,11 +3,53 @@
 
 #include <stdio.h>
 
+#include "compress.h"
+
 #define ZSTD_MAX_FLUSH_SECONDS_DEFAULT    15
 
+// the writer closes its current frame and starts a new one after this many uncompressed bytes
+#define ZSTD_MAX_FRAME_INPUT_SIZE         (4 * 1024 * 1024)
+
+// compressed data is read by chunks of this size, rather than a block at a time as zstd suggests
+#define ZSTD_READ_BUFFER_SIZE             (1024 * 1024)
+
+// zstd_find_prev_frame() reads backwards by chunks of this size, and gives up after that distance
+#define ZSTD_SCAN_CHUNK_SIZE              (64 * 1024)
+#define ZSTD_MAX_SCAN_DISTANCE            (64 * 1024 * 1024)
+#define ZSTD_FRAME_HEADER_MAX_SIZE        18
+
+typedef struct zstd_writer ZstdWriter;
+typedef struct zstd_reader ZstdReader;
+
+// gets the decompressed content of a frame, see zstd_walk_frame()
+typedef void (*ZstdFrameCallback)(const void *buf, size_t len, void *arg);
+
+ZstdWriter *zstd_writer_new(void);
+void zstd_writer_free(ZstdWriter *zw);
+void zstd_writer_set_level(ZstdWriter *zw, long level);
+int zstd_writer_set_long(ZstdWriter *zw);
+int zstd_writer_error(ZstdWriter *zw);
+size_t zstd_writer_write(ZstdWriter *zw, const void *ptr, size_t len, FILE *stream);
+int zstd_writer_flush(ZstdWriter *zw, FILE *fp);
+long zstd_writer_flush_due(ZstdWriter *zw);
+void zstd_writer_end(ZstdWriter *zw, FILE *fp);
+ZstdReader *zstd_reader_new(void);
+void zstd_reader_reset(ZstdReader *zr);
+void zstd_reader_free(ZstdReader *zr);
+void zstd_reader_salvage(ZstdReader *zr);
+void zstd_reader_damage(ZstdReader *zr, ReaderDamage *damage);
+int zstd_reader_error(ZstdReader *zr);
+size_t zstd_reader_fill(ZstdReader *zr, void *ptr, size_t len, FILE *stream);
+int zstd_reader_read(ZstdReader *zr, void *ptr, size_t len, FILE *stream);
 size_t fread_wrapper_zstd(void *ptr, size_t size, size_t nmemb, FILE *stream);
+int fskip_wrapper_zstd(FILE *stream, size_t len);
 size_t fwrite_wrapper_zstd(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 int fclose_wrapper_zstd(FILE *fp);
+void zstd_end_stream(FILE *fp);
+void zstd_reset_stream(void);
 void zstd_set_max_flush(long seconds);
+long zstd_find_prev_frame(FILE *fp, long before);
+size_t zstd_decompress_frame(FILE *fp, long offset, void *dst, size_t dstSize);
+long zstd_walk_frame(FILE *fp, long offset, ZstdFrameCallback cb, void *arg);
 
 #endif
@@ -56,29 +56,19 @@
              (((unsigned int)(val) & (unsigned int)0x00ff0000U) >> 8) |  \
              (((unsigned int)(val) & (unsigned int)0xff000000U) >> 24)))
 
+/*
+ * Not cached in a static: headers are decoded from several threads at once by
+ * some tools, and the compiler folds this to a constant anyway.
+ */
 static int is_little_endian(void)
 {
-    static int retval = -1;
-
-    if (retval == -1)
-    {
-        int  n   = 1;
-        char *p  = (char *)&n;
-        char x[] = { 1, 0, 0, 0 };
-
-        _Static_assert(sizeof(int) == 4, "Check relies on int size");
+    int  n   = 1;
+    char *p  = (char *)&n;
+    char x[] = { 1, 0, 0, 0 };
 
-        if (memcmp(p, x, 4) == 0)
-        {
-            retval = 1;
-        }
-        else
-        {
-            retval = 0;
-        }
-    }
+    _Static_assert(sizeof(int) == 4, "Check relies on int size");
 
-    return retval;
+    return memcmp(p, x, 4) == 0;
 }
 
 
@@ -95,20 +85,55 @@ static uint32_t convert_to_little_endian(uint32_t x)
 }
 
 
+void decode_header(const void *buf, Header *h)
+{
+    uint32_t raw[3], raw_usec;
+
+    memcpy(raw, buf, sizeof(raw));
+    raw_usec      = convert_to_little_endian(raw[1]);
+    h->tv.tv_sec  = convert_to_little_endian(raw[0]) | ((raw_usec & 0xfff00000ull) << 12);
+    h->tv.tv_usec = raw_usec & 0x000fffffU;
+    h->len        = convert_to_little_endian(raw[2]);
+}
+
+
+void encode_header(void *buf, Header *h)
+{
+    uint32_t raw[3];
+
+    // The reasonable range of tv_usec is [0, 999999], which is [0, 0x00`0F`42`3F]
+    // Thus, we can stuff 3 nibbles from tv_sec into the top bits, giving us a range of dates up to around year 559444
+    raw[0] = convert_to_little_endian(h->tv.tv_sec & 0xffffffffU);
+    raw[1] = convert_to_little_endian(h->tv.tv_usec | ((h->tv.tv_sec & 0x00000fff00000000ull) >> 12));
+    raw[2] = convert_to_little_endian(h->len);
+    memcpy(buf, raw, sizeof(raw));
+}
+
+
 int read_header(FILE *fp, Header *h)
 {
-    uint32_t buf[3], raw_usec;
+    uint32_t buf[3];
 
     if (fread_wrapper(buf, sizeof(uint32_t), 3, fp) != 3)
     {
         return 0;
     }
 
-    raw_usec      = convert_to_little_endian(buf[1]);
-    h->tv.tv_sec  = convert_to_little_endian(buf[0]) | ((raw_usec & 0xfff00000ull) << 12);
-    h->tv.tv_usec = raw_usec & 0x000fffffU;
-    h->len        = convert_to_little_endian(buf[2]);
+    decode_header(buf, h);
+    return 1;
+}
+
+
+int reader_header(Reader *r, Header *h)
+{
+    uint32_t buf[3];
+
+    if (reader_read(r, buf, sizeof(buf)) == 0)
+    {
+        return 0;
+    }
 
+    decode_header(buf, h);
     return 1;
 }
 
@@ -117,12 +142,7 @@ int write_header(FILE *fp, Header *h)
 {
     uint32_t buf[3];
 
-    // The reasonable range of tv_usec is [0, 999999], which is [0, 0x00`0F`42`3F]
-    // Thus, we can stuff 3 nibbles from tv_sec into the top bits, giving us a range of dates up to around year 559444
-    buf[0] = convert_to_little_endian(h->tv.tv_sec & 0xffffffffU);
-    buf[1] = convert_to_little_endian(h->tv.tv_usec | ((h->tv.tv_sec & 0x00000fff00000000ull) >> 12));
-    buf[2] = convert_to_little_endian(h->len);
-
+    encode_header(buf, h);
     if (fwrite_wrapper(buf, sizeof(uint32_t), 3, fp) == 0)
     {
         return 0;
@@ -132,6 +152,67 @@ int write_header(FILE *fp, Header *h)
 }
 
 
+int write_record(FILE *fp, Header *h, const char *buf)
+{
+    char rec[HEADER_SIZE + BUFSIZ];
+
+    if (h->len > BUFSIZ)
+    {
+        // too big for our stack buffer, but still to be handed over in one call, see below
+        char *big = malloc(HEADER_SIZE + h->len);
+        int  ret;
+
+        if (big == NULL)
+        {
+            return 0;
+        }
+        encode_header(big, h);
+        memcpy(big + HEADER_SIZE, buf, h->len);
+        ret = fwrite_wrapper(big, 1, HEADER_SIZE + h->len, fp) != 0;
+        free(big);
+        return ret;
+    }
+
+    // hand the header and the payload to the compression layer in one call,
+    // so that it can only cut its frames between two records
+    encode_header(rec, h);
+    memcpy(rec + HEADER_SIZE, buf, h->len);
+    if (fwrite_wrapper(rec, 1, HEADER_SIZE + h->len, fp) == 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* same as write_record(), returns 1 on success, 0 on error */
+int writer_record(Writer *w, Header *h, const char *buf)
+{
+    char rec[HEADER_SIZE + BUFSIZ];
+
+    if (h->len > BUFSIZ)
+    {
+        char *big = malloc(HEADER_SIZE + h->len);
+        int  ret;
+
+        if (big == NULL)
+        {
+            return 0;
+        }
+        encode_header(big, h);
+        memcpy(big + HEADER_SIZE, buf, h->len);
+        ret = writer_write(w, big, HEADER_SIZE + h->len) == 0;
+        free(big);
+        return ret;
+    }
+
+    encode_header(rec, h);
+    memcpy(rec + HEADER_SIZE, buf, h->len);
+    return writer_write(w, rec, HEADER_SIZE + h->len) == 0;
+}
+
+
 static const char *progname = "";
 void set_progname(const char *name)
 {
@@ -2,9 +2,15 @@
 #define __TTYREC_IO_H__
 
 #include "ttyrec.h"
+#include "compress.h"
 
+void decode_header(const void *buf, Header *h);
+void encode_header(void *buf, Header *h);
 int read_header(FILE *fp, Header *h);
+int reader_header(Reader *r, Header *h);
 int write_header(FILE *fp, Header *h);
+int write_record(FILE *fp, Header *h, const char *buf);
+int writer_record(Writer *w, Header *h, const char *buf);
 FILE *efopen(const char *path, const char *mode);
 int edup(int oldfd);
 int edup2(int oldfd, int newfd);
@@ -0,0 +1,335 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * The public API of libttyrec, see libttyrec.h: a thin layer over the per-stream
+ * readers and writers of compress.c, which turns their failures into error codes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libttyrec.h"
+#include "ttyrec.h"
+#include "io.h"
+#include "compress.h"
+#include "configure.h"
+
+/*
+ * All files go through a Reader, and their records through buf. They're never mapped:
+ * another process truncating the file (rotating or repacking it) would get us a SIGBUS.
+ */
+struct ttyrec_reader
+{
+    Reader *reader;
+    char   *buf;
+    size_t bufSize;
+    int    error;       // once set, returned by all the next calls
+};
+
+struct ttyrec_writer
+{
+    Writer *writer;
+    int    error;       // same
+};
+
+
+const char *ttyrec_strerror(int error)
+{
+    switch (error)
+    {
+    case TTYREC_OK:
+        return "success";
+
+    case TTYREC_EOF:
+        return "end of file";
+
+    case TTYREC_ERR_IO:
+        return "input/output error";
+
+    case TTYREC_ERR_NOMEM:
+        return "out of memory";
+
+    case TTYREC_ERR_UNSUPPORTED:
+        return "unsupported compression mode";
+
+    case TTYREC_ERR_CORRUPT:
+        return "corrupt recording";
+
+    case TTYREC_ERR_TRUNCATED:
+        return "truncated recording";
+
+    case TTYREC_ERR_INVALID:
+        return "invalid argument";
+
+    default:
+        return "unknown error";
+    }
+}
+
+
+static void set_error(int *error, int value)
+{
+    if (error != NULL)
+    {
+        *error = value;
+    }
+}
+
+
+// without zstd, we can't do anything with zstd-compressed files: don't even try
+static int mode_supported(compress_mode_t cm)
+{
+#ifdef HAVE_zstd
+    return (cm == COMPRESS_NONE) || (cm == COMPRESS_ZSTD);
+#else
+    return cm == COMPRESS_NONE;
+#endif
+}
+
+
+TtyrecReader *ttyrec_reader_open(const char *path, int *error)
+{
+    TtyrecReader    *tr;
+    FILE            *fp;
+    compress_mode_t cm;
+
+    if (path == NULL)
+    {
+        set_error(error, TTYREC_ERR_INVALID);
+        return NULL;
+    }
+    fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        set_error(error, TTYREC_ERR_IO);
+        return NULL;
+    }
+    tr = calloc(1, sizeof(*tr));
+    if (tr == NULL)
+    {
+        fclose(fp);
+        set_error(error, TTYREC_ERR_NOMEM);
+        return NULL;
+    }
+
+    cm = detect_compress_mode(path, fp);
+    if (!mode_supported(cm))
+    {
+        fclose(fp);
+        free(tr);
+        set_error(error, TTYREC_ERR_UNSUPPORTED);
+        return NULL;
+    }
+    tr->reader = reader_new(fp, cm);
+    if (tr->reader == NULL)
+    {
+        fclose(fp);
+        free(tr);
+        set_error(error, TTYREC_ERR_NOMEM);
+        return NULL;
+    }
+    return tr;
+}
+
+
+static int check_header(const Header *h)
+{
+    return (h->len >= 0) && (h->len <= MAX_RECORD_LEN) ? TTYREC_OK : TTYREC_ERR_CORRUPT;
+}
+
+
+// what to make of a short read, at the start of a record (got == 0) or within one
+static int stream_error(TtyrecReader *tr, size_t got)
+{
+    switch (reader_error(tr->reader))
+    {
+    case -1:
+        return TTYREC_ERR_IO;
+
+    case 1:
+        return TTYREC_ERR_CORRUPT;
+
+    default:
+        return got == 0 ? TTYREC_EOF : TTYREC_ERR_TRUNCATED;
+    }
+}
+
+
+static int next_stream(TtyrecReader *tr, TtyrecRecord *rec)
+{
+    char   buf[HEADER_SIZE];
+    size_t got = reader_fill(tr->reader, buf, sizeof(buf));
+    Header h;
+
+    if (got < sizeof(buf))
+    {
+        return stream_error(tr, got);
+    }
+    decode_header(buf, &h);
+    if (check_header(&h) != TTYREC_OK)
+    {
+        return TTYREC_ERR_CORRUPT;
+    }
+
+    if ((size_t)h.len > tr->bufSize)
+    {
+        char *p = realloc(tr->buf, h.len);
+        if (p == NULL)
+        {
+            return TTYREC_ERR_NOMEM;
+        }
+        tr->buf     = p;
+        tr->bufSize = h.len;
+    }
+    got = reader_fill(tr->reader, tr->buf, h.len);
+    if (got < (size_t)h.len)
+    {
+        int ret = stream_error(tr, got);
+        return ret == TTYREC_EOF ? TTYREC_ERR_TRUNCATED : ret;
+    }
+
+    rec->tv   = h.tv;
+    rec->data = h.len > 0 ? tr->buf : "";
+    rec->len  = h.len;
+    return TTYREC_OK;
+}
+
+
+int ttyrec_reader_next(TtyrecReader *tr, TtyrecRecord *rec)
+{
+    if ((tr == NULL) || (rec == NULL))
+    {
+        return TTYREC_ERR_INVALID;
+    }
+    if (tr->error == TTYREC_OK)
+    {
+        tr->error = next_stream(tr, rec);
+        if (tr->error == TTYREC_OK)
+        {
+            return TTYREC_OK;
+        }
+    }
+    return tr->error;
+}
+
+
+int ttyrec_reader_close(TtyrecReader *tr)
+{
+    int ret = TTYREC_OK;
+
+    if (tr == NULL)
+    {
+        return TTYREC_ERR_INVALID;
+    }
+    if (reader_close(tr->reader) != 0)
+    {
+        ret = TTYREC_ERR_IO;
+    }
+    free(tr->buf);
+    free(tr);
+    return ret;
+}
+
+
+TtyrecWriter *ttyrec_writer_open(const char *path, int flags, int level, int *error)
+{
+    TtyrecWriter    *tw;
+    FILE            *fp;
+    compress_mode_t cm = (flags & TTYREC_WRITE_ZSTD) ? COMPRESS_ZSTD : COMPRESS_NONE;
+
+    if ((path == NULL) || ((flags & ~(TTYREC_WRITE_ZSTD | TTYREC_WRITE_APPEND)) != 0) || (level < 0))
+    {
+        set_error(error, TTYREC_ERR_INVALID);
+        return NULL;
+    }
+    if (!mode_supported(cm))
+    {
+        set_error(error, TTYREC_ERR_UNSUPPORTED);
+        return NULL;
+    }
+    tw = calloc(1, sizeof(*tw));
+    if (tw == NULL)
+    {
+        set_error(error, TTYREC_ERR_NOMEM);
+        return NULL;
+    }
+    fp = fopen(path, (flags & TTYREC_WRITE_APPEND) ? "a" : "w");
+    if (fp == NULL)
+    {
+        free(tw);
+        set_error(error, TTYREC_ERR_IO);
+        return NULL;
+    }
+    tw->writer = writer_new(fp, cm);
+    if (tw->writer == NULL)
+    {
+        fclose(fp);
+        free(tw);
+        set_error(error, TTYREC_ERR_NOMEM);
+        return NULL;
+    }
+    if (level > 0)
+    {
+        writer_set_level(tw->writer, level);
+    }
+    return tw;
+}
+
+
+int ttyrec_writer_write(TtyrecWriter *tw, const struct timeval *tv, const void *data, size_t len)
+{
+    Header h;
+
+    if ((tw == NULL) || (tv == NULL) || ((data == NULL) && (len > 0)) || (len > MAX_RECORD_LEN))
+    {
+        return TTYREC_ERR_INVALID;
+    }
+    if (tw->error != TTYREC_OK)
+    {
+        return tw->error;
+    }
+    h.tv  = *tv;
+    h.len = (int)len;
+    if (writer_record(tw->writer, &h, data != NULL ? data : "") == 0)
+    {
+        tw->error = TTYREC_ERR_IO;
+    }
+    return tw->error;
+}
+
+
+int ttyrec_writer_flush(TtyrecWriter *tw)
+{
+    if (tw == NULL)
+    {
+        return TTYREC_ERR_INVALID;
+    }
+    if ((tw->error == TTYREC_OK) && (writer_flush(tw->writer) != 0))
+    {
+        tw->error = TTYREC_ERR_IO;
+    }
+    return tw->error;
+}
+
+
+int ttyrec_writer_close(TtyrecWriter *tw)
+{
+    int ret;
+
+    if (tw == NULL)
+    {
+        return TTYREC_ERR_INVALID;
+    }
+    ret = tw->error;
+    if ((writer_close(tw->writer) != 0) && (ret == TTYREC_OK))
+    {
+        ret = TTYREC_ERR_IO;
+    }
+    free(tw);
+    return ret;
+}
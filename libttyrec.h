@@ -0,0 +1,81 @@
+#ifndef __LIBTTYREC_H__
+#define __LIBTTYREC_H__
+
+/*
+ * libttyrec: read and write ttyrec recordings, compressed or not, from another
+ * program. Nothing here ever exits or prints: every failure is returned as one
+ * of the codes below, and every handle is independent of the others, so that
+ * different threads can each use their own.
+ */
+
+#include <stddef.h>
+#include <sys/time.h>
+
+#if defined(__GNUC__)
+# define TTYREC_API    __attribute__((visibility("default")))
+#else
+# define TTYREC_API
+#endif
+
+typedef enum
+{
+    TTYREC_OK              = 0,
+    TTYREC_EOF             = 1,  // no more records
+    TTYREC_ERR_IO          = -1, // see errno
+    TTYREC_ERR_NOMEM       = -2,
+    TTYREC_ERR_UNSUPPORTED = -3, // compressed in a way this build can't handle
+    TTYREC_ERR_CORRUPT     = -4, // invalid record, or undecompressable data
+    TTYREC_ERR_TRUNCATED   = -5, // the file ends in the middle of a record
+    TTYREC_ERR_INVALID     = -6, // bad argument
+} ttyrec_error_t;
+
+// flags of ttyrec_writer_open()
+#define TTYREC_WRITE_ZSTD      0x1 // compress the records with zstd
+#define TTYREC_WRITE_APPEND    0x2 // add the records at the end of an existing file
+
+typedef struct ttyrec_reader TtyrecReader;
+typedef struct ttyrec_writer TtyrecWriter;
+
+/*
+ * A record, as returned by ttyrec_reader_next(): data points into the reader's
+ * own memory, and is only valid until the next call on the reader.
+ */
+typedef struct ttyrec_record
+{
+    struct timeval tv;
+    const char     *data;
+    size_t         len;
+} TtyrecRecord;
+
+TTYREC_API const char *ttyrec_strerror(int error);
+
+/*
+ * Open a recording, zstd-compressed ones included (recognized from their .zst suffix,
+ * or from their contents). Returns NULL on failure, with the reason in *error.
+ */
+TTYREC_API TtyrecReader *ttyrec_reader_open(const char *path, int *error);
+
+/*
+ * Get the next record, returns TTYREC_OK, TTYREC_EOF after the last one, or an error
+ * (which is then returned again by all the next calls).
+ */
+TTYREC_API int ttyrec_reader_next(TtyrecReader *r, TtyrecRecord *rec);
+TTYREC_API int ttyrec_reader_close(TtyrecReader *r);
+
+/*
+ * Create (or with TTYREC_WRITE_APPEND, extend) a recording. Returns NULL on failure,
+ * with the reason in *error. level is the zstd compression level, 0 for the default.
+ */
+TTYREC_API TtyrecWriter *ttyrec_writer_open(const char *path, int flags, int level, int *error);
+TTYREC_API int ttyrec_writer_write(TtyrecWriter *w, const struct timeval *tv, const void *data, size_t len);
+
+/*
+ * Hand the records written so far to the kernel, compressed ones included: until then,
+ * they may only be in our buffers, or in zstd's.
+ */
+TTYREC_API int ttyrec_writer_flush(TtyrecWriter *w);
+
+// flushes, then closes: returns an error if any of the records couldn't be written
+TTYREC_API int ttyrec_writer_close(TtyrecWriter *w);
+
+#endif
@@ -0,0 +1,484 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * Live view of a session: ttyrec publishes the records it writes into a named
+ * shared-memory ring, that any number of viewers (ttyplay --shm) map read-only.
+ * They get the recent output right from memory, without any disk I/O, and are
+ * woken up as soon as a record is published.
+ *
+ * The ring holds ttyrec records, header included, one after the other, wrapping
+ * around at its end. head and tail only ever grow: the next record is written at
+ * head, and the oldest whole one starts at tail. The writer never waits on anybody:
+ * to make room, it moves tail past the oldest records, then overwrites them. It
+ * does so within a seqlock (seq is odd meanwhile), which lets the viewers take a
+ * consistent snapshot of head and tail, and is also the futex they sleep on.
+ * A viewer copies a record out of the ring, then checks tail again: if tail went
+ * past the record meanwhile, the copy may be garbage, and the viewer skips to the
+ * new tail. A slow viewer loses records, the recorder never notices it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "configure.h"
+#include "live.h"
+#include "io.h"
+
+#ifdef HAVE_futex
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+
+#ifndef HAVE_shm_open
+// then there's no ring to create or attach to
+# define shm_open(name, flags, mode)    (errno = ENOSYS, -1)
+# define shm_unlink(name)               (errno = ENOSYS, -1)
+#endif
+
+#define LIVE_MAGIC      0x4C595454U // "TTYL"
+#define LIVE_VERSION    1
+
+// how long a viewer sleeps before checking that the recorder is still there, in ms
+#define LIVE_WAIT_MS    1000
+
+typedef struct live_ring
+{
+    uint32_t magic;   // set last, once the rest is ready
+    uint32_t version;
+    uint64_t size;    // of data[]
+    uint64_t head;    // bytes ever written: the next record goes at head % size
+    uint64_t tail;    // the oldest whole record is at tail % size
+    uint32_t seq;     // seqlock, odd while the writer moves head and tail
+    uint32_t closed;  // the recorder is done
+    int32_t  pid;     // of the recorder, to tell one that died from a quiet one
+    uint32_t unused;
+    char     data[];
+} LiveRing;
+
+struct live
+{
+    LiveRing *ring;
+    size_t   mapSize;
+    char     *name;     // writer only, to remove the ring in live_close()
+    uint64_t head;      // writer only, our own copies of the ring's
+    uint64_t tail;
+    uint32_t seq;
+    uint64_t pos;       // viewer only, where its next record starts
+    char     *buf;      // viewer only, the last record it read
+    size_t   bufSize;
+};
+
+
+// shm_open() names start with a slash, don't make our users type it
+static char *shm_name(const char *name)
+{
+    size_t len = strlen(name);
+    char   *s  = malloc(len + 2);
+
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    s[0] = '/';
+    memcpy(s + 1, name[0] == '/' ? name + 1 : name, name[0] == '/' ? len : len + 1);
+    return s;
+}
+
+
+static void ring_put(LiveRing *r, uint64_t pos, const char *src, size_t len)
+{
+    size_t off   = pos % r->size;
+    size_t first = r->size - off < len ? r->size - off : len;
+
+    memcpy(r->data + off, src, first);
+    memcpy(r->data, src + first, len - first);
+}
+
+
+static void ring_get(const LiveRing *r, uint64_t pos, char *dst, size_t len)
+{
+    size_t off   = pos % r->size;
+    size_t first = r->size - off < len ? r->size - off : len;
+
+    memcpy(dst, r->data + off, first);
+    memcpy(dst + first, r->data, len - first);
+}
+
+
+static void ring_wake(LiveRing *r)
+{
+#ifdef HAVE_futex
+    (void)syscall(SYS_futex, &r->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)r;
+#endif
+}
+
+
+/*
+ * Wait for the writer to publish something, seq being what we last saw. Returns 0
+ * if it looks like it's gone without closing the ring (killed).
+ */
+static int ring_wait(const LiveRing *r, uint32_t seq)
+{
+#ifdef HAVE_futex
+    struct timespec ts = { LIVE_WAIT_MS / 1000, (LIVE_WAIT_MS % 1000) * 1000000L };
+
+    // a futex works on a read-only mapping too, as long as we only wait on it
+    if ((syscall(SYS_futex, &r->seq, FUTEX_WAIT, seq, &ts, NULL, 0) == 0) || (errno != ETIMEDOUT))
+    {
+        return 1;
+    }
+#else
+    static unsigned int naps = 0;
+    struct timespec     ts   = { 0, 1000000L };
+
+    (void)seq;
+    nanosleep(&ts, NULL);
+    if (++naps % LIVE_WAIT_MS != 0)
+    {
+        return 1;
+    }
+#endif
+    return (kill(r->pid, 0) == 0) || (errno != ESRCH);
+}
+
+
+// a ring nobody writes to any more, left behind by a recorder that was killed
+static int ring_stale(const char *shmname)
+{
+    int         fd = shm_open(shmname, O_RDONLY, 0);
+    struct stat st;
+    LiveRing    *r;
+    int         stale = 0;
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+    if ((fstat(fd, &st) == 0) && ((size_t)st.st_size >= sizeof(LiveRing)))
+    {
+        r = mmap(NULL, sizeof(LiveRing), PROT_READ, MAP_SHARED, fd, 0);
+        if (r != MAP_FAILED)
+        {
+            stale = (r->magic == LIVE_MAGIC) && (kill(r->pid, 0) == -1) && (errno == ESRCH);
+            munmap(r, sizeof(LiveRing));
+        }
+    }
+    close(fd);
+    return stale;
+}
+
+
+Live *live_create(const char *name, size_t size)
+{
+    Live *l = calloc(1, sizeof(*l));
+    int  fd = -1;
+    int  saved_errno;
+
+    if (l == NULL)
+    {
+        return NULL;
+    }
+    l->name = shm_name(name);
+    if (l->name == NULL)
+    {
+        free(l);
+        return NULL;
+    }
+    fd = shm_open(l->name, O_RDWR | O_CREAT | O_EXCL, 0640);
+    if ((fd < 0) && (errno == EEXIST) && ring_stale(l->name))
+    {
+        (void)shm_unlink(l->name);
+        fd = shm_open(l->name, O_RDWR | O_CREAT | O_EXCL, 0640);
+    }
+    if (fd < 0)
+    {
+        goto err;
+    }
+
+    l->mapSize = sizeof(LiveRing) + size;
+    if (ftruncate(fd, l->mapSize) != 0)
+    {
+        goto err;
+    }
+    l->ring = mmap(NULL, l->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (l->ring == MAP_FAILED)
+    {
+        goto err;
+    }
+    close(fd);
+
+    l->ring->version = LIVE_VERSION;
+    l->ring->size    = size;
+    l->ring->pid     = (int32_t)getpid();
+    __atomic_store_n(&l->ring->magic, LIVE_MAGIC, __ATOMIC_RELEASE);
+    return l;
+
+err:
+    saved_errno = errno;
+    if (fd >= 0)
+    {
+        close(fd);
+        (void)shm_unlink(l->name);
+    }
+    free(l->name);
+    free(l);
+    errno = saved_errno;
+    return NULL;
+}
+
+
+void live_write(Live *l, const Header *h, const char *buf)
+{
+    LiveRing *r   = l->ring;
+    Header   copy = *h;
+    char     hdr[HEADER_SIZE];
+    uint64_t len  = HEADER_SIZE + (uint64_t)h->len;
+
+    if (len > r->size / 2)
+    {
+        // it would leave the viewers hardly anything else, they'll do without it
+        return;
+    }
+    encode_header(hdr, &copy);
+
+    __atomic_store_n(&r->seq, ++l->seq, __ATOMIC_RELAXED);
+    while (l->head + len - l->tail > r->size)
+    {
+        Header old;
+        char   oldhdr[HEADER_SIZE];
+
+        ring_get(r, l->tail, oldhdr, HEADER_SIZE);
+        decode_header(oldhdr, &old);
+        l->tail += HEADER_SIZE + old.len;
+    }
+    __atomic_store_n(&r->tail, l->tail, __ATOMIC_RELAXED);
+    // the new tail must be visible before we overwrite what it no longer covers
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    ring_put(r, l->head, hdr, HEADER_SIZE);
+    ring_put(r, l->head + HEADER_SIZE, buf, h->len);
+    l->head += len;
+    __atomic_store_n(&r->head, l->head, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->seq, ++l->seq, __ATOMIC_RELEASE);
+    ring_wake(r);
+}
+
+
+void live_close(Live *l)
+{
+    if (l == NULL)
+    {
+        return;
+    }
+    __atomic_store_n(&l->ring->closed, 1, __ATOMIC_RELEASE);
+    // even if we're interrupted in the middle of live_write(), seq must end up even
+    l->seq = (l->seq + 2) & ~1U;
+    __atomic_store_n(&l->ring->seq, l->seq, __ATOMIC_RELEASE);
+    ring_wake(l->ring);
+    (void)shm_unlink(l->name);
+    munmap(l->ring, l->mapSize);
+    free(l->name);
+    free(l);
+}
+
+
+/*
+ * Copy len bytes at pos out of the ring, returns 0 if they were (maybe) overwritten
+ * meanwhile, with *tail updated.
+ */
+static int ring_copy(const LiveRing *r, uint64_t pos, char *dst, size_t len, uint64_t *tail)
+{
+    ring_get(r, pos, dst, len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    *tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    return pos >= *tail;
+}
+
+
+// a consistent view of where the records start and end
+static void ring_snapshot(const LiveRing *r, uint64_t *head, uint64_t *tail)
+{
+    uint32_t seq;
+
+    do
+    {
+        seq   = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        *head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        *tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || (seq != __atomic_load_n(&r->seq, __ATOMIC_RELAXED)));
+}
+
+
+// length of the record at pos, header included, or 0 if it was overwritten meanwhile
+static uint64_t record_length(const LiveRing *r, uint64_t pos, Header *h, uint64_t *tail)
+{
+    char hdr[HEADER_SIZE];
+
+    if (!ring_copy(r, pos, hdr, HEADER_SIZE, tail))
+    {
+        return 0;
+    }
+    decode_header(hdr, h);
+    if ((h->len < 0) || ((uint64_t)h->len > r->size / 2))
+    {
+        // can't be, unless the writer is already past it
+        return 0;
+    }
+    return HEADER_SIZE + h->len;
+}
+
+
+Live *live_attach(const char *name, size_t context)
+{
+    Live        *l = calloc(1, sizeof(*l));
+    char        *shmname;
+    int         fd;
+    struct stat st;
+    uint64_t    head, tail;
+    int         saved_errno;
+
+    if (l == NULL)
+    {
+        return NULL;
+    }
+    shmname = shm_name(name);
+    if (shmname == NULL)
+    {
+        free(l);
+        return NULL;
+    }
+    fd          = shm_open(shmname, O_RDONLY, 0);
+    saved_errno = errno;
+    free(shmname);
+    if (fd < 0)
+    {
+        free(l);
+        errno = saved_errno;
+        return NULL;
+    }
+    if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(LiveRing)))
+    {
+        close(fd);
+        free(l);
+        errno = EINVAL;
+        return NULL;
+    }
+    l->mapSize  = st.st_size;
+    l->ring     = mmap(NULL, l->mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    saved_errno = errno;
+    close(fd);
+    if (l->ring == MAP_FAILED)
+    {
+        free(l);
+        errno = saved_errno;
+        return NULL;
+    }
+    if ((__atomic_load_n(&l->ring->magic, __ATOMIC_ACQUIRE) != LIVE_MAGIC) || (l->ring->version != LIVE_VERSION) ||
+        (l->ring->size != l->mapSize - sizeof(LiveRing)))
+    {
+        live_detach(l);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // skip the oldest records, down to the context we were asked for
+    ring_snapshot(l->ring, &head, &tail);
+    l->pos = tail;
+    while (head - l->pos > context)
+    {
+        Header   h;
+        uint64_t len = record_length(l->ring, l->pos, &h, &tail);
+
+        if (len == 0)
+        {
+            l->pos = tail;
+            continue;
+        }
+        l->pos += len;
+    }
+    return l;
+}
+
+
+int live_read(Live *l, Header *h, char **buf, unsigned long long *lost)
+{
+    const LiveRing *r = l->ring;
+
+    for ( ; ;)
+    {
+        uint32_t seq  = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        uint64_t len;
+
+        if (l->pos < tail)
+        {
+            // overwritten before we got to it
+            if (lost != NULL)
+            {
+                *lost += tail - l->pos;
+            }
+            l->pos = tail;
+        }
+        if (l->pos >= head)
+        {
+            if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE) || !ring_wait(r, seq))
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        len = record_length(r, l->pos, h, &tail);
+        if (len == 0)
+        {
+            continue;
+        }
+        if ((size_t)h->len > l->bufSize)
+        {
+            char *p = realloc(l->buf, h->len);
+            if (p == NULL)
+            {
+                return 0;
+            }
+            l->buf     = p;
+            l->bufSize = h->len;
+        }
+        if (!ring_copy(r, l->pos + HEADER_SIZE, l->buf, h->len, &tail))
+        {
+            continue;
+        }
+        l->pos += len;
+        *buf    = l->buf;
+        return 1;
+    }
+}
+
+
+void live_detach(Live *l)
+{
+    if (l == NULL)
+    {
+        return;
+    }
+    munmap(l->ring, l->mapSize);
+    free(l->buf);
+    free(l);
+}
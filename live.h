@@ -0,0 +1,39 @@
+#ifndef __TTYREC_LIVE_H__
+#define __TTYREC_LIVE_H__
+
+#include <stddef.h>
+
+#include "ttyrec.h"
+
+// default size of the ring ttyrec publishes its recent output to, see live_create()
+#define LIVE_DEFAULT_SIZE    (1024 * 1024)
+#define LIVE_MIN_SIZE        (64 * 1024)
+
+typedef struct live Live;
+
+/*
+ * Writer side, used by ttyrec: create the shared-memory ring NAME (of SIZE bytes of
+ * records) and publish records to it. Writing never waits on the viewers: the oldest
+ * records are simply overwritten. Returns NULL with errno set on failure.
+ */
+Live *live_create(const char *name, size_t size);
+void live_write(Live *l, const Header *h, const char *buf);
+
+// tells the viewers we're done, and removes the ring (they keep theirs until they detach)
+void live_close(Live *l);
+
+/*
+ * Viewer side, used by ttyplay: attach to the ring NAME, read-only, and start with
+ * the records of about the last CONTEXT bytes. Returns NULL with errno set on failure.
+ */
+Live *live_attach(const char *name, size_t context);
+
+/*
+ * Get the next record, waiting for it if needed: returns 1 with the record in *h and
+ * *buf (valid until the next call), 0 once the recorder's gone. Records that were
+ * overwritten before we could read them are skipped, and counted in *lost if not NULL.
+ */
+int live_read(Live *l, Header *h, char **buf, unsigned long long *lost);
+void live_detach(Live *l);
+
+#endif
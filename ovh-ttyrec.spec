@@ -50,9 +50,19 @@ rm -rf -- "$RPM_BUILD_ROOT"
 %{_mandir}/man1/ttyplay.*
 %{_mandir}/man1/ttytime.*
 %{_mandir}/man1/ttyrec.*
+%{_mandir}/man1/ttygrep.*
+%{_mandir}/man1/ttycut.*
+%{_mandir}/man1/ttycheck.*
+%{_mandir}/man1/ttypack.*
+%{_mandir}/man1/ttyrecd.*
 %{_bindir}/ttyplay
 %{_bindir}/ttytime
 %{_bindir}/ttyrec
+%{_bindir}/ttygrep
+%{_bindir}/ttycut
+%{_bindir}/ttycheck
+%{_bindir}/ttypack
+%{_bindir}/ttyrecd
 
 %changelog
 * Tue Jun 23 2026 Stéphane Lesimple (deb packages) <stephane.lesimple@corp.ovh.com>   1.2.0.0
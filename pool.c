@@ -0,0 +1,297 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * Helpers for the tools working on many recordings at once: building the
+ * list of files (optionally walking directories), and running a job on each
+ * of them from a pool of threads, with the outputs still written in order.
+ */
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "pool.h"
+#include "summary.h"
+
+// workers don't get further than this many items ahead of the output
+#define POOL_MAX_AHEAD    4096
+
+typedef struct pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;    // a result became available
+    pthread_cond_t  room;     // the output moved forward
+    size_t          count;
+    size_t          next;     // next item to hand to a worker
+    size_t          written;  // number of results already written out
+    char            **results;
+    unsigned char   *done;
+    PoolJob         job;
+    void            *arg;
+} Pool;
+
+
+static int filelist_push(FileList *fl, const char *name)
+{
+    if (fl->count == fl->size)
+    {
+        size_t newsize   = fl->size ? fl->size * 2 : 64;
+        char   **newlist = realloc(fl->names, newsize * sizeof(char *));
+        if (newlist == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        fl->names = newlist;
+        fl->size  = newsize;
+    }
+    fl->names[fl->count] = strdup(name);
+    if (fl->names[fl->count] == NULL)
+    {
+        perror("strdup");
+        return -1;
+    }
+    fl->count++;
+    return 0;
+}
+
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+// summaries of uncompressed recordings found along them aren't recordings themselves
+static int is_sidecar(const char *name)
+{
+    size_t len    = strlen(name);
+    size_t suflen = strlen(SUMMARY_SIDECAR_SUFFIX);
+
+    return (len > suflen) && (strcmp(name + len - suflen, SUMMARY_SIDECAR_SUFFIX) == 0);
+}
+
+
+static int filelist_walk(FileList *fl, const char *dir)
+{
+    DIR           *d = opendir(dir);
+    struct dirent *de;
+    FileList      entries = { NULL, 0, 0 };
+    int           ret     = 0;
+
+    if (d == NULL)
+    {
+        perror(dir);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL)
+    {
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0))
+        {
+            continue;
+        }
+
+        size_t len   = strlen(dir) + strlen(de->d_name) + 2;
+        char   *path = malloc(len);
+        if (path == NULL)
+        {
+            perror("malloc");
+            ret = -1;
+            break;
+        }
+        snprintf(path, len, "%s/%s", dir, de->d_name);
+        ret = filelist_push(&entries, path);
+        free(path);
+        if (ret != 0)
+        {
+            break;
+        }
+    }
+    closedir(d);
+
+    // sorted, so that the output doesn't depend on the order of the directory entries
+    qsort(entries.names, entries.count, sizeof(char *), compare_names);
+    for (size_t i = 0; i < entries.count && ret == 0; i++)
+    {
+        struct stat st;
+
+        // don't follow symlinks here, they could get us into a loop
+        if (lstat(entries.names[i], &st) != 0)
+        {
+            perror(entries.names[i]);
+        }
+        else if (S_ISDIR(st.st_mode))
+        {
+            filelist_walk(fl, entries.names[i]);
+        }
+        else if (S_ISREG(st.st_mode) && !is_sidecar(entries.names[i]))
+        {
+            ret = filelist_push(fl, entries.names[i]);
+        }
+    }
+    filelist_free(&entries);
+    return ret;
+}
+
+
+/*
+ * Add path to the list. If recursive is set and path is a directory, add all
+ * the regular files found under it instead (except summary sidecars), in alphabetical order.
+ * Returns 0 on success, -1 on error.
+ */
+int filelist_add(FileList *fl, const char *path, int recursive)
+{
+    struct stat st;
+
+    if (recursive && (stat(path, &st) == 0) && S_ISDIR(st.st_mode))
+    {
+        return filelist_walk(fl, path);
+    }
+    return filelist_push(fl, path);
+}
+
+
+void filelist_free(FileList *fl)
+{
+    for (size_t i = 0; i < fl->count; i++)
+    {
+        free(fl->names[i]);
+    }
+    free(fl->names);
+    fl->names = NULL;
+    fl->count = 0;
+    fl->size  = 0;
+}
+
+
+static void *pool_worker(void *p)
+{
+    Pool *pool = p;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->count)
+    {
+        size_t i = pool->next;
+        if (i >= pool->written + POOL_MAX_AHEAD)
+        {
+            pthread_cond_wait(&pool->room, &pool->lock);
+            continue;
+        }
+        pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        char *result = pool->job(i, pool->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->results[i] = result;
+        pool->done[i]    = 1;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+/*
+ * Run job on items 0 to count - 1 using up to 'jobs' threads, and write their
+ * outputs to 'out' in the order of the items, as soon as they're available.
+ * Returns 0 on success, -1 on error.
+ */
+int pool_run(size_t count, int jobs, PoolJob job, void *arg, FILE *out)
+{
+    Pool      pool;
+    pthread_t *threads;
+    int       nthreads = 0;
+
+    if ((size_t)jobs > count)
+    {
+        jobs = count;
+    }
+    if (jobs <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            char *result = job(i, arg);
+            if (result != NULL)
+            {
+                fputs(result, out);
+                free(result);
+            }
+        }
+        return 0;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.count   = count;
+    pool.job     = job;
+    pool.arg     = arg;
+    pool.results = calloc(count, sizeof(char *));
+    pool.done    = calloc(count, 1);
+    threads      = calloc(jobs, sizeof(pthread_t));
+    if ((pool.results == NULL) || (pool.done == NULL) || (threads == NULL))
+    {
+        perror("calloc");
+        free(pool.results);
+        free(pool.done);
+        free(threads);
+        return -1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.room, NULL);
+
+    for (int t = 0; t < jobs; t++)
+    {
+        if (pthread_create(&threads[nthreads], NULL, pool_worker, &pool) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        nthreads++;
+    }
+    if (nthreads == 0)
+    {
+        // do it ourselves
+        pool_worker(&pool);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.done[i])
+        {
+            pthread_cond_wait(&pool.ready, &pool.lock);
+        }
+        char *result = pool.results[i];
+        pool.results[i] = NULL;
+        pool.written    = i + 1;
+        pthread_cond_broadcast(&pool.room);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (result != NULL)
+        {
+            fputs(result, out);
+            free(result);
+        }
+    }
+
+    for (int t = 0; t < nthreads; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_cond_destroy(&pool.room);
+    pthread_cond_destroy(&pool.ready);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.results);
+    free(pool.done);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef __TTYREC_POOL_H__
+#define __TTYREC_POOL_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+// list of files to process, see filelist_add()
+typedef struct filelist
+{
+    char   **names;
+    size_t count;
+    size_t size;
+} FileList;
+
+/*
+ * Job run by the pool on the item of index i, returns its output as a
+ * malloc'd string (or NULL for no output).
+ */
+typedef char *(*PoolJob)(size_t i, void *arg);
+
+int filelist_add(FileList *fl, const char *path, int recursive);
+void filelist_free(FileList *fl);
+int pool_run(size_t count, int jobs, PoolJob job, void *arg, FILE *out);
+
+#endif
@@ -0,0 +1,245 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * Summary of a recording (first and last timestamps, number of records and
+ * bytes), written by ttyrec when it closes a file, so that the tools can get
+ * them without reading the whole recording.
+ *
+ * It's stored as a zstd skippable frame, which zstd decoders silently skip:
+ * appended to the file itself for compressed recordings, and in a sidecar file
+ * for uncompressed ones. It also holds the size of the recording it describes,
+ * so that a summary that no longer matches its file (truncated, or appended to
+ * by something that didn't update it) is ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "summary.h"
+
+#define SUMMARY_FRAME_MAGIC    0x184D2A5EU // one of the 16 zstd skippable frame magic numbers
+#define SUMMARY_MAGIC          0x53595454U // "TTYS"
+#define SUMMARY_VERSION        1
+
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = v >> (8 * i);
+    }
+}
+
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        p[i] = v >> (8 * i);
+    }
+}
+
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    uint32_t v = 0;
+
+    for (int i = 3; i >= 0; i--)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+
+    for (int i = 7; i >= 0; i--)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+
+static void encode_summary(unsigned char *buf, const Summary *s)
+{
+    put_le32(buf, SUMMARY_FRAME_MAGIC);
+    put_le32(buf + 4, SUMMARY_SIZE - 8); // size of the skippable frame's payload
+    put_le32(buf + 8, SUMMARY_MAGIC);
+    put_le32(buf + 12, SUMMARY_VERSION);
+    put_le64(buf + 16, s->first.tv_sec);
+    put_le32(buf + 24, s->first.tv_usec);
+    put_le64(buf + 28, s->last.tv_sec);
+    put_le32(buf + 36, s->last.tv_usec);
+    put_le64(buf + 40, s->records);
+    put_le64(buf + 48, s->bytes);
+    put_le64(buf + 56, s->file_size);
+}
+
+
+static int decode_summary(const unsigned char *buf, Summary *s)
+{
+    if ((get_le32(buf) != SUMMARY_FRAME_MAGIC) || (get_le32(buf + 4) != SUMMARY_SIZE - 8) ||
+        (get_le32(buf + 8) != SUMMARY_MAGIC) || (get_le32(buf + 12) != SUMMARY_VERSION))
+    {
+        return 0;
+    }
+    s->first.tv_sec  = get_le64(buf + 16);
+    s->first.tv_usec = get_le32(buf + 24);
+    s->last.tv_sec   = get_le64(buf + 28);
+    s->last.tv_usec  = get_le32(buf + 36);
+    s->records       = get_le64(buf + 40);
+    s->bytes         = get_le64(buf + 48);
+    s->file_size     = get_le64(buf + 56);
+    return 1;
+}
+
+
+void summary_add(Summary *s, const Header *h)
+{
+    if (s->records == 0)
+    {
+        s->first = h->tv;
+    }
+    s->last = h->tv;
+    s->records++;
+    s->bytes += h->len;
+}
+
+
+/* account for the records of next, which come after those of s */
+void summary_merge(Summary *s, const Summary *next)
+{
+    if (next->records == 0)
+    {
+        return;
+    }
+    if (s->records == 0)
+    {
+        s->first = next->first;
+    }
+    s->last     = next->last;
+    s->records += next->records;
+    s->bytes   += next->bytes;
+}
+
+
+/*
+ * Append the summary to fp as a trailer. For a zstd-compressed file, the current
+ * frame must have been ended first. Returns 0 on success, -1 on error.
+ */
+int summary_write_trailer(FILE *fp, Summary *s)
+{
+    struct stat   st;
+    unsigned char buf[SUMMARY_SIZE];
+
+    if ((fflush(fp) != 0) || (fstat(fileno(fp), &st) != 0))
+    {
+        return -1;
+    }
+    s->file_size = st.st_size;
+    encode_summary(buf, s);
+    return fwrite(buf, 1, sizeof(buf), fp) == sizeof(buf) ? 0 : -1;
+}
+
+
+/*
+ * Write the summary of the (closed) recording filename to its sidecar file.
+ * Returns 0 on success, -1 on error.
+ */
+int summary_write_sidecar(const char *filename, Summary *s)
+{
+    struct stat st;
+    size_t      len  = strlen(filename) + strlen(SUMMARY_SIDECAR_SUFFIX) + 1;
+    char        *name = malloc(len);
+    FILE        *fp;
+    int         ret = -1;
+
+    if (name == NULL)
+    {
+        return -1;
+    }
+    snprintf(name, len, "%s%s", filename, SUMMARY_SIDECAR_SUFFIX);
+    if ((stat(filename, &st) == 0) && ((fp = fopen(name, "w")) != NULL))
+    {
+        s->file_size = st.st_size;
+        ret          = summary_write_sidecar_fp(fp, s);
+        if (fclose(fp) != 0)
+        {
+            ret = -1;
+        }
+    }
+    free(name);
+    return ret;
+}
+
+
+/*
+ * Same, to a sidecar file opened by someone else (see ttyrecd), file_size included:
+ * it must already be set to the size of the recording. Returns 0 on success, -1 on error.
+ */
+int summary_write_sidecar_fp(FILE *fp, Summary *s)
+{
+    unsigned char buf[SUMMARY_SIZE];
+
+    encode_summary(buf, s);
+    return fwrite(buf, 1, sizeof(buf), fp) == sizeof(buf) ? 0 : -1;
+}
+
+
+/*
+ * Get the summary of the recording filename, open as fp: from its trailer, or
+ * from its sidecar file. The position of fp is preserved. Returns 1 if we found
+ * one matching the current size of the file, 0 otherwise.
+ */
+int summary_read(const char *filename, FILE *fp, Summary *s)
+{
+    struct stat   st;
+    unsigned char buf[SUMMARY_SIZE];
+    long          pos   = ftell(fp);
+    int           found = 0;
+
+    if ((pos < 0) || (fstat(fileno(fp), &st) != 0))
+    {
+        return 0;
+    }
+
+    if ((st.st_size >= SUMMARY_SIZE) && (fseek(fp, st.st_size - SUMMARY_SIZE, SEEK_SET) == 0) &&
+        (fread(buf, 1, sizeof(buf), fp) == sizeof(buf)) && decode_summary(buf, s) &&
+        (s->file_size == (uint64_t)st.st_size - SUMMARY_SIZE))
+    {
+        found = 1;
+    }
+    fseek(fp, pos, SEEK_SET);
+
+    if (!found)
+    {
+        size_t len  = strlen(filename) + strlen(SUMMARY_SIDECAR_SUFFIX) + 1;
+        char   *name = malloc(len);
+        FILE   *sfp;
+
+        if (name == NULL)
+        {
+            return 0;
+        }
+        snprintf(name, len, "%s%s", filename, SUMMARY_SIDECAR_SUFFIX);
+        if ((sfp = fopen(name, "r")) != NULL)
+        {
+            found = (fread(buf, 1, sizeof(buf), sfp) == sizeof(buf)) && decode_summary(buf, s) &&
+                    (s->file_size == (uint64_t)st.st_size);
+            fclose(sfp);
+        }
+        free(name);
+    }
+    return found;
+}
@@ -0,0 +1,32 @@
+#ifndef __TTYREC_SUMMARY_H__
+#define __TTYREC_SUMMARY_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "ttyrec.h"
+
+// on-disk size of a summary: an 8-byte zstd skippable frame header, then our payload
+#define SUMMARY_SIZE             64
+
+// suffix of the sidecar file holding the summary of an uncompressed recording
+#define SUMMARY_SIDECAR_SUFFIX   ".sum"
+
+typedef struct summary
+{
+    struct timeval first;     // timestamp of the first record
+    struct timeval last;      // timestamp of the last record
+    uint64_t       records;   // number of records
+    uint64_t       bytes;     // total length of the records' payloads
+    uint64_t       file_size; // size of the recording the summary describes, trailer excluded
+} Summary;
+
+void summary_add(Summary *s, const Header *h);
+void summary_merge(Summary *s, const Summary *next);
+int summary_write_trailer(FILE *fp, Summary *s);
+int summary_write_sidecar(const char *filename, Summary *s);
+int summary_write_sidecar_fp(FILE *fp, Summary *s);
+int summary_read(const char *filename, FILE *fp, Summary *s);
+
+#endif
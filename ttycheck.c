@@ -0,0 +1,477 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * Check the integrity of ttyrec recordings, such as those left behind by a crash,
+ * and optionally write a cleaned copy of the damaged ones.
+ *
+ * Records are validated as a chain: a header must have a sane length and usec, and
+ * a timestamp that makes sense after the previous one. After an invalid header, we
+ * look for the next place where two valid headers follow each other, and go on from
+ * there. Damaged zstd frames are decompressed as far as possible, then skipped.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ttyrec.h"
+#include "io.h"
+#include "compress.h"
+#include "pool.h"
+#include "summary.h"
+
+// decompressed data is read by chunks of this size
+#define CHECK_READ_SIZE       (1024 * 1024)
+
+// how far back in time a record can go from the previous one (clock adjustments)
+#define MAX_BACKWARDS_SECS    (24 * 3600)
+
+// how far in the future a record can be
+#define MAX_FUTURE_SECS       (24 * 3600)
+
+// a file being checked, and what we found in it
+typedef struct check
+{
+    Reader             *r;
+    Writer             *w;        // where the cleaned copy goes, if we're writing one
+    char               *buf;
+    size_t             size;
+    size_t             start;     // first byte of buf not consumed yet
+    size_t             end;       // end of the data in buf
+    int                eof;
+    time_t             now;
+    uint64_t           records;
+    uint64_t           regions;   // corrupt regions
+    unsigned long long skipped;   // bytes in them
+    int                truncated; // the last record is incomplete
+    ReaderDamage       damage;    // of the compressed stream
+    Summary            summary;   // of the cleaned copy
+} Check;
+
+size_t need(Check *c, size_t n);
+int plausible(const Check *c, const Header *h, const Header *prev);
+void resync(Check *c, const Header *prev);
+void check_stream(Check *c);
+int check_file(const char *filename, const char *cleaned, Check *c);
+char *check_job(size_t i, void *arg);
+void usage(void);
+
+static int opt_write  = 0;       // -w
+static int opt_quiet  = 0;       // -q
+static int *file_result = NULL;  // 0 if fine, 1 if damaged, 2 on error
+
+
+/*
+ * Make sure we have the next n bytes in buf, if the file is long enough.
+ * Returns how many of them we have.
+ */
+size_t need(Check *c, size_t n)
+{
+    while ((c->end - c->start < n) && !c->eof)
+    {
+        // make room for at least n bytes, plus a full read
+        if (c->start + n + CHECK_READ_SIZE > c->size)
+        {
+            memmove(c->buf, c->buf + c->start, c->end - c->start);
+            c->end  -= c->start;
+            c->start = 0;
+            if (n + CHECK_READ_SIZE > c->size)
+            {
+                char *newbuf = realloc(c->buf, n + CHECK_READ_SIZE);
+                if (newbuf == NULL)
+                {
+                    perror("realloc");
+                    exit(2);
+                }
+                c->buf  = newbuf;
+                c->size = n + CHECK_READ_SIZE;
+            }
+        }
+        size_t want = c->size - c->end;
+        size_t got  = reader_fill(c->r, c->buf + c->end, want);
+        c->end += got;
+        c->eof  = got < want;
+    }
+    return c->end - c->start < n ? c->end - c->start : n;
+}
+
+
+/* whether h looks like a header that could follow prev (NULL for the first one) */
+int plausible(const Check *c, const Header *h, const Header *prev)
+{
+    if ((h->len < 0) || (h->len > MAX_RECORD_LEN) || (h->tv.tv_usec >= 1000000) ||
+        (h->tv.tv_sec <= 0) || (h->tv.tv_sec > c->now + MAX_FUTURE_SECS))
+    {
+        return 0;
+    }
+    return (prev == NULL) || (h->tv.tv_sec >= prev->tv.tv_sec - MAX_BACKWARDS_SECS);
+}
+
+
+/*
+ * The header at start is invalid: move to the next place where a valid header is
+ * followed by another one (or by the end of the file).
+ */
+void resync(Check *c, const Header *prev)
+{
+    c->regions++;
+    while (1)
+    {
+        Header h, next;
+        size_t avail;
+
+        c->start++;
+        c->skipped++;
+        avail = need(c, HEADER_SIZE);
+        if (avail < HEADER_SIZE)
+        {
+            // nothing valid up to the end
+            c->start   += avail;
+            c->skipped += avail;
+            return;
+        }
+        decode_header(c->buf + c->start, &h);
+        if (!plausible(c, &h, prev))
+        {
+            continue;
+        }
+
+        size_t reclen = HEADER_SIZE + h.len;
+        avail = need(c, reclen + HEADER_SIZE);
+        if (avail < reclen + HEADER_SIZE)
+        {
+            // the end of the file is within this record, or right after it
+            return;
+        }
+        decode_header(c->buf + c->start + reclen, &next);
+        if (plausible(c, &next, &h))
+        {
+            return;
+        }
+    }
+}
+
+
+void check_stream(Check *c)
+{
+    Header prev;
+    int    have_prev = 0;
+
+    while (1)
+    {
+        Header h;
+        size_t avail = need(c, HEADER_SIZE);
+
+        if (avail == 0)
+        {
+            break;
+        }
+        if (avail < HEADER_SIZE)
+        {
+            c->truncated = 1;
+            break;
+        }
+        decode_header(c->buf + c->start, &h);
+        if (!plausible(c, &h, have_prev ? &prev : NULL))
+        {
+            resync(c, have_prev ? &prev : NULL);
+            continue;
+        }
+
+        size_t reclen = HEADER_SIZE + h.len;
+        int    whole  = 1; // records may be empty, but what's left of a truncated one must not
+        avail = need(c, reclen);
+        if (avail < reclen)
+        {
+            // keep what we have of the last record, it still is some output of the session
+            c->truncated = 1;
+            whole        = 0;
+            h.len        = avail - HEADER_SIZE;
+            reclen       = avail;
+        }
+        if (whole || (h.len > 0))
+        {
+            c->records++;
+            if (c->w != NULL)
+            {
+                if (writer_record(c->w, &h, c->buf + c->start + HEADER_SIZE) == 0)
+                {
+                    perror("ttycheck: write");
+                    exit(2);
+                }
+                summary_add(&c->summary, &h);
+            }
+        }
+        c->start += reclen;
+        prev      = h;
+        have_prev = 1;
+    }
+    reader_damage(c->r, &c->damage);
+}
+
+
+/*
+ * Check filename, writing the records we could get out of it to cleaned unless NULL.
+ * Returns 0 if it's fine, 1 if it's damaged, 2 if it couldn't be checked.
+ */
+int check_file(const char *filename, const char *cleaned, Check *c)
+{
+    FILE            *fp = fopen(filename, "r");
+    compress_mode_t cm;
+
+    memset(c, 0, sizeof(*c));
+    if (fp == NULL)
+    {
+        fprintf(stderr, "ttycheck: %s: %s\n", filename, strerror(errno));
+        return 2;
+    }
+    cm    = detect_compress_mode(filename, fp);
+    c->r  = reader_new(fp, cm);
+    c->now = time(NULL);
+    if (c->r == NULL)
+    {
+        fclose(fp);
+        return 2;
+    }
+    reader_salvage(c->r);
+
+    if (cleaned != NULL)
+    {
+        FILE *out = fopen(cleaned, "w");
+        if ((out == NULL) || ((c->w = writer_new(out, cm)) == NULL))
+        {
+            fprintf(stderr, "ttycheck: %s: %s\n", cleaned, strerror(errno));
+            if (out != NULL)
+            {
+                fclose(out);
+            }
+            reader_close(c->r);
+            return 2;
+        }
+    }
+
+    check_stream(c);
+    free(c->buf);
+
+    if (c->w != NULL)
+    {
+        // give it a summary, as ttyrec would have if it had closed the file
+        if (cm == COMPRESS_ZSTD)
+        {
+            writer_end_frame(c->w);
+            (void)summary_write_trailer(writer_file(c->w), &c->summary);
+        }
+        if (writer_close(c->w) != 0)
+        {
+            fprintf(stderr, "ttycheck: %s: %s\n", cleaned, strerror(errno));
+            reader_close(c->r);
+            return 2;
+        }
+    }
+    reader_close(c->r);
+    return (c->regions > 0) || c->truncated || (c->damage.regions > 0) || c->damage.truncated;
+}
+
+
+/* FILE.clean, or FILE.clean.zst for FILE.zst */
+static char *cleaned_name(const char *filename)
+{
+    size_t len  = strlen(filename);
+    size_t size = len + sizeof(".clean");
+    char   *name = malloc(size);
+
+    if (name == NULL)
+    {
+        perror("malloc");
+        exit(2);
+    }
+    if ((len >= 4) && (strcmp(filename + len - 4, ".zst") == 0))
+    {
+        snprintf(name, size, "%.*s.clean.zst", (int)(len - 4), filename);
+    }
+    else
+    {
+        snprintf(name, size, "%s.clean", filename);
+    }
+    return name;
+}
+
+
+char *check_job(size_t i, void *arg)
+{
+    const char *filename = ((FileList *)arg)->names[i];
+    char       *cleaned  = NULL;
+    char       *line     = NULL;
+    size_t     len       = 0;
+    FILE       *mem;
+    Check      c;
+    int        ret;
+
+    ret = check_file(filename, NULL, &c);
+    if ((ret == 1) && opt_write)
+    {
+        // only damaged files are copied, in a second pass
+        cleaned = cleaned_name(filename);
+        if (check_file(filename, cleaned, &c) == 2)
+        {
+            ret = 2;
+        }
+    }
+    file_result[i] = ret;
+    if ((ret == 0) && opt_quiet)
+    {
+        free(cleaned);
+        return NULL;
+    }
+
+    mem = open_memstream(&line, &len);
+    if (mem == NULL)
+    {
+        perror("open_memstream");
+        exit(2);
+    }
+    fprintf(mem, "%s\t%llu\t%s", ret == 0 ? "ok" : ret == 1 ? "damaged" : "error",
+            (unsigned long long)c.records, filename);
+    if (ret == 1)
+    {
+        const char *sep = "\t";
+        if (c.damage.regions > 0)
+        {
+            fprintf(mem, "%s%lu damaged zstd frames, %llu compressed bytes skipped", sep, c.damage.regions, c.damage.skipped);
+            sep = ", ";
+        }
+        if (c.damage.truncated)
+        {
+            fprintf(mem, "%struncated zstd frame", sep);
+            sep = ", ";
+        }
+        if (c.regions > 0)
+        {
+            fprintf(mem, "%s%llu corrupt regions, %llu bytes skipped", sep, (unsigned long long)c.regions, c.skipped);
+            sep = ", ";
+        }
+        if (c.truncated)
+        {
+            fprintf(mem, "%struncated last record", sep);
+        }
+        if (cleaned != NULL)
+        {
+            fprintf(mem, "\t-> %s", cleaned);
+        }
+    }
+    fputc('\n', mem);
+    fclose(mem);
+    free(cleaned);
+    return line;
+}
+
+
+void usage(void)
+{
+    printf("Usage: ttycheck [OPTION] FILE...\n");
+    printf("Check the integrity of ttyrec files, and print for each of them: ok, damaged or error, the number of\n");
+    printf("valid records found, the file name, and what's wrong with it.\n\n");
+    printf("  -w, --write-clean      Write what can be salvaged from damaged files to FILE.clean (FILE.clean.zst for FILE.zst)\n");
+    printf("  -q, --quiet            Only print the files that aren't ok\n");
+    printf("  -j, --jobs N           Check N files at a time [1]\n");
+    printf("  -r, --recursive        Check all the files found in the directories given, recursively\n");
+    printf("\nExit status is 0 if all files are ok, 1 if some are damaged, 2 on error.\n");
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    FileList files     = { NULL, 0, 0 };
+    int      jobs      = 1;
+    int      recursive = 0;
+    int      status    = 0;
+
+    set_progname(argv[0]);
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            { "write-clean", 0, 0, 'w' },
+            { "quiet",       0, 0, 'q' },
+            { "jobs",        1, 0, 'j' },
+            { "recursive",   0, 0, 'r' },
+            { "help",        0, 0, 'h' },
+            { 0,             0, 0, 0   }
+        };
+        int option_index = 0;
+        int ch           = getopt_long(argc, argv, "hwqj:r", long_options, &option_index);
+        if (ch == -1)
+        {
+            break;
+        }
+        switch (ch)
+        {
+        case 'w':
+            opt_write = 1;
+            break;
+
+        case 'q':
+            opt_quiet = 1;
+            break;
+
+        case 'j':
+            if ((optarg == NULL) || (sscanf(optarg, "%d", &jobs) != 1) || (jobs <= 0))
+            {
+                fprintf(stderr, "-j option requires a strictly positive number\n");
+                exit(2);
+            }
+            break;
+
+        case 'r':
+            recursive = 1;
+            break;
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage();
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        if (filelist_add(&files, argv[i], recursive) != 0)
+        {
+            exit(2);
+        }
+    }
+
+    file_result = calloc(files.count ? files.count : 1, sizeof(int));
+    if (file_result == NULL)
+    {
+        perror("calloc");
+        exit(2);
+    }
+    if (pool_run(files.count, jobs, check_job, &files, stdout) != 0)
+    {
+        exit(2);
+    }
+
+    for (size_t i = 0; i < files.count; i++)
+    {
+        if (file_result[i] > status)
+        {
+            status = file_result[i];
+        }
+    }
+    free(file_result);
+    filelist_free(&files);
+    return status;
+}
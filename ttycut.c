@@ -0,0 +1,576 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * Extract a time range out of ttyrec recordings, or concatenate rotated ones back
+ * into a single file.
+ *
+ * As little as possible is recompressed: files that entirely fit in the range, as
+ * told by their summary (see summary.h), are copied as is. Otherwise, zstd frames
+ * are decompressed to find out which records they hold, those holding only records
+ * in the range are copied as is, and only the frames at the edges of the range get
+ * their records recompressed.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ttyrec.h"
+#include "io.h"
+#include "compress.h"
+#include "summary.h"
+#include "configure.h"
+
+#ifdef HAVE_zstd
+# include "compress_zstd.h"
+#endif
+
+// start or end of the range to extract
+typedef struct bound
+{
+    int    set;
+    int    absolute; // value is a date, rather than an offset from the start of the first recording
+    double value;
+} Bound;
+
+// follows the records of a stream handed to it in arbitrary pieces
+typedef struct parser
+{
+    unsigned char hdr[HEADER_SIZE];
+    size_t        hdrlen;    // bytes of the next header got so far, HEADER_SIZE once in its payload
+    Header        h;         // record being read
+    size_t        remaining; // bytes of its payload still to come
+    int           keep;      // the record is in the range
+    int           emit;      // write the records in the range, rather than just counting them
+    Summary       in;        // records in the range met
+    uint64_t      out;       // records out of the range met
+    int           past_end;  // met a record after the end of the range
+    int           corrupt;   // met an invalid header
+} Parser;
+
+int parse_time(const char *arg, Bound *b);
+int in_range(const Header *h);
+void parse(Parser *p, const char *buf, size_t len);
+void parse_cb(const void *buf, size_t len, void *arg);
+void copy_bytes(FILE *in, long offset, uint64_t len);
+int cut_frames(const char *filename, FILE *fp);
+int cut_records(const char *filename, FILE *fp, compress_mode_t cm);
+int cut_file(const char *filename);
+void usage(void);
+
+static Bound           range_start;
+static Bound           range_end;
+static int             origin_known = 0;
+static struct timeval  origin;        // timestamp of the first record of the first recording
+static FILE            *out         = NULL;
+static compress_mode_t out_mode     = COMPRESS_NONE;
+static Summary         total;         // what has been written to out
+static char            *payload     = NULL;
+static size_t          payload_size = 0;
+
+
+/*
+ * Parse a time given as [[HH:]MM:]SS[.frac], an offset from the start of the first
+ * recording, or as @EPOCH[.frac], a date. Returns 0 on success, -1 on error.
+ */
+int parse_time(const char *arg, Bound *b)
+{
+    char   *end;
+    double part;
+
+    b->set      = 1;
+    b->absolute = (arg[0] == '@');
+    b->value    = 0;
+    if (b->absolute)
+    {
+        arg++;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        errno = 0;
+        part  = strtod(arg, &end);
+        if ((errno != 0) || (end == arg) || (part < 0))
+        {
+            return -1;
+        }
+        b->value = b->value * 60 + part;
+        if (*end == '\0')
+        {
+            return 0;
+        }
+        if ((*end != ':') || b->absolute)
+        {
+            return -1;
+        }
+        arg = end + 1;
+    }
+    return -1;
+}
+
+
+static void grow_payload(size_t len)
+{
+    if (len > payload_size)
+    {
+        char *newbuf = realloc(payload, len);
+        if (newbuf == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        payload      = newbuf;
+        payload_size = len;
+    }
+}
+
+
+/* the first record ever met gives the origin of the offsets of the range */
+int in_range(const Header *h)
+{
+    double t = h->tv.tv_sec + h->tv.tv_usec / 1000000.0;
+    double o;
+
+    if (!origin_known)
+    {
+        origin       = h->tv;
+        origin_known = 1;
+    }
+    o = origin.tv_sec + origin.tv_usec / 1000000.0;
+
+    if (range_start.set && (t < (range_start.absolute ? 0 : o) + range_start.value))
+    {
+        return 0;
+    }
+    if (range_end.set && (t > (range_end.absolute ? 0 : o) + range_end.value))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+
+static int after_range(const struct timeval *tv)
+{
+    double t = tv->tv_sec + tv->tv_usec / 1000000.0;
+
+    return range_end.set && (t > (range_end.absolute ? 0 : origin.tv_sec + origin.tv_usec / 1000000.0) + range_end.value);
+}
+
+
+static void write_out(Header *h, const char *buf)
+{
+    // with zstd, write_record() returns 0 as long as the data is only buffered
+    (void)write_record(out, h, buf);
+    if (ferror(out))
+    {
+        perror("ttycut: write");
+        exit(EXIT_FAILURE);
+    }
+    summary_add(&total, h);
+}
+
+
+void parse(Parser *p, const char *buf, size_t len)
+{
+    while ((len > 0) && !p->corrupt)
+    {
+        size_t n;
+
+        if (p->hdrlen < HEADER_SIZE)
+        {
+            n = HEADER_SIZE - p->hdrlen < len ? HEADER_SIZE - p->hdrlen : len;
+            memcpy(p->hdr + p->hdrlen, buf, n);
+            p->hdrlen += n;
+            buf       += n;
+            len       -= n;
+            if (p->hdrlen < HEADER_SIZE)
+            {
+                return;
+            }
+
+            decode_header(p->hdr, &p->h);
+            if ((p->h.len < 0) || (p->h.len > MAX_RECORD_LEN))
+            {
+                p->corrupt = 1;
+                return;
+            }
+            p->remaining = p->h.len;
+            p->keep      = in_range(&p->h);
+            if (p->keep)
+            {
+                summary_add(&p->in, &p->h);
+            }
+            else
+            {
+                p->out++;
+                p->past_end |= after_range(&p->h.tv);
+            }
+            if (p->emit && p->keep)
+            {
+                grow_payload(p->h.len);
+            }
+        }
+
+        n = p->remaining < len ? p->remaining : len;
+        if (p->emit && p->keep)
+        {
+            memcpy(payload + p->h.len - p->remaining, buf, n);
+        }
+        p->remaining -= n;
+        buf          += n;
+        len          -= n;
+        if (p->remaining == 0)
+        {
+            if (p->emit && p->keep)
+            {
+                write_out(&p->h, payload);
+            }
+            p->hdrlen = 0;
+        }
+    }
+}
+
+
+void parse_cb(const void *buf, size_t len, void *arg)
+{
+    parse(arg, buf, len);
+}
+
+
+/* copy len bytes of in, from offset, to the output as they are */
+void copy_bytes(FILE *in, long offset, uint64_t len)
+{
+    char buf[64 * 1024];
+
+    if (fseek(in, offset, SEEK_SET) != 0)
+    {
+        perror("ttycut: fseek");
+        exit(EXIT_FAILURE);
+    }
+    while (len > 0)
+    {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        if (fread(buf, 1, chunk, in) != chunk)
+        {
+            fprintf(stderr, "ttycut: unexpected end of file\n");
+            exit(EXIT_FAILURE);
+        }
+        if (fwrite(buf, 1, chunk, out) != chunk)
+        {
+            perror("ttycut: write");
+            exit(EXIT_FAILURE);
+        }
+        len -= chunk;
+    }
+}
+
+
+#ifdef HAVE_zstd
+/*
+ * zstd to zstd: each frame is first decompressed without keeping anything, to see
+ * which records it holds. If they all are in the range, and the frame starts and
+ * ends on a record boundary, it's copied as is. If none of them are, it's skipped.
+ * Otherwise it's decompressed again, to recompress the records in the range.
+ * Returns 1 once past the end of the range, 0 otherwise.
+ */
+int cut_frames(const char *filename, FILE *fp)
+{
+    Parser p      = { .emit = 1 };
+    long   offset = 0;
+
+    while (!p.past_end)
+    {
+        Parser scan = p;
+        long   size;
+
+        scan.emit = 0;
+        memset(&scan.in, 0, sizeof(scan.in));
+        scan.out = 0;
+        size     = zstd_walk_frame(fp, offset, parse_cb, &scan);
+        if (size == 0)
+        {
+            break;
+        }
+
+        if ((size < 0) || scan.corrupt)
+        {
+            // keep what we could read before the damage
+            fprintf(stderr, "ttycut: %s: corrupt or truncated at offset %ld, ignoring the rest\n", filename, offset);
+            (void)zstd_walk_frame(fp, offset, parse_cb, &p);
+            break;
+        }
+
+        if ((scan.in.records == 0) && (scan.out == 0) && (scan.hdrlen == p.hdrlen) && (scan.remaining == p.remaining))
+        {
+            // no content, such as a summary left by ttyrec: dropped, we'll write our own
+        }
+        else if ((p.hdrlen == 0) && (scan.hdrlen == 0) && (scan.out == 0))
+        {
+            // the current frame of the output must be ended, for this one to follow it
+            zstd_end_stream(out);
+            copy_bytes(fp, offset, size);
+            summary_merge(&total, &scan.in);
+            p = scan;
+        }
+        else if ((scan.in.records == 0) && !((p.hdrlen == HEADER_SIZE) && p.keep))
+        {
+            p = scan;
+        }
+        else
+        {
+            (void)zstd_walk_frame(fp, offset, parse_cb, &p);
+        }
+        p.emit = 1;
+        offset += size;
+    }
+    return p.past_end;
+}
+#endif
+
+
+/*
+ * Any other combination: the records in the range are read, and written again.
+ * Returns 1 once past the end of the range, 0 otherwise.
+ */
+int cut_records(const char *filename, FILE *fp, compress_mode_t cm)
+{
+    Reader *r        = reader_new(fp, cm);
+    int    past_end  = 0;
+
+    if (r == NULL)
+    {
+        fprintf(stderr, "ttycut: %s: can't read this file\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    while (1)
+    {
+        Header h;
+
+        if (reader_header(r, &h) == 0)
+        {
+            break;
+        }
+        if ((h.len < 0) || (h.len > MAX_RECORD_LEN))
+        {
+            fprintf(stderr, "ttycut: %s: invalid record, ignoring the rest\n", filename);
+            break;
+        }
+        if (!in_range(&h))
+        {
+            if (after_range(&h.tv))
+            {
+                past_end = 1;
+                break;
+            }
+            if (reader_skip(r, h.len) != 0)
+            {
+                break;
+            }
+            continue;
+        }
+        grow_payload(h.len);
+        if (reader_read(r, payload, h.len) == 0)
+        {
+            fprintf(stderr, "ttycut: %s: truncated record, ignoring it\n", filename);
+            break;
+        }
+        write_out(&h, payload);
+    }
+    reader_close(r);
+    return past_end;
+}
+
+
+/*
+ * Append the part of filename that is in the range to the output.
+ * Returns 1 once past the end of the range, 0 otherwise.
+ */
+int cut_file(const char *filename)
+{
+    FILE            *fp = efopen(filename, "r");
+    compress_mode_t cm  = detect_compress_mode(filename, fp);
+    Summary         s;
+    int             past_end;
+
+    if (summary_read(filename, fp, &s))
+    {
+        if (s.records == 0)
+        {
+            fclose(fp);
+            return 0;
+        }
+        Header first = { .tv = s.first };
+        Header last  = { .tv = s.last };
+        if (!in_range(&first) && after_range(&first.tv))
+        {
+            fclose(fp);
+            return 1;
+        }
+        if (in_range(&first) && in_range(&last) && (cm == out_mode))
+        {
+            // the whole file is in the range: copied as is, minus its trailer
+#ifdef HAVE_zstd
+            if (out_mode == COMPRESS_ZSTD)
+            {
+                zstd_end_stream(out);
+            }
+#endif
+            copy_bytes(fp, 0, s.file_size);
+            summary_merge(&total, &s);
+            fclose(fp);
+            return 0;
+        }
+        if (!in_range(&last) && !after_range(&last.tv))
+        {
+            // the whole file is before the range
+            fclose(fp);
+            return 0;
+        }
+    }
+
+#ifdef HAVE_zstd
+    if ((cm == COMPRESS_ZSTD) && (out_mode == COMPRESS_ZSTD))
+    {
+        past_end = cut_frames(filename, fp);
+        fclose(fp);
+        return past_end;
+    }
+#endif
+    past_end = cut_records(filename, fp, cm);
+    return past_end;
+}
+
+
+void usage(void)
+{
+    printf("Usage: ttycut [OPTION] -o OUTPUT FILE...\n");
+    printf("Write the records of the ttyrec FILEs that are in the given time range to OUTPUT, one after the other.\n");
+    printf("Times are [[HH:]MM:]SS offsets from the start of the first FILE, or @EPOCH dates.\n\n");
+    printf("  -s, --start TIME       Start of the range [beginning]\n");
+    printf("  -e, --end TIME         End of the range [end]\n");
+    printf("  -o, --output OUTPUT    Write to OUTPUT, zstd-compressed if it has a .zst suffix\n");
+    printf("  -Z                     Compress OUTPUT with zstd, whatever its name\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv)
+{
+    const char  *output  = NULL;
+    int         opt_zstd = 0;
+    struct stat out_st;
+
+    set_progname(argv[0]);
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            { "start",  1, 0, 's' },
+            { "end",    1, 0, 'e' },
+            { "output", 1, 0, 'o' },
+            { "help",   0, 0, 'h' },
+            { 0,        0, 0, 0   }
+        };
+        int option_index = 0;
+        int ch           = getopt_long(argc, argv, "hs:e:o:Z", long_options, &option_index);
+        if (ch == -1)
+        {
+            break;
+        }
+        switch (ch)
+        {
+        case 's':
+            if (parse_time(optarg, &range_start) != 0)
+            {
+                fprintf(stderr, "ttycut: invalid start time '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'e':
+            if (parse_time(optarg, &range_end) != 0)
+            {
+                fprintf(stderr, "ttycut: invalid end time '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'Z':
+            opt_zstd = 1;
+            break;
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+
+    if ((output == NULL) || (optind >= argc))
+    {
+        usage();
+    }
+
+    if (opt_zstd || ((strlen(output) >= 4) && (strcmp(output + strlen(output) - 4, ".zst") == 0)))
+    {
+        out_mode = COMPRESS_ZSTD;
+    }
+    if (set_compress_mode(out_mode) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // truncating one of our inputs would be unfortunate
+    if (stat(output, &out_st) == 0)
+    {
+        for (int i = optind; i < argc; i++)
+        {
+            struct stat st;
+            if ((stat(argv[i], &st) == 0) && (st.st_dev == out_st.st_dev) && (st.st_ino == out_st.st_ino))
+            {
+                fprintf(stderr, "ttycut: %s is both an input and the output\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    out = efopen(output, "w");
+
+    for (int i = optind; i < argc; i++)
+    {
+        // recordings are expected in chronological order: nothing more to do past the end of the range
+        if (cut_file(argv[i]))
+        {
+            break;
+        }
+    }
+
+#ifdef HAVE_zstd
+    if (out_mode == COMPRESS_ZSTD)
+    {
+        zstd_end_stream(out);
+        if (total.records > 0)
+        {
+            (void)summary_write_trailer(out, &total);
+        }
+    }
+#endif
+    if (fclose(out) != 0)
+    {
+        perror("ttycut: close");
+        exit(EXIT_FAILURE);
+    }
+    free(payload);
+    return 0;
+}
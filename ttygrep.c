@@ -0,0 +1,523 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * Search ttyrec recordings for a regular expression, as if their output had
+ * been played and grep'd: escape sequences are stripped, and the text is split
+ * into lines regardless of how it was split into records.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ttyrec.h"
+#include "io.h"
+#include "compress.h"
+#include "pool.h"
+#include "vt.h"
+
+// longer lines are searched in pieces of this size
+#define MAX_LINE_LEN    (64 * 1024)
+
+// escape sequences parsing
+enum
+{
+    SEARCH_TEXT = 0,
+    SEARCH_ESCAPE,
+    SEARCH_ESCAPE_INTERMEDIATE,
+    SEARCH_CSI,
+    SEARCH_STRING,   // OSC, DCS, SOS, PM, APC: dropped up to BEL or ST
+    SEARCH_STRING_ESCAPE,
+};
+
+// the part of the current line that comes from a given record
+typedef struct segment
+{
+    size_t         pos;
+    struct timeval tv;
+} Segment;
+
+typedef struct search
+{
+    const char     *filename;
+    FILE           *out;
+    regex_t        re;
+    int            state;
+    char           line[MAX_LINE_LEN + 1];
+    size_t         len;
+    Segment        *segs;
+    size_t         nsegs;
+    size_t         segs_size;
+    int            new_segment; // the next text starts a new segment
+    struct timeval start;       // timestamp of the first record
+    struct timeval cur;         // timestamp of the current record
+    long           matches;
+} Search;
+
+void flush_line(Search *s);
+void add_text(Search *s, const char *text, size_t n);
+void search_record(Search *s, const char *buf, size_t n);
+long search_file(const char *filename, FILE *out);
+char *search_job(size_t i, void *arg);
+void usage(void);
+
+static const char *pattern     = NULL;
+static int        regex_flags  = REG_EXTENDED;
+static int        opt_list     = 0; // -l
+static int        opt_count    = 0; // -c
+static long       *file_result = NULL; // number of matches per file, -1 on error
+
+
+void flush_line(Search *s)
+{
+    regmatch_t m;
+    size_t     seg = 0;
+
+    if (s->len > 0)
+    {
+        s->line[s->len] = '\0';
+        if (regexec(&s->re, s->line, 1, &m, 0) == 0)
+        {
+            s->matches++;
+            if (!opt_list && !opt_count)
+            {
+                // the hit is dated by the record its first character comes from
+                while (seg + 1 < s->nsegs && s->segs[seg + 1].pos <= (size_t)m.rm_so)
+                {
+                    seg++;
+                }
+
+                struct timeval tv = s->nsegs > 0 ? s->segs[seg].tv : s->cur;
+                time_t         t  = tv.tv_sec;
+                struct tm      tm;
+                char           date[32];
+                localtime_r(&t, &tm);
+                strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+                fprintf(s->out, "%s\t%s\t+%.3f\t%s\n", s->filename, date,
+                        (tv.tv_sec - s->start.tv_sec) + (tv.tv_usec - s->start.tv_usec) / 1000000.0, s->line);
+            }
+        }
+    }
+    s->len         = 0;
+    s->nsegs       = 0;
+    s->new_segment = 1;
+}
+
+
+void add_text(Search *s, const char *text, size_t n)
+{
+    while (n > 0)
+    {
+        if (s->new_segment)
+        {
+            if (s->nsegs == s->segs_size)
+            {
+                size_t  newsize = s->segs_size ? s->segs_size * 2 : 16;
+                Segment *segs   = realloc(s->segs, newsize * sizeof(Segment));
+                if (segs == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                s->segs      = segs;
+                s->segs_size = newsize;
+            }
+            s->segs[s->nsegs].pos  = s->len;
+            s->segs[s->nsegs].tv   = s->cur;
+            s->nsegs++;
+            s->new_segment = 0;
+        }
+
+        size_t k = MAX_LINE_LEN - s->len;
+        if (k > n)
+        {
+            k = n;
+        }
+        memcpy(s->line + s->len, text, k);
+        s->len += k;
+        text   += k;
+        n      -= k;
+        if (s->len == MAX_LINE_LEN)
+        {
+            flush_line(s);
+        }
+    }
+}
+
+
+/*
+ * Feed the text of a record, minus its escape sequences. What moves the cursor to
+ * another line ends the current one, horizontal moves are replaced by a space.
+ */
+void search_record(Search *s, const char *buf, size_t n)
+{
+    const char *p   = buf;
+    const char *end = buf + n;
+
+    s->new_segment = 1;
+    while (p < end)
+    {
+        unsigned char c;
+
+        if (s->state == SEARCH_TEXT)
+        {
+            // most of it is plain text, copied in bulk
+            size_t run = vt_printable_run(p, end - p);
+            if (run > 0)
+            {
+                add_text(s, p, run);
+                p += run;
+                continue;
+            }
+        }
+
+        c = *p++;
+        switch (s->state)
+        {
+        case SEARCH_TEXT:
+            if (c >= 0x80 || c == '\t')
+            {
+                add_text(s, (const char *)&c, 1);
+            }
+            else if (c == '\n' || c == '\r' || c == '\v' || c == '\f')
+            {
+                flush_line(s);
+            }
+            else if (c == '\b')
+            {
+                if (s->len > 0)
+                {
+                    s->len--;
+                }
+            }
+            else if (c == 0x1b)
+            {
+                s->state = SEARCH_ESCAPE;
+            }
+            break;
+
+        case SEARCH_ESCAPE:
+            if (c == '[')
+            {
+                s->state = SEARCH_CSI;
+            }
+            else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+            {
+                s->state = SEARCH_STRING;
+            }
+            else if (c >= 0x20 && c <= 0x2f)
+            {
+                s->state = SEARCH_ESCAPE_INTERMEDIATE;
+            }
+            else if (c != 0x1b)
+            {
+                if (c == 'D' || c == 'E' || c == 'M')
+                {
+                    flush_line(s);
+                }
+                s->state = SEARCH_TEXT;
+            }
+            break;
+
+        case SEARCH_ESCAPE_INTERMEDIATE:
+            if (c >= 0x30 && c <= 0x7e)
+            {
+                s->state = SEARCH_TEXT;
+            }
+            break;
+
+        case SEARCH_CSI:
+            if (c >= 0x40 && c <= 0x7e)
+            {
+                if (strchr("ABEFHdf", c) != NULL)
+                {
+                    flush_line(s);
+                }
+                else if (c == 'C' || c == 'G' || c == '`' || c == 'a')
+                {
+                    add_text(s, " ", 1);
+                }
+                s->state = SEARCH_TEXT;
+            }
+            else if (c == 0x1b)
+            {
+                s->state = SEARCH_ESCAPE;
+            }
+            else if (c == 0x18 || c == 0x1a)
+            {
+                s->state = SEARCH_TEXT;
+            }
+            break;
+
+        case SEARCH_STRING:
+            if (c == 0x07 || c == 0x18 || c == 0x1a)
+            {
+                s->state = SEARCH_TEXT;
+            }
+            else if (c == 0x1b)
+            {
+                s->state = SEARCH_STRING_ESCAPE;
+            }
+            break;
+
+        case SEARCH_STRING_ESCAPE:
+            // ST, or the start of another sequence
+            s->state = c == '\\' ? SEARCH_TEXT : SEARCH_ESCAPE;
+            if (c != '\\')
+            {
+                p--;
+            }
+            break;
+        }
+    }
+}
+
+
+/*
+ * Search one file, writing the hits to out.
+ * Returns the number of matches, or -1 if the file couldn't be read.
+ */
+long search_file(const char *filename, FILE *out)
+{
+    Search *s;
+    Reader *r;
+    char   *buf      = NULL;
+    size_t buf_size  = 0;
+    int    first     = 1;
+    long   matches;
+    FILE   *fp       = fopen(filename, "r");
+    int    errcode;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "ttygrep: %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    r = reader_new(fp, detect_compress_mode(filename, fp));
+    if (r == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    s->filename = filename;
+    s->out      = out;
+    // one compiled regex per file: regexec() on a shared one would serialize the threads on its lock
+    if ((errcode = regcomp(&s->re, pattern, regex_flags | ((opt_list || opt_count) ? REG_NOSUB : 0))) != 0)
+    {
+        char err[256];
+        regerror(errcode, &s->re, err, sizeof(err));
+        fprintf(stderr, "ttygrep: %s\n", err);
+        exit(2);
+    }
+
+    while (1)
+    {
+        Header h;
+
+        if ((reader_header(r, &h) == 0) || (h.len <= 0) || (h.len > MAX_RECORD_LEN))
+        {
+            break;
+        }
+        if ((size_t)h.len > buf_size)
+        {
+            char *newbuf = realloc(buf, h.len);
+            if (newbuf == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            buf      = newbuf;
+            buf_size = h.len;
+        }
+        if (reader_read(r, buf, h.len) == 0)
+        {
+            break;
+        }
+
+        if (first)
+        {
+            s->start = h.tv;
+            first    = 0;
+        }
+        s->cur = h.tv;
+        search_record(s, buf, h.len);
+
+        if (opt_list && (s->matches > 0))
+        {
+            // no need to go any further
+            break;
+        }
+    }
+    flush_line(s);
+
+    matches = s->matches;
+    if (opt_list && (matches > 0))
+    {
+        fprintf(out, "%s\n", filename);
+    }
+    else if (opt_count)
+    {
+        fprintf(out, "%ld\t%s\n", matches, filename);
+    }
+
+    regfree(&s->re);
+    free(s->segs);
+    free(s);
+    free(buf);
+    reader_close(r);
+    return matches;
+}
+
+
+char *search_job(size_t i, void *arg)
+{
+    FileList *files = arg;
+    char     *out   = NULL;
+    size_t   len    = 0;
+    FILE     *mem   = open_memstream(&out, &len);
+
+    if (mem == NULL)
+    {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+    file_result[i] = search_file(files->names[i], mem);
+    fclose(mem);
+    if (len == 0)
+    {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+
+void usage(void)
+{
+    printf("Usage: ttygrep [OPTION] PATTERN FILE...\n");
+    printf("Search the output recorded in ttyrec files for lines matching PATTERN, an extended regular expression.\n");
+    printf("Each hit is printed as: file, date of the record, seconds since the start of the session, line.\n\n");
+    printf("  -i, --ignore-case      Ignore case distinctions\n");
+    printf("  -l, --files-with-matches  Only print the names of the files with a match\n");
+    printf("  -c, --count            Only print the number of matching lines of each file\n");
+    printf("  -j, --jobs N           Search N files at a time [1]\n");
+    printf("  -r, --recursive        Search all the files found in the directories given, recursively\n");
+    printf("\nExit status is 0 if a line matched, 1 if none did, 2 on error.\n");
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    FileList files     = { NULL, 0, 0 };
+    int      jobs      = 1;
+    int      recursive = 0;
+    int      status    = 1;
+
+    set_progname(argv[0]);
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            { "ignore-case",        0, 0, 'i' },
+            { "files-with-matches", 0, 0, 'l' },
+            { "count",              0, 0, 'c' },
+            { "jobs",               1, 0, 'j' },
+            { "recursive",          0, 0, 'r' },
+            { "help",               0, 0, 'h' },
+            { 0,                    0, 0, 0   }
+        };
+        int option_index = 0;
+        int ch           = getopt_long(argc, argv, "hilcj:r", long_options, &option_index);
+        if (ch == -1)
+        {
+            break;
+        }
+        switch (ch)
+        {
+        case 'i':
+            regex_flags |= REG_ICASE;
+            break;
+
+        case 'l':
+            opt_list = 1;
+            break;
+
+        case 'c':
+            opt_count = 1;
+            break;
+
+        case 'j':
+            if ((optarg == NULL) || (sscanf(optarg, "%d", &jobs) != 1) || (jobs <= 0))
+            {
+                fprintf(stderr, "-j option requires a strictly positive number\n");
+                exit(2);
+            }
+            break;
+
+        case 'r':
+            recursive = 1;
+            break;
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+
+    if (optind + 2 > argc)
+    {
+        usage();
+    }
+    pattern = argv[optind++];
+
+    for (int i = optind; i < argc; i++)
+    {
+        if (filelist_add(&files, argv[i], recursive) != 0)
+        {
+            exit(2);
+        }
+    }
+
+    file_result = calloc(files.count ? files.count : 1, sizeof(long));
+    if (file_result == NULL)
+    {
+        perror("calloc");
+        exit(2);
+    }
+    if (pool_run(files.count, jobs, search_job, &files, stdout) != 0)
+    {
+        exit(2);
+    }
+
+    for (size_t i = 0; i < files.count; i++)
+    {
+        if (file_result[i] < 0)
+        {
+            status = 2;
+            break;
+        }
+        if (file_result[i] > 0)
+        {
+            status = 0;
+        }
+    }
+    free(file_result);
+    filelist_free(&files);
+    return status;
+}
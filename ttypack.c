@@ -0,0 +1,531 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * Recompress ttyrec recordings with zstd, uncompressed ones as well as those
+ * compressed at a lower level, in place.
+ *
+ * Each file is written to a temporary file next to it, which is then read back and
+ * compared record by record with the original, and only then renamed over it (or
+ * to FILE.zst, for an uncompressed FILE, which is then removed).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ttyrec.h"
+#include "io.h"
+#include "compress.h"
+#include "pool.h"
+#include "summary.h"
+
+// outcome of a file, see pack_file()
+typedef struct packed
+{
+    int       status;   // 0 if packed, 1 if kept as it was, 2 on error
+    long long old_size;
+    long long new_size;
+} Packed;
+
+int copy_records(Reader *r, Writer *w, Summary *s, char **buf, size_t *buf_size);
+int verify(const char *filename, const char *packed);
+void pack_file(const char *filename, Packed *p, FILE *report);
+char *pack_job(size_t i, void *arg);
+void usage(void);
+
+static long   opt_level      = -1;          // -l
+static int    opt_long       = 0;           // --long
+static size_t opt_frame_size = 4096 * 1024; // --frame-size, in bytes, by default what the zstd writer does by itself
+static int    opt_keep       = 0;           // -k
+static Packed *results       = NULL;
+
+
+static int read_record(Reader *r, Header *h, char **buf, size_t *buf_size)
+{
+    char   hdr[HEADER_SIZE];
+    size_t got = reader_fill(r, hdr, HEADER_SIZE);
+
+    if (got == 0)
+    {
+        return 0;
+    }
+    if (got < HEADER_SIZE)
+    {
+        return -1;
+    }
+    decode_header(hdr, h);
+    if ((h->len < 0) || (h->len > MAX_RECORD_LEN))
+    {
+        return -1;
+    }
+    if ((size_t)h->len > *buf_size)
+    {
+        char *newbuf = realloc(*buf, h->len);
+        if (newbuf == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *buf      = newbuf;
+        *buf_size = h->len;
+    }
+    return reader_read(r, *buf, h->len) ? 1 : -1;
+}
+
+
+/* returns 0 once all the records of r have been written to w, -1 if r is damaged */
+int copy_records(Reader *r, Writer *w, Summary *s, char **buf, size_t *buf_size)
+{
+    Header       h;
+    int          ret;
+    size_t       frame = 0;
+    ReaderDamage damage;
+
+    while ((ret = read_record(r, &h, buf, buf_size)) == 1)
+    {
+        if (writer_record(w, &h, *buf) == 0)
+        {
+            return -1;
+        }
+        summary_add(s, &h);
+
+        // smaller frames for finer seeking, only ever cut between two records
+        frame += HEADER_SIZE + h.len;
+        if ((opt_frame_size > 0) && (frame >= opt_frame_size))
+        {
+            writer_end_frame(w);
+            frame = 0;
+        }
+    }
+    reader_damage(r, &damage);
+    return (ret == 0) && (damage.regions == 0) && !damage.truncated ? 0 : -1;
+}
+
+
+/* read both files back, returns 0 if they hold the same records */
+int verify(const char *filename, const char *packed)
+{
+    FILE   *fa    = fopen(filename, "r");
+    FILE   *fb    = fopen(packed, "r");
+    Reader *a     = NULL;
+    Reader *b     = NULL;
+    char   *bufa  = NULL;
+    char   *bufb  = NULL;
+    size_t sizea  = 0;
+    size_t sizeb  = 0;
+    int    ret    = -1;
+
+    // the readers own the files once created: below, they close them
+    if ((fa == NULL) || (fb == NULL) || ((a = reader_new(fa, detect_compress_mode(filename, fa))) == NULL))
+    {
+        goto out;
+    }
+    fa = NULL;
+    if ((b = reader_new(fb, COMPRESS_ZSTD)) == NULL)
+    {
+        goto out;
+    }
+    fb = NULL;
+    reader_salvage(a);
+    reader_salvage(b);
+
+    while (1)
+    {
+        Header ha, hb;
+        int    ra = read_record(a, &ha, &bufa, &sizea);
+        int    rb = read_record(b, &hb, &bufb, &sizeb);
+
+        if ((ra != rb) || (ra < 0))
+        {
+            break;
+        }
+        if (ra == 0)
+        {
+            ReaderDamage damage;
+            reader_damage(b, &damage);
+            ret = (damage.regions == 0) && !damage.truncated ? 0 : -1;
+            break;
+        }
+        if ((ha.tv.tv_sec != hb.tv.tv_sec) || (ha.tv.tv_usec != hb.tv.tv_usec) || (ha.len != hb.len) ||
+            (memcmp(bufa, bufb, ha.len) != 0))
+        {
+            break;
+        }
+    }
+
+out:
+    if (a != NULL)
+    {
+        reader_close(a);
+    }
+    if (b != NULL)
+    {
+        reader_close(b);
+    }
+    if (fa != NULL)
+    {
+        fclose(fa);
+    }
+    if (fb != NULL)
+    {
+        fclose(fb);
+    }
+    free(bufa);
+    free(bufb);
+    return ret;
+}
+
+
+/* make sure a rename in the directory of path is on disk */
+static void sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char       *dir   = slash == NULL ? strdup(".") : strndup(path, slash == path ? 1 : slash - path);
+    int        fd;
+
+    if (dir == NULL)
+    {
+        return;
+    }
+    if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0)
+    {
+        (void)fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+
+#define FAIL(...)                           \
+        do {                                \
+            fprintf(report, __VA_ARGS__);   \
+            goto out;                       \
+        } while (0)
+
+
+/*
+ * Recompress filename, telling what happened to report.
+ */
+void pack_file(const char *filename, Packed *p, FILE *report)
+{
+    struct stat st, st_after;
+    size_t      len      = strlen(filename);
+    int         is_zst   = (len >= 4) && (strcmp(filename + len - 4, ".zst") == 0);
+    const char  *slash   = strrchr(filename, '/');
+    size_t      dirlen   = slash == NULL ? 0 : (size_t)(slash - filename) + 1;
+    char        *target  = malloc(len + 5);
+    char        *tmp     = malloc(len + 9);
+    char        *buf     = NULL;
+    size_t      buf_size = 0;
+    FILE        *in      = NULL;
+    Reader      *r       = NULL;
+    Writer      *w       = NULL;
+    FILE        *out     = NULL;
+    int         fd       = -1;
+    int         have_tmp = 0;
+    Summary     s;
+
+    memset(&s, 0, sizeof(s));
+    p->status = 2;
+    if ((target == NULL) || (tmp == NULL))
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    // FILE.zst stays FILE.zst, FILE becomes FILE.zst, through a hidden .FILE.XXXXXX
+    snprintf(target, len + 5, "%s%s", filename, is_zst ? "" : ".zst");
+    snprintf(tmp, len + 9, "%.*s.%s.XXXXXX", (int)dirlen, filename, filename + dirlen);
+
+    if (((in = fopen(filename, "r")) == NULL) || (fstat(fileno(in), &st) != 0))
+    {
+        FAIL("error\t\t\t%s\t%s\n", filename, strerror(errno));
+    }
+    p->old_size = st.st_size;
+    if ((r = reader_new(in, detect_compress_mode(filename, in))) == NULL)
+    {
+        FAIL("error\t\t\t%s\tunsupported compression\n", filename);
+    }
+    in = NULL;
+    reader_salvage(r);
+
+    if (!is_zst && (access(target, F_OK) == 0))
+    {
+        FAIL("error\t\t\t%s\t%s already exists\n", filename, target);
+    }
+
+    if ((fd = mkstemp(tmp)) < 0)
+    {
+        FAIL("error\t\t\t%s\t%s\n", filename, strerror(errno));
+    }
+    have_tmp = 1;
+    if (((out = fdopen(fd, "w")) == NULL) || ((w = writer_new(out, COMPRESS_ZSTD)) == NULL))
+    {
+        FAIL("error\t\t\t%s\t%s: %s\n", filename, tmp, strerror(errno));
+    }
+    writer_set_level(w, opt_level);
+    if (opt_long && (writer_set_long_distance(w) != 0))
+    {
+        FAIL("error\t\t\t%s\tlong distance matching isn't supported by this libzstd\n", filename);
+    }
+
+    if (copy_records(r, w, &s, &buf, &buf_size) != 0)
+    {
+        FAIL("error\t\t\t%s\tdamaged, see ttycheck(1)\n", filename);
+    }
+    writer_end_frame(w);
+    if (s.records > 0)
+    {
+        (void)summary_write_trailer(writer_file(w), &s);
+    }
+    // the new file must be on disk before it replaces the old one
+    if ((fflush(writer_file(w)) != 0) || (fchmod(fd, st.st_mode & 07777) != 0) ||
+        (futimens(fd, (struct timespec[2]) { st.st_atim, st.st_mtim }) != 0) || (fsync(fd) != 0))
+    {
+        FAIL("error\t\t\t%s\t%s: %s\n", filename, tmp, strerror(errno));
+    }
+    p->new_size = lseek(fd, 0, SEEK_END);
+    fd          = -1;
+    out         = NULL;
+    if (writer_close(w) != 0)
+    {
+        w = NULL;
+        FAIL("error\t\t\t%s\t%s: %s\n", filename, tmp, strerror(errno));
+    }
+    w = NULL;
+
+    if (verify(filename, tmp) != 0)
+    {
+        FAIL("error\t\t\t%s\trecompressed file doesn't match the original, kept the original\n", filename);
+    }
+    if ((stat(filename, &st_after) != 0) || (st_after.st_size != st.st_size) ||
+        (st_after.st_mtim.tv_sec != st.st_mtim.tv_sec) || (st_after.st_mtim.tv_nsec != st.st_mtim.tv_nsec))
+    {
+        FAIL("error\t\t\t%s\tmodified while being recompressed\n", filename);
+    }
+    if (p->new_size >= p->old_size)
+    {
+        p->status = 1;
+        FAIL("kept\t%lld\t%lld\t%s\n", p->old_size, p->new_size, filename);
+    }
+
+    if (rename(tmp, target) != 0)
+    {
+        FAIL("error\t\t\t%s\t%s: %s\n", filename, target, strerror(errno));
+    }
+    have_tmp = 0;
+    sync_dir(target);
+    if (!is_zst && !opt_keep)
+    {
+        size_t sumlen  = len + strlen(SUMMARY_SIDECAR_SUFFIX) + 1;
+        char   *sidecar = malloc(sumlen);
+
+        // the new file has its summary in its trailer
+        if (sidecar != NULL)
+        {
+            snprintf(sidecar, sumlen, "%s%s", filename, SUMMARY_SIDECAR_SUFFIX);
+            (void)unlink(sidecar);
+            free(sidecar);
+        }
+        (void)unlink(filename);
+    }
+    p->status = 0;
+    fprintf(report, "packed\t%lld\t%lld\t%s\n", p->old_size, p->new_size, target);
+
+out:
+    if (w != NULL)
+    {
+        (void)writer_close(w);
+    }
+    else if (out != NULL)
+    {
+        fclose(out);
+    }
+    else if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (have_tmp)
+    {
+        (void)unlink(tmp);
+    }
+    if (r != NULL)
+    {
+        reader_close(r);
+    }
+    if (in != NULL)
+    {
+        fclose(in);
+    }
+    free(buf);
+    free(tmp);
+    free(target);
+}
+
+
+char *pack_job(size_t i, void *arg)
+{
+    char   *line = NULL;
+    size_t len   = 0;
+    FILE   *mem  = open_memstream(&line, &len);
+
+    if (mem == NULL)
+    {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+    pack_file(((FileList *)arg)->names[i], &results[i], mem);
+    fclose(mem);
+    return line;
+}
+
+
+void usage(void)
+{
+    printf("Usage: ttypack [OPTION] FILE...\n");
+    printf("Recompress ttyrec files with zstd, in place: FILE.zst files are replaced, other FILEs become FILE.zst.\n");
+    printf("Each new file is checked to hold the same records as the original before replacing it.\n");
+    printf("For each file, prints: packed, kept (no gain) or error, the old and new sizes, and the file name.\n\n");
+    printf("  -l, --level LEVEL      Compression level, between 1 and 19 [3]\n");
+    printf("      --long             Enable long distance matching, for long sessions with far repetitions\n");
+    printf("      --frame-size KB    End zstd frames every KB kilobytes of records, for finer seeking [4096]\n");
+    printf("  -k, --keep             Keep the original of uncompressed FILEs\n");
+    printf("  -j, --jobs N           Process N files at a time [1]\n");
+    printf("  -r, --recursive        Process all the files found in the directories given, recursively\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char **argv)
+{
+    FileList  files     = { NULL, 0, 0 };
+    int       jobs      = 1;
+    int       recursive = 0;
+    int       status    = 0;
+    long long old_total = 0;
+    long long new_total = 0;
+
+    set_progname(argv[0]);
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            { "level",      1, 0, 'l' },
+            { "long",       0, 0, 0   },
+            { "frame-size", 1, 0, 0   },
+            { "keep",       0, 0, 'k' },
+            { "jobs",       1, 0, 'j' },
+            { "recursive",  0, 0, 'r' },
+            { "help",       0, 0, 'h' },
+            { 0,            0, 0, 0   }
+        };
+        int option_index = 0;
+        int ch           = getopt_long(argc, argv, "hl:kj:r", long_options, &option_index);
+        if (ch == -1)
+        {
+            break;
+        }
+        switch (ch)
+        {
+        case 0:
+            if (strcmp(long_options[option_index].name, "long") == 0)
+            {
+                opt_long = 1;
+            }
+            else if (strcmp(long_options[option_index].name, "frame-size") == 0)
+            {
+                long kb;
+                if ((sscanf(optarg, "%ld", &kb) != 1) || (kb <= 0))
+                {
+                    fprintf(stderr, "--frame-size option requires a strictly positive number\n");
+                    exit(EXIT_FAILURE);
+                }
+                opt_frame_size = kb * 1024;
+            }
+            break;
+
+        case 'l':
+            errno     = 0;
+            opt_level = strtol(optarg, NULL, 10);
+            if ((errno != 0) || (opt_level < 1) || (opt_level > 19))
+            {
+                fprintf(stderr, "-l option requires a level between 1 and 19\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'k':
+            opt_keep = 1;
+            break;
+
+        case 'j':
+            if ((optarg == NULL) || (sscanf(optarg, "%d", &jobs) != 1) || (jobs <= 0))
+            {
+                fprintf(stderr, "-j option requires a strictly positive number\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'r':
+            recursive = 1;
+            break;
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage();
+    }
+    if (set_compress_mode(COMPRESS_ZSTD) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        if (filelist_add(&files, argv[i], recursive) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    results = calloc(files.count ? files.count : 1, sizeof(Packed));
+    if (results == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    if (pool_run(files.count, jobs, pack_job, &files, stdout) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < files.count; i++)
+    {
+        if (results[i].status == 2)
+        {
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            old_total += results[i].old_size;
+            new_total += results[i].status == 0 ? results[i].new_size : results[i].old_size;
+        }
+    }
+    printf("total\t%lld\t%lld\n", old_total, new_total);
+    free(results);
+    filelist_free(&files);
+    return status;
+}
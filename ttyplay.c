@@ -41,19 +41,44 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/time.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
 
 #include "ttyrec.h"
 #include "io.h"
 #include "compress.h"
 #include "configure.h"
+#include "vt.h"
+#include "live.h"
 
-// Upper sanity bound on a record length read from a (possibly corrupt) file.
-#define MAX_RECORD_LEN    (16 * 1024 * 1024)
+#ifdef HAVE_zstd
+# include "compress_zstd.h"
+#endif
+
+#ifdef HAVE_ppoll
+# include <poll.h>
+#endif
+
+// When peeking (-p), we look for the records to start from in a window at the end of the file,
+// this is its initial size, doubled as needed, up to the max size.
+#define PEEK_WINDOW_SIZE        (64 * 1024)
+#define PEEK_MAX_WINDOW_SIZE    (64 * 1024 * 1024)
+
+// With --max-fps, we write the current frame early if it gets bigger than this
+#define MAX_FRAME_LEN           (1024 * 1024)
+
+// Size of the stdout buffer in no wait mode (-n)
+#define OUTPUT_BUFFER_SIZE      (64 * 1024)
+
+// Upper bound on each dimension of --geometry
+#define MAX_GEOMETRY            10000
 
 typedef double (*WaitFunc) (struct timeval prev,
                             struct timeval cur,
@@ -63,8 +88,21 @@ typedef void (*WriteFunc)    (char *buf, int len);
 typedef void (*ProcessFunc)  (FILE *fp, double speed,
                               ReadFunc read_func, WaitFunc wait_func);
 
+typedef struct chain
+{
+    size_t         count; // number of complete records in the chain
+    size_t         end;   // offset right after the last complete record
+    struct timeval first; // timestamp of the first complete record
+    struct timeval last;  // timestamp of the last complete record
+} Chain;
+
 struct timeval timeval_diff(struct timeval tv1, struct timeval tv2);
-struct timeval timeval_div(struct timeval tv1, double n);
+double timeval_to_double(struct timeval tv);
+struct timespec monotonic_now(void);
+double timespec_diff(struct timespec ts1, struct timespec ts2);
+struct timespec timespec_add(struct timespec ts, double seconds);
+int wait_until(struct timespec deadline);
+void set_anchor(struct timespec clock, double rec, double speed);
 double ttywait(struct timeval prev, struct timeval cur, double speed);
 double ttynowait(struct timeval prev, struct timeval cur, double speed);
 int ttyread(FILE *fp, Header *h, char **buf);
@@ -74,10 +112,58 @@ void ttynowrite(char *buf, int len);
 void ttyplay(FILE *fp, double speed, ReadFunc read_func, WriteFunc write_func, WaitFunc wait_func);
 void ttyskipall(FILE *fp);
 void ttyplayback(FILE *fp, double speed, ReadFunc read_func, WaitFunc wait_func);
+int walk_chain(const char *buf, size_t len, size_t start, Chain *c);
+size_t chain_seek(const char *buf, size_t start, const Chain *c, struct timeval target, size_t *skipped);
+int peek_seek_raw(FILE *fp);
+int peek_seek_zstd(FILE *fp);
 void ttypeek(FILE *fp, double speed, ReadFunc read_func, WaitFunc wait_func);
+int ttylive(const char *name);
+double next_snapshot(size_t at_done, double every_next);
+void snapshot(Terminal *vt, const char *what, double elapsed);
+void ttyrender(FILE *fp, double speed, ReadFunc read_func, WaitFunc wait_func);
+int compare_doubles(const void *a, const void *b);
+int parse_snapshot_at(const char *arg);
 void usage(void);
 FILE *input_from_stdin(void);
 
+// the next record, as far as ttyread() got it so far
+static char   pending_header[HEADER_SIZE];
+static size_t pending_header_len = 0;
+static char   *pending_data      = NULL; // allocated once we have the header
+static size_t pending_data_len   = 0;
+static int    read_failed        = 0; // ttyread() hit something waiting won't fix, see ttypread()
+
+// -c: how many seconds of already recorded output to show before following the file (-p)
+static long peek_context = 0;
+
+// --shm: the shared-memory ring of the session to watch live, and how many KB of its output to show first
+static char *shm_name   = NULL;
+static long shm_context = 16;
+
+// ttywait() scheduling: the monotonic clock instant at which we played the recorded time anchor_rec
+static struct timespec anchor_clock;
+static double          anchor_rec   = 0;
+static double          anchor_speed = 0; // 0 until the first wait
+static int             watch_stdin  = 1; // whether we still wait for keystrokes on stdin
+
+// -i: if set, idle gaps longer than this are shortened to this many seconds
+static double idle_limit = 0;
+
+// -a: if set, idle gaps longer than this are skipped altogether, only activity is played
+static double activity_threshold = 0;
+
+// --max-fps: if set, all the records falling within the same 1/max_fps interval are written at once
+static double max_fps = 0;
+
+// headless rendering: the records are fed to a terminal emulator, and we output what it displays
+static int    render_screen     = 0;    // --screen: the final screen
+static int    render_transcript = 0;    // --transcript: every line that was displayed
+static double snapshot_every    = 0;    // --snapshot-every: the screen every so many seconds
+static double *snapshot_at      = NULL; // --snapshot-at: the screen at these times (sorted)
+static size_t snapshot_at_count = 0;
+static int    render_cols       = 80;   // --geometry
+static int    render_rows       = 24;
+
 
 struct timeval timeval_diff(struct timeval tv1, struct timeval tv2)
 {
@@ -95,89 +181,202 @@ struct timeval timeval_diff(struct timeval tv1, struct timeval tv2)
 }
 
 
-struct timeval timeval_div(struct timeval tv1, double n)
+double timeval_to_double(struct timeval tv)
 {
-    double         x = ((double)tv1.tv_sec + (double)tv1.tv_usec / 1000000.0) / n;
-    struct timeval div;
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
 
-    div.tv_sec  = (int)x;
-    div.tv_usec = (x - (int)x) * 1000000;
+/* current time, on a clock that doesn't jump if we have one */
+struct timespec monotonic_now(void)
+{
+    struct timespec ts;
 
-    return div;
+#ifdef HAVE_clock_gettime
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return ts;
+    }
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts.tv_sec  = tv.tv_sec;
+    ts.tv_nsec = tv.tv_usec * 1000;
+    return ts;
 }
 
 
-double ttywait(struct timeval prev, struct timeval cur, double speed)
+/* ts2 - ts1, in seconds */
+double timespec_diff(struct timespec ts1, struct timespec ts2)
 {
-    static struct timeval drift = { 0, 0 };
-    struct timeval        start;
-    struct timeval        diff = timeval_diff(prev, cur);
-    fd_set                readfs;
+    return (double)(ts2.tv_sec - ts1.tv_sec) + (double)(ts2.tv_nsec - ts1.tv_nsec) / 1000000000.0;
+}
 
-    gettimeofday(&start, NULL);
 
-    assert(speed != 0);
-    diff = timeval_diff(drift, timeval_div(diff, speed));
-    if (diff.tv_sec < 0)
+struct timespec timespec_add(struct timespec ts, double seconds)
+{
+    long long nsec = (long long)ts.tv_nsec + (long long)(seconds * 1000000000.0);
+
+    ts.tv_sec += nsec / 1000000000;
+    nsec      %= 1000000000;
+    if (nsec < 0)
     {
-        diff.tv_sec = diff.tv_usec = 0;
+        ts.tv_sec--;
+        nsec += 1000000000;
     }
+    ts.tv_nsec = nsec;
+    return ts;
+}
 
-    FD_ZERO(&readfs);
-    FD_SET(STDIN_FILENO, &readfs);
 
-    /*
-     * We use select() for sleeping with subsecond precision.
-     * select() is also used to wait user's input from a keyboard.
-     *
-     * Save "diff" since select(2) may overwrite it to {0, 0}.
-     */
-    struct timeval orig_diff = diff;
+/*
+ * Sleep until the given monotonic deadline, unless the user hits a key before.
+ * Returns 1 if there's something to read on stdin, 0 once the deadline is reached.
+ */
+int wait_until(struct timespec deadline)
+{
+    for ( ; ;)
+    {
+        double remaining = timespec_diff(monotonic_now(), deadline);
+        if (remaining <= 0)
+        {
+            return 0;
+        }
+
+        if (!watch_stdin)
+        {
+#if defined(HAVE_clock_nanosleep) && defined(HAVE_clock_gettime)
+            (void)clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+#else
+            struct timespec rem = timespec_add((struct timespec) { 0, 0 }, remaining);
+            (void)nanosleep(&rem, NULL);
+#endif
+            continue;
+        }
+
+#ifdef HAVE_ppoll
+        struct pollfd   pfd = { STDIN_FILENO, POLLIN, 0 };
+        struct timespec rem = timespec_add((struct timespec) { 0, 0 }, remaining);
+        if (ppoll(&pfd, 1, &rem, NULL) > 0)
+        {
+            return 1;
+        }
+#else
+        fd_set readfs;
+        FD_ZERO(&readfs);
+        FD_SET(STDIN_FILENO, &readfs);
+        // round up, to avoid waking up right before the deadline and looping
+        struct timeval rem = { (long)remaining, (long)((remaining - (long)remaining) * 1000000) + 1 };
+        if ((select(STDIN_FILENO + 1, &readfs, NULL, NULL, &rem) > 0) && FD_ISSET(STDIN_FILENO, &readfs))
+        {
+            return 1;
+        }
+#endif
+    }
+}
+
 
-    int r = select(1, &readfs, NULL, NULL, &diff);
-    diff = orig_diff;                    /* Restore the original diff value. */
-    if ((r > 0) && FD_ISSET(0, &readfs)) /* a user hits a character? */
+void set_anchor(struct timespec clock, double rec, double speed)
+{
+    anchor_clock = clock;
+    anchor_rec   = rec;
+    anchor_speed = speed;
+}
+
+
+/*
+ * Playback is anchored to an instant of the monotonic clock and to the recorded time
+ * that was played at this instant: each record has an absolute deadline derived from
+ * its timestamp and the speed, so that sleeping a bit too long (or too short) for one
+ * record never accumulates. We re-anchor when the speed changes, when the user skips ahead,
+ * or when the recorded time goes backward (the clock was set back while recording).
+ */
+double ttywait(struct timeval prev, struct timeval cur, double speed)
+{
+    double rec = timeval_to_double(cur);
+
+    assert(speed != 0);
+    if (anchor_speed == 0)
     {
-        char c[32];
+        // first wait of the playback
+        set_anchor(monotonic_now(), timeval_to_double(prev), speed);
+    }
+    else if (speed != anchor_speed)
+    {
+        struct timespec now = monotonic_now();
+        set_anchor(now, anchor_rec + timespec_diff(anchor_clock, now) * anchor_speed, speed);
+    }
+
+    // -i and -a: shorten long idle gaps, by moving the recorded time anchor forward
+    double gap = rec - timeval_to_double(prev);
+    if (gap < 0)
+    {
+        // play this record right away, and only lose this gap: those after it are relative to it
+        set_anchor(monotonic_now(), rec, anchor_speed);
+    }
+    else if ((activity_threshold > 0) && (gap > activity_threshold))
+    {
+        anchor_rec += gap;
+    }
+    else if ((idle_limit > 0) && (gap > idle_limit))
+    {
+        anchor_rec += gap - idle_limit;
+    }
+
+    for ( ; ;)
+    {
+        struct timespec deadline = timespec_add(anchor_clock, (rec - anchor_rec) / anchor_speed);
+        if (wait_until(deadline) == 0)
+        {
+            break;
+        }
+
+        /* a user hits a character? */
+        char    c[32];
+        ssize_t n = read(STDIN_FILENO, c, 32);
+        if (n <= 0)
+        {
+            // stdin is closed or unusable, just sleep from now on
+            watch_stdin = 0;
+            continue;
+        }
 
         /* If the read size is == 1, it's *probably* a human typing
          * to change ttyplay's behavior, and not the term answering
          * to a control code sent by the running program (e.g. vim)
          */
-        if (read(STDIN_FILENO, c, 32) == 1)
+        if (n != 1)
         {
-            /* drain the character */
-            switch (c[0])
-            {
-            case '+':
-            case 'f':
-                speed *= 2;
-                break;
-
-            case '-':
-            case 's':
-                speed /= 2;
-                break;
-
-            case '1':
-                speed = 1.0;
-                break;
-            }
+            continue;
         }
-        drift.tv_sec = drift.tv_usec = 0;
-    }
-    else
-    {
-        struct timeval stop;
-        gettimeofday(&stop, NULL);
-        /* Hack to accumulate the drift */
-        if ((diff.tv_sec == 0) && (diff.tv_usec == 0))
+
+        struct timespec now = monotonic_now();
+        double          pos = anchor_rec + timespec_diff(anchor_clock, now) * anchor_speed;
+        switch (c[0])
         {
-            diff = timeval_diff(drift, diff);  // diff = 0 - drift.
+        case '+':
+        case 'f':
+            set_anchor(now, pos, anchor_speed * 2);
+            break;
+
+        case '-':
+        case 's':
+            set_anchor(now, pos, anchor_speed / 2);
+            break;
+
+        case '1':
+            set_anchor(now, pos, 1.0);
+            break;
+
+        case ' ':
+        case 'n':
+        default:
+            // go right to the next record
+            set_anchor(now, rec, anchor_speed);
+            return anchor_speed;
         }
-        drift = timeval_diff(diff, timeval_diff(start, stop));
     }
-    return speed;
+    return anchor_speed;
 }
 
 
@@ -191,43 +390,58 @@ double ttynowait(struct timeval prev, struct timeval cur, double speed)
 }
 
 
-/* returns 0 on error */
+/*
+ * Returns 0 on error, or if the next record isn't all there yet. What we got of it is then
+ * kept, and the next call picks up from there: when following a file that's still being
+ * written (-p), we can't go back to the start of the record and read it again, be it from
+ * a pipe, or from a zstd stream, whose decompressor would then be fed the same data twice.
+ */
 int ttyread(FILE *fp, Header *h, char **buf)
 {
-    fpos_t pos;
-    int    can_seek = fgetpos(fp, &pos) == 0;
-
     clearerr(fp);
 
-    if (read_header(fp, h) == 0)
+    if (pending_header_len < HEADER_SIZE)
     {
-        goto err;
+        pending_header_len += fread_wrapper(pending_header + pending_header_len, 1, HEADER_SIZE - pending_header_len, fp);
+        if (pending_header_len < HEADER_SIZE)
+        {
+            goto err;
+        }
     }
+    decode_header(pending_header, h);
 
-    if ((h->len <= 0) || (h->len > MAX_RECORD_LEN))
+    if ((h->len < 0) || (h->len > MAX_RECORD_LEN))
     {
-        /* corrupt/invalid record length: a valid record has 1 <= len <= MAX_RECORD_LEN.
+        /* corrupt/invalid record length: a valid record has 0 <= len <= MAX_RECORD_LEN.
          * reject it instead of feeding a negative (huge) or implausibly large size to malloc. */
         fprintf(stderr, "invalid record length %d\n", h->len);
+        pending_header_len = 0;
+        read_failed        = 1;
         return 0;
     }
 
-    *buf = malloc(h->len);
-    if (*buf == NULL)
+    if (pending_data == NULL)
     {
-        perror("malloc");
-        return 0;
+        // one byte at least, malloc(0) may return NULL
+        pending_data = malloc(h->len > 0 ? h->len : 1);
+        if (pending_data == NULL)
+        {
+            perror("malloc");
+            pending_header_len = 0;
+            read_failed        = 1;
+            return 0;
+        }
     }
-
-    if (fread_wrapper(*buf, 1, h->len, fp) != (size_t)h->len)
+    pending_data_len += fread_wrapper(pending_data + pending_data_len, 1, h->len - pending_data_len, fp);
+    if (pending_data_len < (size_t)h->len)
     {
-        /* short read (truncated/partial record): free the buffer we won't use and fall through
-         * to the seek-back/retry path.
-         */
-        free(*buf);
-        *buf = NULL;
         goto err;
     }
+
+    *buf               = pending_data;
+    pending_data       = NULL;
+    pending_data_len   = 0;
+    pending_header_len = 0;
     return 1;
 
 err:
@@ -235,14 +449,6 @@ err:
     {
         perror("fread");
     }
-    else
-    {
-        /* Short read. Seek back to before header, to set up for retry. */
-        if (can_seek)
-        {
-            fsetpos(fp, &pos);
-        }
-    }
     return 0;
 }
 
@@ -250,15 +456,23 @@ err:
 int ttypread(FILE *fp, Header *h, char **buf)
 {
     /*
-     * Read persistently just like tail -f.
+     * Read persistently just like tail -f, unless what's there is corrupt.
      */
-    while (ttyread(fp, h, buf) == 0)
+    while (!read_failed)
     {
+        if (ttyread(fp, h, buf))
+        {
+            return 1;
+        }
+        if (read_failed)
+        {
+            break;
+        }
         struct timeval w = { 0, 250000 };
         select(0, NULL, NULL, NULL, &w);
         clearerr(fp);
     }
-    return 1;
+    return 0;
 }
 
 
@@ -279,9 +493,12 @@ void ttynowrite(char *buf, int len)
 void ttyplay(FILE *fp, double speed, ReadFunc read_func, WriteFunc write_func, WaitFunc wait_func)
 {
     int            first_time = 1;
-    struct timeval prev;
+    struct timeval prev       = { 0, 0 };
+    char           *frame     = NULL; // output of the records coalesced in the current frame (--max-fps)
+    size_t         frame_len  = 0;
+    size_t         frame_size = 0;
+    int            coalesce   = (max_fps > 0) && (wait_func != ttynowait);
 
-    setbuf(stdout, NULL);
     setbuf(fp, NULL);
 
     while (1)
@@ -294,6 +511,45 @@ void ttyplay(FILE *fp, double speed, ReadFunc read_func, WriteFunc write_func, W
             break;
         }
 
+        if (coalesce)
+        {
+            // as long as we're within the same frame interval than the first record of the
+            // current frame, just append this record to it instead of waiting and writing it
+            struct timeval diff     = timeval_diff(prev, h.tv);
+            int            in_frame = !first_time && (frame_len < MAX_FRAME_LEN) && (diff.tv_sec >= 0) &&
+                                      timeval_to_double(diff) / speed < 1.0 / max_fps;
+            if (!in_frame)
+            {
+                if (frame_len > 0)
+                {
+                    write_func(frame, frame_len);
+                    frame_len = 0;
+                }
+                if (!first_time)
+                {
+                    speed = wait_func(prev, h.tv, speed);
+                }
+                first_time = 0;
+                prev       = h.tv;
+            }
+
+            if (frame_len + h.len > frame_size)
+            {
+                char *newframe = realloc(frame, frame_len + h.len);
+                if (newframe == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                frame      = newframe;
+                frame_size = frame_len + h.len;
+            }
+            memcpy(frame + frame_len, buf, h.len);
+            frame_len += h.len;
+            free(buf);
+            continue;
+        }
+
         if (!first_time)
         {
             speed = wait_func(prev, h.tv, speed);
@@ -304,6 +560,12 @@ void ttyplay(FILE *fp, double speed, ReadFunc read_func, WriteFunc write_func, W
         prev = h.tv;
         free(buf);
     }
+
+    if (frame_len > 0)
+    {
+        write_func(frame, frame_len);
+    }
+    free(frame);
 }
 
 
@@ -323,23 +585,508 @@ void ttyplayback(FILE *fp, double speed, ReadFunc read_func, WaitFunc wait_func)
 }
 
 
+/*
+ * Follow the chain of records found in buf from offset 'start'. Returns 1 if they
+ * chain up to the end of buf (the last record may be incomplete, as it might
+ * still be being written), and fills 'c' accordingly. Returns 0 otherwise.
+ */
+int walk_chain(const char *buf, size_t len, size_t start, Chain *c)
+{
+    size_t pos = start;
+
+    memset(c, 0, sizeof(*c));
+    c->end = start;
+
+    while (len - pos >= HEADER_SIZE)
+    {
+        Header h;
+        decode_header(buf + pos, &h);
+        // records may be empty, but a zero timestamp only is in runs of zeros, never a recording
+        if ((h.tv.tv_sec <= 0) || (h.tv.tv_usec >= 1000000) || (h.len < 0) || (h.len > MAX_RECORD_LEN))
+        {
+            return 0;
+        }
+        if ((c->count > 0) && timercmp(&h.tv, &c->last, <))
+        {
+            return 0;
+        }
+        if (len - pos - HEADER_SIZE < (size_t)h.len)
+        {
+            // incomplete last record
+            break;
+        }
+        pos += HEADER_SIZE + h.len;
+        if (c->count++ == 0)
+        {
+            c->first = h.tv;
+        }
+        c->last = h.tv;
+        c->end  = pos;
+    }
+    return 1;
+}
+
+
+/*
+ * Returns the offset of the first complete record of chain 'c' (starting at 'start')
+ * which is not older than 'target', or the end of the chain if there's none.
+ * The number of records before this one is stored in 'skipped'.
+ */
+size_t chain_seek(const char *buf, size_t start, const Chain *c, struct timeval target, size_t *skipped)
+{
+    size_t pos = start;
+
+    for (*skipped = 0; *skipped < c->count; (*skipped)++)
+    {
+        Header h;
+        decode_header(buf + pos, &h);
+        if (!timercmp(&h.tv, &target, <))
+        {
+            break;
+        }
+        pos += HEADER_SIZE + h.len;
+    }
+    return pos;
+}
+
+
+/*
+ * Position an uncompressed file near its end for peeking, without reading it all:
+ * read a window at the end of the file, and find the first offset in it from which
+ * a valid chain of records leads to EOF. Returns 0 on success, -1 if we couldn't.
+ */
+int peek_seek_raw(FILE *fp)
+{
+    long size, window;
+
+    if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) < 0))
+    {
+        return -1;
+    }
+
+    for (window = PEEK_WINDOW_SIZE; ; window *= 2)
+    {
+        long   start = size > window ? size - window : 0;
+        size_t len   = size - start;
+        char   *buf  = malloc(len + 1);
+        Chain  c;
+        size_t p     = 0;
+        int    found = 0;
+
+        if ((buf == NULL) || (fseek(fp, start, SEEK_SET) != 0) || (fread(buf, 1, len, fp) != len))
+        {
+            free(buf);
+            return -1;
+        }
+
+        // if the window covers the whole file, the chain must start right at the beginning
+        while (!found && (p < len) && (start > 0 || p == 0))
+        {
+            found = walk_chain(buf, len, p, &c) && c.count > 0;
+            if (!found)
+            {
+                p++;
+            }
+        }
+
+        if ((!found || ((peek_context > 0) && (c.last.tv_sec - c.first.tv_sec < peek_context))) &&
+            (start > 0) && (window < PEEK_MAX_WINDOW_SIZE))
+        {
+            // nothing found, or not enough context: try again with a bigger window
+            free(buf);
+            continue;
+        }
+        if (!found)
+        {
+            free(buf);
+            return -1;
+        }
+
+        size_t offset = c.end;
+        if (peek_context > 0)
+        {
+            size_t         skipped;
+            struct timeval target = c.last;
+            target.tv_sec -= peek_context;
+            offset         = chain_seek(buf, p, &c, target, &skipped);
+        }
+        free(buf);
+        return fseek(fp, start + offset, SEEK_SET) == 0 ? 0 : -1;
+    }
+}
+
+
+#ifdef HAVE_zstd
+/*
+ * Find the last frame of a zstd-compressed file starting before offset 'before' which
+ * decompresses (into buf, of PEEK_MAX_WINDOW_SIZE bytes) to a chain of at least one
+ * record: bytes that merely look like a frame header, or a frame that was only just
+ * started, are skipped. Returns its offset, with its content in buf, len and c, or -1.
+ */
+static long peek_find_frame(FILE *fp, long before, char *buf, size_t *len, Chain *c)
+{
+    long frame = before;
+
+    while ((frame = zstd_find_prev_frame(fp, frame)) >= 0)
+    {
+        *len = zstd_decompress_frame(fp, frame, buf, PEEK_MAX_WINDOW_SIZE);
+        if ((*len < PEEK_MAX_WINDOW_SIZE) && walk_chain(buf, *len, 0, c) && (c->count > 0))
+        {
+            return frame;
+        }
+        if (before - frame >= ZSTD_MAX_SCAN_DISTANCE)
+        {
+            break;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Position a zstd-compressed file near its end for peeking: the writer regularly
+ * starts new frames on record boundaries, so we only need to find and decompress
+ * the last one (or the last few ones if we need some context) instead of the whole file.
+ * Returns 0 on success, -1 if we couldn't.
+ */
+int peek_seek_zstd(FILE *fp)
+{
+    long   size, frame, prev;
+    char   *buf;
+    size_t len, skip;
+    Chain  c;
+    int    ret = -1;
+
+    if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) < 0))
+    {
+        return -1;
+    }
+    if ((buf = malloc(PEEK_MAX_WINDOW_SIZE)) == NULL)
+    {
+        return -1;
+    }
+
+    // the last frame might have no record yet, then the previous one has our last timestamp
+    frame = peek_find_frame(fp, size, buf, &len, &c);
+    if (frame < 0)
+    {
+        goto out;
+    }
+    skip = c.count;
+
+    if (peek_context > 0)
+    {
+        // go back frame by frame until we have enough context
+        struct timeval target = c.last;
+        long           cur    = frame;
+
+        target.tv_sec -= peek_context;
+        while (timercmp(&c.first, &target, >))
+        {
+            if ((prev = peek_find_frame(fp, cur, buf, &len, &c)) < 0)
+            {
+                break;
+            }
+            cur = prev;
+        }
+
+        frame = cur;
+        len   = zstd_decompress_frame(fp, frame, buf, PEEK_MAX_WINDOW_SIZE);
+        if (!walk_chain(buf, len, 0, &c))
+        {
+            goto out;
+        }
+        (void)chain_seek(buf, 0, &c, target, &skip);
+    }
+
+    if (fseek(fp, frame, SEEK_SET) != 0)
+    {
+        goto out;
+    }
+    // now skip the records we don't want to show, we know they're all there
+    for ( ; skip > 0; skip--)
+    {
+        char   *rbuf;
+        Header h;
+        if (ttyread(fp, &h, &rbuf) == 0)
+        {
+            goto out;
+        }
+        free(rbuf);
+    }
+    ret = 0;
+
+out:
+    free(buf);
+    return ret;
+}
+
+
+#endif
+
+
 void ttypeek(FILE *fp, double speed, ReadFunc read_func, WaitFunc wait_func)
 {
+    int positioned;
+
     (void)read_func;
     (void)wait_func;
-    ttyskipall(fp);
+    setbuf(fp, NULL);
+
+#ifdef HAVE_zstd
+    if (get_compress_mode() == COMPRESS_ZSTD)
+    {
+        positioned = peek_seek_zstd(fp);
+    }
+    else
+#endif
+    {
+        positioned = peek_seek_raw(fp);
+    }
+
+    if (positioned != 0)
+    {
+        // slow path: not seekable (stdin), or we couldn't make sense of the end of the file.
+        // we may have fed the decompressor from some frame already, it has to start over
+        (void)fseek(fp, 0, SEEK_SET);
+#ifdef HAVE_zstd
+        if (get_compress_mode() == COMPRESS_ZSTD)
+        {
+            zstd_reset_stream();
+        }
+#endif
+        free(pending_data);
+        pending_data       = NULL;
+        pending_data_len   = 0;
+        pending_header_len = 0;
+        read_failed        = 0;
+        ttyskipall(fp);
+    }
     ttyplay(fp, speed, ttypread, ttywrite, ttynowait);
 }
 
 
+/*
+ * --shm: watch a session live, right from the shared-memory ring its ttyrec publishes
+ * its output to. We show the last --shm-context KB of it, then whatever it outputs, as
+ * soon as it does, until it ends. If we can't keep up, what we missed is skipped.
+ */
+int ttylive(const char *name)
+{
+    Live               *l = live_attach(name, (size_t)shm_context * 1024);
+    Header             h;
+    char               *buf;
+    unsigned long long lost = 0;
+
+    if (l == NULL)
+    {
+        fprintf(stderr, "Couldn't attach to the live view ring %s: %s\n", name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    setbuf(stdout, NULL);
+    while (live_read(l, &h, &buf, &lost))
+    {
+        ttywrite(buf, h.len);
+    }
+    live_detach(l);
+    if (lost > 0)
+    {
+        fprintf(stderr, "\r\n%llu bytes of output were overwritten before we could show them\r\n", lost);
+    }
+    return 0;
+}
+
+
+/*
+ * Time of the next snapshot to take, in seconds since the first record, given
+ * how many --snapshot-at times are done and the next --snapshot-every time.
+ * Returns -1 if there's none left.
+ */
+double next_snapshot(size_t at_done, double every_next)
+{
+    double next = -1;
+
+    if (at_done < snapshot_at_count)
+    {
+        next = snapshot_at[at_done];
+    }
+    if ((snapshot_every > 0) && ((next < 0) || (every_next < next)))
+    {
+        next = every_next;
+    }
+    return next;
+}
+
+
+void snapshot(Terminal *vt, const char *what, double elapsed)
+{
+    printf("=== %s at %.3fs ===\n", what, elapsed);
+    vt_dump(vt, stdout);
+}
+
+
+/*
+ * Headless mode: run the records through the terminal emulator as fast as they
+ * can be read, and output the screen contents instead of the raw stream.
+ */
+void ttyrender(FILE *fp, double speed, ReadFunc read_func, WaitFunc wait_func)
+{
+    Terminal       *vt        = vt_new(render_cols, render_rows);
+    char           *buf       = NULL;
+    size_t         buf_size   = 0;
+    int            first_time = 1;
+    struct timeval start      = { 0, 0 };
+    double         elapsed    = 0;
+    size_t         at_done    = 0;
+    double         every_next = snapshot_every;
+    double         next;
+    Header         h;
+
+    (void)speed;
+    (void)read_func;
+    (void)wait_func;
+
+    if (vt == NULL)
+    {
+        perror("vt_new");
+        exit(EXIT_FAILURE);
+    }
+    if (render_transcript)
+    {
+        vt_set_transcript(vt, stdout);
+    }
+
+    while (read_header(fp, &h))
+    {
+        if ((h.len < 0) || (h.len > MAX_RECORD_LEN))
+        {
+            fprintf(stderr, "invalid record length %d\n", h.len);
+            break;
+        }
+        if ((size_t)h.len > buf_size)
+        {
+            char *newbuf = realloc(buf, h.len);
+            if (newbuf == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            buf      = newbuf;
+            buf_size = h.len;
+        }
+        if (fread_wrapper(buf, 1, h.len, fp) != (size_t)h.len)
+        {
+            break;
+        }
+
+        if (first_time)
+        {
+            start      = h.tv;
+            first_time = 0;
+        }
+        elapsed = timeval_to_double(timeval_diff(start, h.tv));
+
+        // the screen at time T is the one right before the first record past T
+        while ((next = next_snapshot(at_done, every_next)) >= 0 && next < elapsed)
+        {
+            snapshot(vt, "snapshot", next);
+            if ((at_done < snapshot_at_count) && (snapshot_at[at_done] == next))
+            {
+                at_done++;
+            }
+            if ((snapshot_every > 0) && (every_next == next))
+            {
+                every_next += snapshot_every;
+            }
+        }
+
+        vt_feed(vt, buf, h.len);
+    }
+
+    // --snapshot-at times past the end of the record all show the final screen
+    for ( ; at_done < snapshot_at_count; at_done++)
+    {
+        snapshot(vt, "snapshot", snapshot_at[at_done]);
+    }
+
+    vt_end_transcript(vt);
+
+    if (render_screen)
+    {
+        if ((snapshot_every > 0) || (snapshot_at_count > 0))
+        {
+            snapshot(vt, "end", elapsed);
+        }
+        else
+        {
+            vt_dump(vt, stdout);
+        }
+    }
+
+    vt_free(vt);
+    free(buf);
+}
+
+
+int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+
+/* parse a comma-separated list of seconds for --snapshot-at, returns 0 on error */
+int parse_snapshot_at(const char *arg)
+{
+    const char *p = arg;
+
+    while (*p != '\0')
+    {
+        char   *end;
+        double t = strtod(p, &end);
+        if ((end == p) || (t < 0) || ((*end != ',') && (*end != '\0')))
+        {
+            return 0;
+        }
+
+        double *newlist = realloc(snapshot_at, (snapshot_at_count + 1) * sizeof(double));
+        if (newlist == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        snapshot_at                      = newlist;
+        snapshot_at[snapshot_at_count++] = t;
+
+        p = (*end == ',') ? end + 1 : end;
+    }
+    qsort(snapshot_at, snapshot_at_count, sizeof(double), compare_doubles);
+    return snapshot_at_count > 0;
+}
+
+
 void usage(void)
 {
     printf("Usage: ttyplay [OPTION] [FILE]\n");
-    printf("  -s SPEED Set speed to SPEED [1.0]\n");
-    printf("  -n       No wait mode\n");
-    printf("  -p       Peek another person's ttyrecord\n");
+    printf("  -s, --speed SPEED      Set speed to SPEED [1.0]\n");
+    printf("  -n, --no-wait          No wait mode\n");
+    printf("  -p, --peek             Peek another person's ttyrecord\n");
+    printf("  -c, --context SECS     When peeking, first show the last SECS seconds of the record\n");
+    printf("  -i, --idle-limit SECS  Shorten any idle gap longer than SECS seconds to SECS seconds\n");
+    printf("  -a, --activity SECS    Activity-only mode: skip any idle gap longer than SECS seconds\n");
+    printf("      --max-fps N        Write at most N times per second, coalescing the records in between\n");
+    printf("      --shm NAME         Watch live the session recorded by ttyrec --shm NAME\n");
+    printf("      --shm-context KB   With --shm, first show the last KB kilobytes of output [16]\n");
+    printf("\nHeadless rendering, as fast as possible, with the output of a virtual terminal:\n");
+    printf("      --screen           Print the final screen\n");
+    printf("      --transcript       Print every line that was displayed, as plain text\n");
+    printf("      --snapshot-every S Print the screen every S seconds of the record\n");
+    printf("      --snapshot-at T,.. Print the screen at these times, in seconds from the start\n");
+    printf("      --geometry CxR     Size of the virtual terminal, in columns and rows [80x24]\n");
 #ifdef HAVE_zstd
-    printf("  -Z       Enable on-the-fly zstd decompression\n");
+    printf("  -Z, --zstd             Enable on-the-fly zstd decompression\n");
     printf("\nThe -Z flag is implied if the file suffix is \".zst\"\n");
 #endif
     exit(EXIT_FAILURE);
@@ -371,17 +1118,105 @@ int main(int argc, char **argv)
     set_progname(argv[0]);
     while (1)
     {
+        static struct option long_options[] =
+        {
+            /*
+             * "long-opt-name",   a, b, c
+             * a: 1 if requires an arg, 0 otherwise
+             * b: always 0
+             * c: an optional char for the corresponding short-option, 0 otherwise
+             */
+            { "speed",          1, 0, 's' },
+            { "no-wait",        0, 0, 'n' },
+            { "peek",           0, 0, 'p' },
+            { "context",        1, 0, 'c' },
+            { "idle-limit",     1, 0, 'i' },
+            { "activity",       1, 0, 'a' },
+            { "max-fps",        1, 0, 0   },
+            { "screen",         0, 0, 0   },
+            { "transcript",     0, 0, 0   },
+            { "snapshot-every", 1, 0, 0   },
+            { "snapshot-at",    1, 0, 0   },
+            { "geometry",       1, 0, 0   },
+            { "shm",            1, 0, 0   },
+            { "shm-context",    1, 0, 0   },
+#ifdef HAVE_zstd
+            { "zstd",           0, 0, 'Z' },
+#endif
+            { "help",           0, 0, 'h' },
+            { 0,                0, 0, 0   }
+        };
+        int option_index = 0;
 #ifdef HAVE_zstd
-        int ch = getopt(argc, argv, "hs:npZ");
+        int ch = getopt_long(argc, argv, "hs:npc:i:a:Z", long_options, &option_index);
 #else
-        int ch = getopt(argc, argv, "hs:np");
+        int ch = getopt_long(argc, argv, "hs:npc:i:a:", long_options, &option_index);
 #endif
-        if (ch == EOF)
+        if (ch == -1)
         {
             break;
         }
         switch (ch)
         {
+        // long option without short-option counterpart
+        case 0:
+            if (strcmp(long_options[option_index].name, "max-fps") == 0)
+            {
+                if ((optarg == NULL) || (sscanf(optarg, "%lf", &max_fps) != 1) || (max_fps <= 0))
+                {
+                    fprintf(stderr, "--max-fps option requires a strictly positive number\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "screen") == 0)
+            {
+                render_screen = 1;
+            }
+            else if (strcmp(long_options[option_index].name, "transcript") == 0)
+            {
+                render_transcript = 1;
+            }
+            else if (strcmp(long_options[option_index].name, "snapshot-every") == 0)
+            {
+                if ((optarg == NULL) || (sscanf(optarg, "%lf", &snapshot_every) != 1) || (snapshot_every <= 0))
+                {
+                    fprintf(stderr, "--snapshot-every option requires a strictly positive number of seconds\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "snapshot-at") == 0)
+            {
+                if ((optarg == NULL) || !parse_snapshot_at(optarg))
+                {
+                    fprintf(stderr, "--snapshot-at option requires a comma-separated list of positive numbers of seconds\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "geometry") == 0)
+            {
+                char extra;
+                if ((optarg == NULL) || (sscanf(optarg, "%dx%d%c", &render_cols, &render_rows, &extra) != 2) ||
+                    (render_cols <= 0) || (render_rows <= 0) || (render_cols > MAX_GEOMETRY) || (render_rows > MAX_GEOMETRY))
+                {
+                    fprintf(stderr, "--geometry option requires a size such as 80x24\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "shm") == 0)
+            {
+                shm_name = optarg;
+            }
+            else if (strcmp(long_options[option_index].name, "shm-context") == 0)
+            {
+                if ((optarg == NULL) || (sscanf(optarg, "%ld", &shm_context) != 1) || (shm_context < 0) ||
+                    ((unsigned long)shm_context > SIZE_MAX / 1024))
+                {
+                    fprintf(stderr, "--shm-context option requires a positive number of kilobytes\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+
         case 's':
             if ((optarg == NULL) || (sscanf(optarg, "%lf", &speed) != 1) || (speed <= 0))
             {
@@ -398,6 +1233,30 @@ int main(int argc, char **argv)
             process = ttypeek;
             break;
 
+        case 'c':
+            if ((optarg == NULL) || (sscanf(optarg, "%ld", &peek_context) != 1) || (peek_context < 0))
+            {
+                fprintf(stderr, "-c option requires a positive number of seconds\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'i':
+            if ((optarg == NULL) || (sscanf(optarg, "%lf", &idle_limit) != 1) || (idle_limit <= 0))
+            {
+                fprintf(stderr, "-i option requires a strictly positive number of seconds\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'a':
+            if ((optarg == NULL) || (sscanf(optarg, "%lf", &activity_threshold) != 1) || (activity_threshold <= 0))
+            {
+                fprintf(stderr, "-a option requires a strictly positive number of seconds\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
 #ifdef HAVE_zstd
         case 'Z':
             set_compress_mode(COMPRESS_ZSTD);
@@ -410,6 +1269,12 @@ int main(int argc, char **argv)
         }
     }
 
+    if (shm_name != NULL)
+    {
+        // no file, no terminal settings: we just follow the ring
+        return ttylive(shm_name);
+    }
+
     if (optind < argc)
     {
         input = efopen(argv[optind], "r");
@@ -427,12 +1292,36 @@ int main(int argc, char **argv)
     }
     assert(input != NULL);
 
+    if (render_screen || render_transcript || (snapshot_every > 0) || (snapshot_at_count > 0))
+    {
+        process = ttyrender;
+    }
+
+    if ((process == ttyrender) || ((process == ttyplayback) && (wait_func == ttynowait)))
+    {
+        // nobody is watching in real time, let stdio do big writes
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+    else
+    {
+        setbuf(stdout, NULL);
+    }
+
+    if (process == ttyrender)
+    {
+        // no terminal involved, no keystrokes to wait for
+        process(input, speed, read_func, wait_func);
+        fflush(stdout);
+        return 0;
+    }
+
     tcgetattr(0, &old);                       /* Get current terminal state */
     new          = old;                       /* Make a copy */
     new.c_lflag &= ~(ICANON | ECHO | ECHONL); /* unbuffered, no echo */
     tcsetattr(0, TCSANOW, &new);              /* Make it current */
 
     process(input, speed, read_func, wait_func);
+    fflush(stdout);
     tcsetattr(0, TCSANOW, &old);              /* Return terminal state */
 
     return 0;
@@ -84,11 +84,18 @@
 #include <sys/utsname.h>     // uname
 #include <time.h>            // localtime
 #include <getopt.h>          // getopt_long
+#include <sys/socket.h>      // socket, sendmsg
+#include <sys/un.h>          // sockaddr_un
+#include <poll.h>            // poll
+#include <limits.h>          // INT_MAX
 
 #include "configure.h"
 #include "ttyrec.h"
 #include "io.h"
 #include "compress.h"
+#include "summary.h"
+#include "ttyrecd.h"
+#include "live.h"
 
 #ifdef HAVE_openpty
 # if defined(HAVE_openpty_pty_h)
@@ -161,22 +168,96 @@
 #define printdbg(...)     if (opt_debug > 0) { fprintf(stderr, __VA_ARGS__); }
 #define printdbg2(...)    if (opt_debug > 1) { fprintf(stderr, __VA_ARGS__); }
 
+// time-based rotations happen up to this percentage of --rotate-interval early, at random,
+// so that sessions started together don't all rotate together again and again
+#define ROTATE_JITTER_PERCENT    10
+
+// --fanout: at most this many subscribers at a time, each with this many bytes of records queued by default
+#define FANOUT_MAX_SUBSCRIBERS    32
+#define FANOUT_DEFAULT_QUEUE      (256 * 1024)
+// at the end of the session, how long they get to take what's queued, see fanout_drain()
+#define FANOUT_DRAIN_MS           1000
+
+// --output-overflow: what to do when the terminal falls --output-queue behind, see output_write()
+#define OUTPUT_OVERFLOW_BLOCK    0 // wait for room, the session is held back as without a queue
+#define OUTPUT_OVERFLOW_DROP     1 // the terminal misses output until it has caught up
+
+// a ttyrec file being written, and what we need to close it properly, see close_segment()
+typedef struct segment
+{
+    Writer         *writer;
+    char           *name;
+    Summary        summary;       // of what has been written to it, see summary.h
+    int            summary_known; // 0 if we appended to a file that had no valid summary
+    off_t          allocated;     // end of the disk space reserved with --prealloc, see preallocate()
+    int            remote;        // written by ttyrecd rather than by us, see daemon_open()
+    struct segment *next;         // in the queue of the closer thread, see close_in_background()
+} Segment;
+
+// a client of the --fanout socket, see fanout_thread()
+typedef struct subscriber
+{
+    int    fd;
+    char   *queue;   // the records it has yet to get, a ring of --fanout-queue bytes
+    size_t start;    // where the next byte to send is in the ring
+    size_t len;      // how many are waiting
+    int    dropping; // it went over budget: no more records until it's caught up, see fanout_publish()
+    size_t left;     // how much of the record being sent is still to be, 0 between two records
+} Subscriber;
+
 // functions used in the main() before the forks
 void fixtty(void);
 void help(void);
 void set_ttyrec_file_name(char **nameptr);
+int unique_file_name(char **nameptr, int n);
+long long parse_size(const char *str);
 void getmaster(void);
 
 // functions used by the parent
 void doinput(void);
 void sigwinch_handler_parent(int signal);
 void *timeout_watcher(void *arg);
+long long timeout_check(long long now);
+void watcher_wake(void);
 void do_lock(void);
 void handle_cheatcodes(char c);
 
 // functions used by the child
 void dooutput(void);
+int write_all(int fd, const char *buf, size_t len);
 void sigwinch_handler_child(int signal);
+void rotate_output_file(void);
+void rotation_requested(void);
+void schedule_rotation(time_t now);
+int rotation_due(time_t now, int len);
+void *closer_thread(void *arg);
+void close_in_background(Segment *seg);
+void closer_drain(void);
+void preallocate(Segment *seg);
+long long now_ms(void);
+void *sync_thread(void *arg);
+void sync_start(void);
+void sync_hold(void);
+void sync_release(int wrote);
+void sync_stop(void);
+struct timeval *flush_timeout(struct timeval *tv);
+void flush_idle(void);
+int fanout_stale(const struct sockaddr_un *addr);
+int fanout_listen(const char *path);
+void fanout_start(void);
+int fanout_send(Subscriber *s, int finish);
+void fanout_remove(int i);
+void fanout_drain(void);
+void *fanout_thread(void *arg);
+void fanout_publish(Header *h, const char *buf);
+void fanout_stop(void);
+void output_start(void);
+void *output_thread(void *arg);
+int output_write(const char *buf, size_t len);
+void output_kick(void);
+void output_stop(void);
+void draw_lock_screen(void);
+void draw_unlock_screen(void);
 
 // functions used by the subchild
 void doshell(const char *, char **);
@@ -191,6 +272,18 @@ void sigterm_handler(int signal);
 void sighup_handler(int signal);
 
 // other functions used by parent and child
+void summary_open(const char *name);
+int open_segment(Segment *seg, const char *name, const char *mode);
+int daemon_connect(const char *path);
+int daemon_send(const void *buf, size_t len);
+int daemon_open(Segment *seg, const char *name, FILE *fp);
+int daemon_record(Header *h, const char *buf);
+void daemon_close(void);
+void daemon_lost(void);
+void forget_script(void);
+void trim_preallocated(Segment *seg);
+void close_segment(Segment *seg);
+void close_script(void);
 void done(int status);
 void fail(void);
 void print_termios_info(int fd, const char *prefix);
@@ -205,14 +298,16 @@ static const char *ansi_restore       = "\033[?47l";
 static const char *ansi_savecursor    = "\0337";
 static const char *ansi_restorecursor = "\0338";
 
-static time_t last_activity = 0;
-static time_t locked_since  = 0;
-static int    lock_warned   = 0;
-static int    kill_warned   = 0;
+// on the now_ms() clock, for timeout_watcher()
+static long long last_activity = 0;
+static long long locked_since  = 0;
+static int       lock_warned   = 0;
+static int       kill_warned   = 0;
+static int       watcher_pipe[2] = { -1, -1 }; // a byte in it has timeout_watcher() look at the deadlines again
 
 static const char version[] = "1.2.0.0";
 
-static FILE *fscript;
+static Segment script;          // the file we're writing to
 static int  child;
 static int  subchild;
 static char *me = NULL;
@@ -253,6 +348,73 @@ static int  opt_cheatcodes      = 0;
 static int  opt_stealth_stdout  = 0;
 static int  opt_stealth_stderr  = 0;
 static char *opt_custom_message = NULL;
+static int  opt_summary         = 0;
+
+static long long opt_rotate_size     = 0; // --rotate-size, in bytes
+static long      opt_rotate_interval = 0; // --rotate-interval, in seconds
+static time_t    rotate_deadline     = 0; // when the current file is due for a time-based rotation
+static long long rotate_written      = 0; // bytes of records in the current file, for --rotate-size
+static int       opt_fsync           = 0; // --fsync
+static long long opt_prealloc        = 0; // --prealloc, in bytes
+static long      opt_sync_interval   = 0; // --sync-interval-ms
+static char      *opt_daemon         = NULL; // --daemon, the socket of ttyrecd
+static int       daemon_sock         = -1;   // connected to it, see daemon_connect()
+static char      *opt_shm            = NULL; // --shm, the name of the live view ring
+static long long opt_shm_size        = LIVE_DEFAULT_SIZE; // --shm-size, in bytes
+static Live      *live               = NULL; // the ring itself, see live_create()
+static char      *opt_fanout         = NULL; // --fanout, the socket to stream the session on
+static long long opt_fanout_queue    = FANOUT_DEFAULT_QUEUE; // --fanout-queue, per subscriber, in bytes
+static long long opt_output_queue    = 0; // --output-queue, in bytes, 0 to write to the terminal ourselves
+static int       opt_output_overflow = OUTPUT_OVERFLOW_BLOCK; // --output-overflow
+
+static volatile sig_atomic_t rotate_requested = 0; // set by SIGUSR1, see swing_output_file()
+
+// rotated files are closed by a background thread, so that recording goes on meanwhile
+static pthread_mutex_t closer_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  closer_cond    = PTHREAD_COND_INITIALIZER;
+static Segment         *closer_queue  = NULL; // oldest first
+static int             closer_busy    = 0;    // the thread is closing a file, out of the queue
+static int             closer_started = 0;
+
+// the sync thread, see sync_thread(): sync_lock guards script.writer while it runs
+static pthread_mutex_t sync_lock;
+static int             sync_started     = 0;
+static int             sync_stopping    = 0;
+static int             sync_dirty       = 0; // records were written since the last sync
+static long long       sync_dirty_since = 0; // when the first of them was, see now_ms()
+static unsigned long   sync_count       = 0;
+static long long       sync_lag_max     = 0; // the longest a record had to wait to be on disk, in ms
+
+// the fanout thread, see fanout_thread(): fanout_lock guards the subscribers and their queues
+static pthread_mutex_t    fanout_lock;
+static pthread_t          fanout_tid;
+static int                fanout_started  = 0;
+static int                fanout_stopping = 0;
+static int                fanout_listener = -1;
+static int                fanout_wake[2]  = { -1, -1 }; // a byte in it wakes the thread up
+static int                fanout_woken    = 0;          // there's one already
+static Subscriber         fanout_subs[FANOUT_MAX_SUBSCRIBERS];
+static int                fanout_count    = 0;
+static unsigned long      fanout_accepted = 0;          // subscribers, all in all
+static unsigned long long fanout_dropped  = 0;          // records, all subscribers together
+
+// the output thread, see output_thread(): output_lock guards the queue
+static pthread_mutex_t    output_lock;
+static pthread_cond_t     output_cond     = PTHREAD_COND_INITIALIZER; // the queue shrunk, or the thread woke up
+static pthread_t          output_tid;
+static int                output_started  = 0;
+static int                output_stopping = 0;
+static int                output_failed   = 0;          // the terminal's gone
+static int                output_wake[2]  = { -1, -1 }; // a byte in it wakes the thread up
+static int                output_woken    = 0;          // there's one already, from output_write()
+static char               *output_queue   = NULL;       // what the terminal has yet to get, a ring of --output-queue bytes
+static size_t             output_head     = 0;          // where the next byte to write is in the ring
+static size_t             output_len      = 0;          // how many are waiting
+static size_t             output_len_max  = 0;
+static int                output_dropping = 0;          // over budget with --output-overflow drop, see output_write()
+static unsigned long long output_dropped  = 0;          // bytes the terminal missed
+static long long          output_blocked  = 0;          // ms the session was held back by the terminal, see dooutput()
+
 
 static int use_tty   = 1; // no=0, yes=1
 static int can_exit  = 0;
@@ -306,6 +468,19 @@ int main(int argc, char **argv)
             { "name-format",      1, 0, 'F' },
             { "warn-before-lock", 1, 0, 0   },
             { "warn-before-kill", 1, 0, 0   },
+            { "summary",          0, 0, 0   },
+            { "rotate-size",      1, 0, 0   },
+            { "rotate-interval",  1, 0, 0   },
+            { "fsync",            0, 0, 0   },
+            { "prealloc",         1, 0, 0   },
+            { "sync-interval-ms", 1, 0, 0   },
+            { "daemon",           2, 0, 0   },
+            { "shm",              1, 0, 0   },
+            { "shm-size",         1, 0, 0   },
+            { "fanout",           1, 0, 0   },
+            { "fanout-queue",     1, 0, 0   },
+            { "output-queue",     1, 0, 0   },
+            { "output-overflow",  1, 0, 0   },
             { "usage",            0, 0, 'h' },
             { 0,                  0, 0, 0   }
         };
@@ -365,6 +540,123 @@ int main(int argc, char **argv)
                     exit(EXIT_FAILURE);
                 }
             }
+            else if (strcmp(long_options[option_index].name, "daemon") == 0)
+            {
+                opt_daemon = optarg != NULL ? optarg : TTYRECD_SOCKET;
+            }
+            else if (strcmp(long_options[option_index].name, "shm") == 0)
+            {
+#ifdef HAVE_shm_open
+                opt_shm = optarg;
+#else
+                fprintf(stderr, "Ignored option 'shm': shm_open() not supported on this system.\r\n");
+#endif
+            }
+            else if (strcmp(long_options[option_index].name, "fanout") == 0)
+            {
+                opt_fanout = optarg;
+            }
+            else if (strcmp(long_options[option_index].name, "fanout-queue") == 0)
+            {
+                opt_fanout_queue = parse_size(optarg);
+                if ((opt_fanout_queue < 64 * 1024) || ((unsigned long long)opt_fanout_queue > SIZE_MAX / 2))
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected a size of at least 64K, optionally suffixed with K, M or G\r\n", long_options[option_index].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "output-queue") == 0)
+            {
+                opt_output_queue = parse_size(optarg);
+                if ((opt_output_queue < 64 * 1024) || ((unsigned long long)opt_output_queue > SIZE_MAX / 2))
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected a size of at least 64K, optionally suffixed with K, M or G\r\n", long_options[option_index].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "output-overflow") == 0)
+            {
+                if (strcmp(optarg, "block") == 0)
+                {
+                    opt_output_overflow = OUTPUT_OVERFLOW_BLOCK;
+                }
+                else if (strcmp(optarg, "drop") == 0)
+                {
+                    opt_output_overflow = OUTPUT_OVERFLOW_DROP;
+                }
+                else
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected block or drop\r\n", long_options[option_index].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "shm-size") == 0)
+            {
+                opt_shm_size = parse_size(optarg);
+                if ((opt_shm_size < LIVE_MIN_SIZE) || ((unsigned long long)opt_shm_size > SIZE_MAX / 2))
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected a size of at least %dK, optionally suffixed with K, M or G\r\n", long_options[option_index].name, optarg, LIVE_MIN_SIZE / 1024);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "summary") == 0)
+            {
+                opt_summary = 1;
+            }
+            else if (strcmp(long_options[option_index].name, "rotate-size") == 0)
+            {
+                opt_rotate_size = parse_size(optarg);
+                if (opt_rotate_size <= 0)
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected a strictly positive size in bytes, optionally suffixed with K, M or G\r\n", long_options[option_index].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "fsync") == 0)
+            {
+                opt_fsync = 1;
+            }
+            else if (strcmp(long_options[option_index].name, "prealloc") == 0)
+            {
+                opt_prealloc = parse_size(optarg);
+                if (opt_prealloc <= 0)
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected a strictly positive size in bytes, optionally suffixed with K, M or G\r\n", long_options[option_index].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+#ifndef HAVE_fallocate
+                fprintf(stderr, "Ignored option 'prealloc': fallocate() not supported on this system.\r\n");
+                opt_prealloc = 0;
+#endif
+            }
+            else if (strcmp(long_options[option_index].name, "sync-interval-ms") == 0)
+            {
+                errno = 0;
+                opt_sync_interval = strtol(optarg, NULL, 10);
+                if ((errno != 0) || (opt_sync_interval <= 0))
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected a strictly positive integer\r\n", long_options[option_index].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if (strcmp(long_options[option_index].name, "rotate-interval") == 0)
+            {
+                errno = 0;
+                opt_rotate_interval = strtol(optarg, NULL, 10);
+                if ((errno != 0) || (opt_rotate_interval <= 0))
+                {
+                    help();
+                    fprintf(stderr, "Invalid value passed to --%s (%s), expected a strictly positive integer\r\n", long_options[option_index].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
             else if (strcmp(long_options[option_index].name, "stealth-stdout") == 0)
             {
                 opt_stealth_stdout = 1;
@@ -694,13 +986,38 @@ int main(int argc, char **argv)
     }
     printdbg("will use %s as dname\r\n", dname);
 
-    if ((fscript = fopen(fname, opt_append ? "a" : "w")) == NULL)
+    script.summary_known = 1;
+    if (opt_append)
+    {
+        summary_open(fname);
+    }
+    if (opt_daemon != NULL)
+    {
+        if ((daemon_sock = daemon_connect(opt_daemon)) < 0)
+        {
+            fprintf(stderr, "Couldn't reach ttyrecd on %s (%s), recording locally\r\n", opt_daemon, strerror(errno));
+        }
+    }
+    if (open_segment(&script, fname, opt_append ? "a" : "w") != 0)
     {
         perror(fname);
         exit(EXIT_FAILURE);
     }
-    free(fname);
-    setbuf(fscript, NULL);
+    script.name = fname;
+    fname       = NULL;
+    if (opt_append)
+    {
+        struct stat st;
+        // --rotate-size counts the records, not what they take on disk once compressed
+        if (script.summary_known)
+        {
+            rotate_written = script.summary.records * HEADER_SIZE + script.summary.bytes;
+        }
+        else if ((get_compress_mode() != COMPRESS_ZSTD) && (stat(script.name, &st) == 0))
+        {
+            rotate_written = st.st_size;
+        }
+    }
 
     {
         struct sigaction act;
@@ -843,6 +1160,15 @@ int main(int argc, char **argv)
         if (timeout_lock || timeout_kill)
         {
             pthread_t watcher_thread;
+            // the watcher looks at the deadlines right away, before doinput() starts
+            last_activity = now_ms();
+            if (pipe(watcher_pipe) != 0)
+            {
+                perror("pipe");
+                fail();
+            }
+            // written to from signal handlers, that must never block
+            (void)fcntl(watcher_pipe[1], F_SETFL, fcntl(watcher_pipe[1], F_GETFL) | O_NONBLOCK);
             if (pthread_create(&watcher_thread, NULL, timeout_watcher, NULL) == -1)
             {
                 perror("pthread");
@@ -904,7 +1230,7 @@ void doinput(void)
     int  cc;
     char ibuf[BUFSIZ];
 
-    (void)fclose_wrapper(fscript);
+    forget_script();
 #ifdef HAVE_openpty
     if (openpty_used)
     {
@@ -923,7 +1249,7 @@ void doinput(void)
         perror("sigaction");
         fail();
     }
-    last_activity = time(NULL);
+    last_activity = now_ms();
     lock_warned   = 0;
     kill_warned   = 0;
 
@@ -948,7 +1274,13 @@ void doinput(void)
                     perror("write[parent-master]");
                     fail();
                 }
-                last_activity = time(NULL);
+                // activity only pushes the deadlines back, the watcher will see it when it wakes up,
+                // unless it already warned: the next warning may then be due before that
+                if (lock_warned || kill_warned)
+                {
+                    watcher_wake();
+                }
+                last_activity = now_ms();
                 lock_warned   = 0;
                 kill_warned   = 0;
                 if (cc == 1)
@@ -1012,6 +1344,43 @@ void finish(int signal)
 }
 
 
+/* parse a size in bytes, with an optional K, M or G suffix, returns -1 if invalid */
+long long parse_size(const char *str)
+{
+    char      *end;
+    long long size;
+    long long unit = 1;
+
+    errno = 0;
+    size  = strtoll(str, &end, 10);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        unit = 1024;
+        end++;
+        break;
+
+    case 'm':
+    case 'M':
+        unit = 1024 * 1024;
+        end++;
+        break;
+
+    case 'g':
+    case 'G':
+        unit = 1024 * 1024 * 1024;
+        end++;
+        break;
+    }
+    if ((errno != 0) || (end == str) || (*end != '\0') || (size < 0) || (size > LLONG_MAX / unit))
+    {
+        return -1;
+    }
+    return size * unit;
+}
+
+
 void set_ttyrec_file_name(char **nameptr)
 {
     struct timeval tv;
@@ -1081,163 +1450,1258 @@ void set_ttyrec_file_name(char **nameptr)
 }
 
 
-void swing_output_file(int signal)
+/*
+ * Turn the name set_ttyrec_file_name() gave into its Nth variant, for when it's taken:
+ * NAME.N, or NAME.N.zst with zstd. Returns -1 with errno set if it doesn't fit.
+ */
+int unique_file_name(char **nameptr, int n)
 {
-    char *newname = NULL;
+    static char base[BUFSIZ];
+    int         ret;
+
+    if (n == 1)
+    {
+        // the name as set_ttyrec_file_name() gave it, without the extension
+        snprintf(base, sizeof(base), "%s", *nameptr);
+        if (opt_zstd)
+        {
+            base[strlen(base) - 4] = '\0';
+        }
+    }
+    ret = snprintf(*nameptr, BUFSIZ, "%s.%d%s", base, n, opt_zstd ? ".zst" : "");
+    if ((ret < 0) || ((size_t)ret >= BUFSIZ))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
 
-    (void)signal;
 
+void swing_output_file(int signal)
+{
     if (subchild != 0)
     {
-        // we are the child: we're the one doing the file rotation.
-        //
-        // coalesce duplicate near-simultaneous requests: "pkill -USR1 ttyrec" delivers the
-        // signal to both the parent and us, and the parent forwards it to us as well
-        static struct timeval last_rotate = { 0, 0 };
-        struct timeval        now;
-        gettimeofday(&now, NULL);
-        // only compute the elapsed time once we have a previous rotation to compare against
-        if (last_rotate.tv_sec != 0)
+        // we are the child: we're the one doing the file rotation, but not from here, where
+        // hardly anything is safe to call. dooutput() does it, see rotation_requested()
+        rotate_requested = 1;
+    }
+    else if (child != 0)
+    {
+        // we are the parent: just forward to our child
+        kill(child, signal);
+    }
+}
+
+
+// called by child, from dooutput(), once it's seen rotate_requested
+void rotation_requested(void)
+{
+    // coalesce duplicate near-simultaneous requests: "pkill -USR1 ttyrec" delivers the
+    // signal to both the parent and us, and the parent forwards it to us as well
+    static struct timeval last_rotate = { 0, 0 };
+    struct timeval        now;
+
+    rotate_requested = 0;
+    gettimeofday(&now, NULL);
+    // only compute the elapsed time once we have a previous rotation to compare against
+    if (last_rotate.tv_sec != 0)
+    {
+        long elapsed_ms = (now.tv_sec - last_rotate.tv_sec) * 1000 + (now.tv_usec - last_rotate.tv_usec) / 1000;
+        if (elapsed_ms < 250)
         {
-            long elapsed_ms = (now.tv_sec - last_rotate.tv_sec) * 1000 + (now.tv_usec - last_rotate.tv_usec) / 1000;
-            if (elapsed_ms < 250)
-            {
-                // multiple signal received in a short amount of time, only rotate once.
-                return;
-            }
+            // multiple signal received in a short amount of time, only rotate once.
+            return;
         }
-        last_rotate = now;
+    }
+    last_rotate = now;
 
-        set_ttyrec_file_name(&newname);
+    rotate_output_file();
+}
 
-        fclose_wrapper(fscript);
 
-        if ((fscript = fopen(newname, "w")) == NULL)
+/*
+ * Called by child: go on in a new ttyrec file. It's opened right away, whereas the
+ * current one is handed to a background thread to be closed (which, with zstd, means
+ * compressing and writing all that's still buffered), so that recording isn't held up.
+ */
+void rotate_output_file(void)
+{
+    char     *newname = NULL;
+    Segment  next;
+    Segment  *old;
+    sigset_t all, saved;
+
+    set_ttyrec_file_name(&newname);
+
+    memset(&next, 0, sizeof(next));
+    next.summary_known = 1;
+    // never truncate an existing file: with -F, two rotations within the same second (or
+    // whatever the format is precise to) get the same name, the current file's among others
+    for (int n = 1; open_segment(&next, newname, "wx") != 0; n++)
+    {
+        if ((errno != EEXIST) || (n > 1000) || (unique_file_name(&newname, n) != 0))
         {
-            perror("fopen()");
+            perror(newname);
             free(newname);
             fail();
         }
+    }
+    next.name = newname;
+    if ((old = malloc(sizeof(*old))) == NULL)
+    {
+        perror("malloc()");
         free(newname);
-        setbuf(fscript, NULL);
+        fail();
     }
-    else if (child != 0)
+
+    // a signal handler calling done() must not see script half swapped
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    sync_hold();
+    *old   = script;
+    script = next;
+    // what's left of the old file will be synced by close_segment()
+    sync_release(0);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    printdbg("rotated to %s\r\n", newname);
+    if (old->remote)
     {
-        // we are the parent: just forward to our child
-        kill(child, signal);
+        // nothing left for us to do, ttyrecd closed it when we handed it the new one
+        close_segment(old);
+        free(old);
+    }
+    else
+    {
+        close_in_background(old);
     }
+    rotate_written = 0;
+    schedule_rotation(time(NULL));
 }
 
 
-// SIGUSR2
-void unlock_session(int signal)
+// called by child: the closer thread, see close_in_background()
+void *closer_thread(void *arg)
 {
-    last_activity = time(NULL);
-    lock_warned   = 0;
-    kill_warned   = 0;
-    // to avoid signal storm, abort if not locked
-    if (!locked_since)
-    {
-        return;
-    }
+    (void)arg;
 
-    printdbg("%s("PID_T_FORMAT "): unlock_session()\r\n", me, getpid());
-    locked_since = 0;
+    pthread_mutex_lock(&closer_lock);
+    while (1)
+    {
+        Segment *seg;
 
-    // in case only the parent or the child got the SIG,
-    // ensure the other also gets it
-    kill(subchild > 0 ? getppid() : child, signal);
+        while (closer_queue == NULL)
+        {
+            pthread_cond_wait(&closer_cond, &closer_lock);
+        }
+        seg          = closer_queue;
+        closer_queue = seg->next;
+        closer_busy  = 1;
+        pthread_mutex_unlock(&closer_lock);
 
-    if (subchild == 0)
-    {
-        // if we're the parent, force our children to redraw after unlock
-        usleep(1000 * 300);
+        close_segment(seg);
+        free(seg);
 
-        struct winsize tmpwin;
-        memset(&tmpwin, 0, sizeof(tmpwin));
-        (void)ioctl(master, TIOCGWINSZ, (char *)&tmpwin);
+        pthread_mutex_lock(&closer_lock);
+        closer_busy = 0;
+        pthread_cond_broadcast(&closer_cond);
+    }
+    return NULL;
+}
 
-        // guard against ws_row == 0 (failed ioctl or bogus size) to avoid a div-by-zero
-        int pixels_per_row = (tmpwin.ws_row > 0) ? (tmpwin.ws_ypixel / tmpwin.ws_row) : 0;
-        tmpwin.ws_row++;
-        tmpwin.ws_ypixel += pixels_per_row;
-        (void)ioctl(master, TIOCSWINSZ, (char *)&tmpwin);
-        kill(child, SIGWINCH);
 
-        usleep(1000 * 300);
+// called by child: have seg closed (and freed) by the closer thread, which we start on first use
+void close_in_background(Segment *seg)
+{
+    sigset_t all, saved;
+
+    seg->next = NULL;
+    // all signals are blocked in the closer thread (it inherits our mask), so that they all
+    // reach the main one; and no handler may run here while we hold the lock (see done())
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if (!closer_started)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, closer_thread, NULL) != 0)
+        {
+            pthread_sigmask(SIG_SETMASK, &saved, NULL);
+            // then we'll do it ourselves
+            close_segment(seg);
+            free(seg);
+            return;
+        }
+        pthread_detach(tid);
+        closer_started = 1;
+    }
 
-        tmpwin.ws_row--;
-        tmpwin.ws_ypixel -= pixels_per_row;
-        (void)ioctl(master, TIOCSWINSZ, (char *)&tmpwin);
-        kill(child, SIGWINCH);
+    pthread_mutex_lock(&closer_lock);
+    if (closer_queue == NULL)
+    {
+        closer_queue = seg;
     }
     else
     {
-        // child: restore console, make cursor visible again, restore its position
-        (void)fputs(ansi_restore, stdout);
-        (void)fputs(ansi_restorecursor, stdout);
-        (void)fputs(ansi_showcursor, stdout);
+        Segment *last = closer_queue;
+        while (last->next != NULL)
+        {
+            last = last->next;
+        }
+        last->next = seg;
     }
+    pthread_cond_broadcast(&closer_cond);
+    pthread_mutex_unlock(&closer_lock);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
 }
 
 
-// SIGURG
-void lock_session(int signal)
+// called by child: wait until the closer thread is done with all the files we gave it
+void closer_drain(void)
 {
-    (void)signal;
-    // to avoid signal storm, abort if locked
-    if (locked_since)
+    if (!closer_started)
     {
         return;
     }
+    pthread_mutex_lock(&closer_lock);
+    while ((closer_queue != NULL) || closer_busy)
+    {
+        pthread_cond_wait(&closer_cond, &closer_lock);
+    }
+    pthread_mutex_unlock(&closer_lock);
+}
 
-    printdbg("%s("PID_T_FORMAT "): lock_session()\r\n", me, getpid());
-    locked_since = time(NULL);
-
-    // in case only the parent or the child got the SIG,
-    // ensure the other also gets it
-    kill(subchild > 0 ? getppid() : child, signal);
 
-    // if we're the parent, nothing more to do
-    if (subchild == 0)
+// called by child: set the time-based rotation deadline of the file we just opened
+void schedule_rotation(time_t now)
+{
+    if (opt_rotate_interval > 0)
     {
-        return;
+        rotate_deadline = now + opt_rotate_interval - random() % (opt_rotate_interval * ROTATE_JITTER_PERCENT / 100 + 1);
     }
+}
 
-    const char *lock = "\033[31m" \
-                       "██╗      ██████╗  ██████╗██╗  ██╗███████╗██████╗ \r\n"
-                       "██║     ██╔═══██╗██╔════╝██║ ██╔╝██╔════╝██╔══██╗\r\n"
-                       "██║     ██║   ██║██║     █████╔╝ █████╗  ██║  ██║\r\n"
-                       "██║     ██║   ██║██║     ██╔═██╗ ██╔══╝  ██║  ██║\r\n"
-                       "███████╗╚██████╔╝╚██████╗██║  ██╗███████╗██████╔╝\r\n"
-                       "╚══════╝ ╚═════╝  ╚═════╝╚═╝  ╚═╝╚══════╝╚═════╝ \033[0m\r\n"                    \
-                       "     .--------.      \r\n"                                                       \
-                       "    / .------. \\     \r\n"                                                      \
-                       "   / /        \\ \\    \033[33mThe current session is \033[31mLOCKED\033[0m\r\n" \
-                       "   | |        | |    \r\n"                                                       \
-                       "  _| |________| |_   \033[33mSince %s\033[0m\r\n"                                \
-                       ".' |_|        |_| '. \r\n"                                                       \
-                       "'._____ ____ _____.' \033[33mDue to input inactivity timeout\033[0m\r\n"         \
-                       "|     .'____'.     | \r\n"                                                       \
-                       "'.__.'.'    '.'.__.' \r\n"                                                       \
-                       "'.__  |      |  __.' \r\n"                                                       \
-                       "|   '.'.____.'.'   | \033[33m%s,\033[0m\r\n"                                     \
-                       "'.____'.____.'____.' \r\n"                                                       \
-                       "'.________________.' \033[33m%s.\033[0m\r\n";
-
-    char           hostname[BUFSIZ];
-    struct utsname name;
 
-    if (uname(&name))
+/*
+ * Called by child before each record of len bytes: whether the current file is full, or
+ * old enough. Checked only when we have something to write, so that idle sessions don't
+ * leave a trail of empty files behind them.
+ */
+int rotation_due(time_t now, int len)
+{
+    if ((opt_rotate_interval > 0) && (now >= rotate_deadline))
     {
-        hostname[0] = '\0';
+        return 1;
     }
-    else
+    // we go by the size of the records rather than by the size of the file: with zstd, the
+    // latter lags way behind (by all that zstd keeps in its buffers), and doesn't bound much.
+    // a file only gets over the size when it has a single record bigger than that
+    return (opt_rotate_size > 0) && (rotate_written > 0) && (rotate_written + HEADER_SIZE + len > opt_rotate_size);
+}
+
+
+/* current time in milliseconds, on a clock that doesn't jump if we have one */
+long long now_ms(void)
+{
+#ifdef HAVE_clock_gettime
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
     {
-        strncpy(hostname, name.nodename, BUFSIZ);
-        hostname[BUFSIZ - 1] = '\0';
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
     }
-
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+/*
+ * Called by child: the sync thread, for --sync-interval-ms. Every interval, if records
+ * were written since the last time, have the current file flushed (with zstd, that's all
+ * it has buffered) then synced to disk, so that a crash loses at most an interval worth
+ * of recording. The sync itself is done on a dup of the file descriptor, out of the lock,
+ * so that neither a rotation nor the next records wait for the disk.
+ */
+void *sync_thread(void *arg)
+{
+    struct timespec interval;
+
+    (void)arg;
+    interval.tv_sec  = opt_sync_interval / 1000;
+    interval.tv_nsec = (opt_sync_interval % 1000) * 1000000;
+    while (1)
+    {
+        long long since;
+        int       fd;
+
+        (void)nanosleep(&interval, NULL);
+        pthread_mutex_lock(&sync_lock);
+        if (sync_stopping)
+        {
+            pthread_mutex_unlock(&sync_lock);
+            return NULL;
+        }
+        if (!sync_dirty)
+        {
+            pthread_mutex_unlock(&sync_lock);
+            continue;
+        }
+        (void)writer_flush(script.writer);
+        fd         = dup(fileno(writer_file(script.writer)));
+        since      = sync_dirty_since;
+        sync_dirty = 0;
+        pthread_mutex_unlock(&sync_lock);
+
+        if (fd < 0)
+        {
+            continue;
+        }
+#ifdef HAVE_fdatasync
+        (void)fdatasync(fd);
+#else
+        (void)fsync(fd);
+#endif
+        (void)close(fd);
+
+        pthread_mutex_lock(&sync_lock);
+        sync_count++;
+        if (now_ms() - since > sync_lag_max)
+        {
+            sync_lag_max = now_ms() - since;
+        }
+        pthread_mutex_unlock(&sync_lock);
+    }
+}
+
+
+// called by child: start the sync thread, or go on without it if we can't
+void sync_start(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_t           tid;
+    sigset_t            all, saved;
+
+    // error-checking, so that done() can tell it interrupted us holding the lock, see sync_stop()
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&sync_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // as for the closer thread, all signals must reach the main one
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if (pthread_create(&tid, NULL, sync_thread, NULL) == 0)
+    {
+        pthread_detach(tid);
+        sync_started = 1;
+    }
+    else
+    {
+        fprintf(stderr, "Couldn't start the sync thread, --sync-interval-ms will be ignored\r\n");
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+
+// called by child around each use of script.writer that may race with the sync thread
+void sync_hold(void)
+{
+    if (sync_started)
+    {
+        pthread_mutex_lock(&sync_lock);
+    }
+}
+
+
+// wrote: whether records were written while we held the lock, that'll need a sync
+void sync_release(int wrote)
+{
+    if (sync_started)
+    {
+        if (wrote && !sync_dirty)
+        {
+            sync_dirty       = 1;
+            sync_dirty_since = now_ms();
+        }
+        pthread_mutex_unlock(&sync_lock);
+    }
+}
+
+
+/*
+ * Called by child from done(): make sure the sync thread won't touch script.writer again,
+ * as it's about to be closed. We may be in a signal handler that interrupted the main
+ * thread while it was holding the lock, in which case the lock is ours already.
+ */
+void sync_stop(void)
+{
+    int ret;
+
+    if (!sync_started)
+    {
+        return;
+    }
+    ret           = pthread_mutex_lock(&sync_lock);
+    sync_stopping = 1;
+    if (ret == 0)
+    {
+        pthread_mutex_unlock(&sync_lock);
+    }
+}
+
+
+/*
+ * Called by child: whether something at path is a unix socket nobody listens to any
+ * more, left behind by a session that was killed, see fanout_listen().
+ */
+int fanout_stale(const struct sockaddr_un *addr)
+{
+    struct stat st;
+    int         probe;
+    int         stale = 0;
+
+    if ((lstat(addr->sun_path, &st) != 0) || !S_ISSOCK(st.st_mode))
+    {
+        return 0;
+    }
+    if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0)
+    {
+        stale = (connect(probe, (const struct sockaddr *)addr, sizeof(*addr)) != 0) && (errno == ECONNREFUSED);
+        (void)close(probe);
+    }
+    return stale;
+}
+
+
+// called by child: listen on the --fanout socket, returns -1 with errno set on failure
+int fanout_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int                fd, ret, saved_errno;
+    mode_t             mask;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        return -1;
+    }
+    // the session's output is as sensitive as its recording: the socket must never be
+    // open to others, not even between its creation and the chmod() below
+    mask = umask(0117);
+    ret  = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    // never take the socket of a live session over, only one that was left behind
+    if ((ret != 0) && (errno == EADDRINUSE) && fanout_stale(&addr))
+    {
+        (void)unlink(path);
+        ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    saved_errno = errno;
+    (void)umask(mask);
+    errno = saved_errno;
+    if (ret == 0)
+    {
+        (void)chmod(path, 0660);
+        if ((ret = listen(fd, 16)) != 0)
+        {
+            saved_errno = errno;
+            (void)unlink(path);
+            errno = saved_errno;
+        }
+    }
+    if (ret != 0)
+    {
+        saved_errno = errno;
+        (void)close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+
+// called by child: start streaming the session on the --fanout socket, or go on without it if we can't
+void fanout_start(void)
+{
+    pthread_mutexattr_t attr;
+    sigset_t            all, saved;
+
+    if ((fanout_listener = fanout_listen(opt_fanout)) < 0)
+    {
+        fprintf(stderr, "Couldn't listen on %s (%s), --fanout will be ignored\r\n", opt_fanout, strerror(errno));
+        return;
+    }
+    if (pipe(fanout_wake) != 0)
+    {
+        perror("pipe");
+        (void)close(fanout_listener);
+        (void)unlink(opt_fanout);
+        return;
+    }
+    (void)fcntl(fanout_wake[1], F_SETFL, fcntl(fanout_wake[1], F_GETFL) | O_NONBLOCK);
+
+    // error-checking, for the same reason as sync_lock, see fanout_stop()
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&fanout_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // as for the closer thread, all signals must reach the main one
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if (pthread_create(&fanout_tid, NULL, fanout_thread, NULL) == 0)
+    {
+        fanout_started = 1;
+    }
+    else
+    {
+        fprintf(stderr, "Couldn't start the fanout thread, --fanout will be ignored\r\n");
+        (void)close(fanout_listener);
+        (void)unlink(opt_fanout);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+
+/*
+ * Called by child, from the fanout thread: send what we can of the queue of a subscriber,
+ * without waiting, or only what's left of the record being sent if finish. Returns -1 if
+ * it's gone. Only we take bytes out of the queue, and fanout_publish() only adds whole
+ * records after those waiting, so we send out of the lock.
+ */
+int fanout_send(Subscriber *s, int finish)
+{
+    size_t  start, len;
+    ssize_t n;
+
+    pthread_mutex_lock(&fanout_lock);
+    start = s->start;
+    len   = s->len;
+    pthread_mutex_unlock(&fanout_lock);
+
+    while (len > 0)
+    {
+        size_t chunk = (size_t)opt_fanout_queue - start < len ? (size_t)opt_fanout_queue - start : len;
+
+        if (s->left == 0)
+        {
+            // a record starts here: find out its size, from its header
+            char   hdr[HEADER_SIZE];
+            Header h;
+
+            if (finish)
+            {
+                break;
+            }
+            for (size_t i = 0; i < HEADER_SIZE; i++)
+            {
+                hdr[i] = s->queue[(start + i) % opt_fanout_queue];
+            }
+            decode_header(hdr, &h);
+            s->left = HEADER_SIZE + h.len;
+        }
+        if (chunk > s->left)
+        {
+            chunk = s->left;
+        }
+        n = send(s->fd, s->queue + start, chunk, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1;
+        }
+        s->left -= n;
+        pthread_mutex_lock(&fanout_lock);
+        s->start = (s->start + n) % opt_fanout_queue;
+        s->len  -= n;
+        start    = s->start;
+        len      = s->len;
+        pthread_mutex_unlock(&fanout_lock);
+    }
+    return 0;
+}
+
+
+// called by child, from the fanout thread: forget subscriber i, fanout_lock held
+void fanout_remove(int i)
+{
+    (void)close(fanout_subs[i].fd);
+    free(fanout_subs[i].queue);
+    fanout_subs[i] = fanout_subs[--fanout_count];
+}
+
+
+/*
+ * Called by child: the fanout thread, for --fanout. It accepts subscribers on the socket,
+ * and sends each of them the records fanout_publish() queued for it, as they can take
+ * them: the main thread never waits on a subscriber, whatever it does.
+ */
+void *fanout_thread(void *arg)
+{
+    struct pollfd pfds[FANOUT_MAX_SUBSCRIBERS + 2];
+    int           count;
+
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&fanout_lock);
+        if (fanout_stopping)
+        {
+            pthread_mutex_unlock(&fanout_lock);
+            fanout_drain();
+            return NULL;
+        }
+        count = fanout_count;
+        for (int i = 0; i < count; i++)
+        {
+            pfds[i + 2].fd     = fanout_subs[i].fd;
+            pfds[i + 2].events = POLLIN | (fanout_subs[i].len > 0 ? POLLOUT : 0);
+        }
+        pthread_mutex_unlock(&fanout_lock);
+        pfds[0].fd     = fanout_listener;
+        pfds[0].events = POLLIN;
+        pfds[1].fd     = fanout_wake[0];
+        pfds[1].events = POLLIN;
+
+        if (poll(pfds, count + 2, -1) < 0)
+        {
+            continue;
+        }
+
+        if (pfds[1].revents & POLLIN)
+        {
+            char buf[64];
+            pthread_mutex_lock(&fanout_lock);
+            (void)read(fanout_wake[0], buf, sizeof(buf));
+            fanout_woken = 0;
+            pthread_mutex_unlock(&fanout_lock);
+        }
+
+        // backwards, as fanout_remove() moves the last one in place of the one removed
+        for (int i = count - 1; i >= 0; i--)
+        {
+            int gone = 0;
+
+            if (pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                // subscribers have nothing to say, this is only to notice they left
+                char    buf[256];
+                ssize_t n = recv(fanout_subs[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+                gone = (n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR));
+            }
+            if (!gone && (pfds[i + 2].revents & POLLOUT))
+            {
+                gone = fanout_send(&fanout_subs[i], 0) != 0;
+            }
+            if (gone)
+            {
+                pthread_mutex_lock(&fanout_lock);
+                fanout_remove(i);
+                pthread_mutex_unlock(&fanout_lock);
+            }
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            int  sock  = accept(fanout_listener, NULL, NULL);
+            char *queue = NULL;
+
+            if ((sock >= 0) && ((fanout_count >= FANOUT_MAX_SUBSCRIBERS) || ((queue = malloc(opt_fanout_queue)) == NULL)))
+            {
+                (void)close(sock);
+                sock = -1;
+            }
+            if (sock >= 0)
+            {
+#ifdef SO_NOSIGPIPE
+                int one = 1;
+                (void)setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+                (void)fcntl(sock, F_SETFD, FD_CLOEXEC);
+                pthread_mutex_lock(&fanout_lock);
+                memset(&fanout_subs[fanout_count], 0, sizeof(Subscriber));
+                fanout_subs[fanout_count].fd    = sock;
+                fanout_subs[fanout_count].queue = queue;
+                fanout_count++;
+                fanout_accepted++;
+                pthread_mutex_unlock(&fanout_lock);
+            }
+        }
+    }
+}
+
+
+/*
+ * Called by child, from the fanout thread once we're stopping: give the subscribers
+ * FANOUT_DRAIN_MS to take what's queued for them, then close them. What they got must
+ * end with a whole record: past that time, no record is started, but one that's half
+ * sent is waited on, for as long again at most.
+ */
+void fanout_drain(void)
+{
+    struct pollfd pfds[FANOUT_MAX_SUBSCRIBERS];
+    long long     deadline = now_ms() + FANOUT_DRAIN_MS;
+
+    while (1)
+    {
+        long long now    = now_ms();
+        int       finish = now >= deadline;
+
+        if (now >= deadline + FANOUT_DRAIN_MS)
+        {
+            break;
+        }
+        // backwards, as fanout_remove() moves the last one in place of the one removed
+        pthread_mutex_lock(&fanout_lock);
+        for (int i = fanout_count - 1; i >= 0; i--)
+        {
+            Subscriber *s = &fanout_subs[i];
+            int        gone;
+
+            pthread_mutex_unlock(&fanout_lock);
+            gone = fanout_send(s, finish) != 0;
+            pthread_mutex_lock(&fanout_lock);
+            if (gone || ((s->left == 0) && (finish || (s->len == 0))))
+            {
+                fanout_remove(i);
+            }
+        }
+        for (int i = 0; i < fanout_count; i++)
+        {
+            pfds[i].fd     = fanout_subs[i].fd;
+            pfds[i].events = POLLOUT;
+        }
+        pthread_mutex_unlock(&fanout_lock);
+        if (fanout_count == 0)
+        {
+            return;
+        }
+        (void)poll(pfds, fanout_count, (int)((finish ? deadline + FANOUT_DRAIN_MS : deadline) - now));
+    }
+
+    // those still in the middle of a record after all that time get a truncated one
+    pthread_mutex_lock(&fanout_lock);
+    while (fanout_count > 0)
+    {
+        fanout_remove(fanout_count - 1);
+    }
+    pthread_mutex_unlock(&fanout_lock);
+}
+
+
+/*
+ * Called by child after each record: queue it for every subscriber. One whose queue
+ * can't take it whole is over its --fanout-queue budget: it gets no record at all
+ * until it has caught up with those queued, then resumes with the next one, so that
+ * what it gets is always a valid ttyrec stream, only with gaps.
+ */
+void fanout_publish(Header *h, const char *buf)
+{
+    char   hdr[HEADER_SIZE];
+    size_t len  = HEADER_SIZE + h->len;
+    int    wake = 0;
+
+    if (!fanout_started)
+    {
+        return;
+    }
+    encode_header(hdr, h);
+    pthread_mutex_lock(&fanout_lock);
+    for (int i = 0; i < fanout_count; i++)
+    {
+        Subscriber *s = &fanout_subs[i];
+        size_t     end, first;
+
+        if (s->dropping && (s->len == 0))
+        {
+            s->dropping = 0;
+        }
+        if (s->dropping || (s->len + len > (size_t)opt_fanout_queue))
+        {
+            s->dropping = 1;
+            fanout_dropped++;
+            continue;
+        }
+        wake  = wake || (s->len == 0);
+        end   = (s->start + s->len) % opt_fanout_queue;
+        first = (size_t)opt_fanout_queue - end;
+        for (int part = 0; part < 2; part++)
+        {
+            const char *src = part == 0 ? hdr : buf;
+            size_t     n    = part == 0 ? HEADER_SIZE : (size_t)h->len;
+            size_t     head = first < n ? first : n;
+
+            memcpy(s->queue + end, src, head);
+            memcpy(s->queue, src + head, n - head);
+            end    = (end + n) % opt_fanout_queue;
+            first  = (size_t)opt_fanout_queue - end;
+            s->len += n;
+        }
+    }
+    if (wake && !fanout_woken)
+    {
+        fanout_woken = write(fanout_wake[1], "", 1) == 1;
+    }
+    pthread_mutex_unlock(&fanout_lock);
+}
+
+
+/*
+ * Called by child from done(): let the fanout thread send what it can, see fanout_drain(),
+ * and close the socket. As in sync_stop(), we may have interrupted the main thread while
+ * it held the lock: then the thread can't go on, and we don't wait for it.
+ */
+void fanout_stop(void)
+{
+    int ret;
+
+    if (!fanout_started)
+    {
+        return;
+    }
+    ret             = pthread_mutex_lock(&fanout_lock);
+    fanout_stopping = 1;
+    fanout_woken    = write(fanout_wake[1], "", 1) == 1;
+    if (ret == 0)
+    {
+        pthread_mutex_unlock(&fanout_lock);
+        pthread_join(fanout_tid, NULL);
+    }
+    (void)close(fanout_listener);
+    (void)unlink(opt_fanout);
+}
+
+
+// called by child: start writing to the terminal from the output thread, or go on without it if we can't
+void output_start(void)
+{
+    pthread_mutexattr_t attr;
+    sigset_t            all, saved;
+
+    if ((output_queue = malloc(opt_output_queue)) == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate the output queue, --output-queue will be ignored\r\n");
+        return;
+    }
+    if (pipe(output_wake) != 0)
+    {
+        fprintf(stderr, "Couldn't create a pipe (%s), --output-queue will be ignored\r\n", strerror(errno));
+        free(output_queue);
+        output_queue = NULL;
+        return;
+    }
+    // written to from signal handlers too, see output_kick()
+    (void)fcntl(output_wake[0], F_SETFL, fcntl(output_wake[0], F_GETFL) | O_NONBLOCK);
+    (void)fcntl(output_wake[1], F_SETFL, fcntl(output_wake[1], F_GETFL) | O_NONBLOCK);
+
+    // error-checking, for the same reason as sync_lock, see output_stop()
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    pthread_mutex_init(&output_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    if (pthread_create(&output_tid, NULL, output_thread, NULL) == 0)
+    {
+        output_started = 1;
+    }
+    else
+    {
+        fprintf(stderr, "Couldn't start the output thread, --output-queue will be ignored\r\n");
+        free(output_queue);
+        output_queue = NULL;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+
+/*
+ * Called by child: the output thread, for --output-queue. It writes to the terminal what
+ * output_write() queued for it, as fast as the terminal takes it, so that the main thread
+ * doesn't wait on the terminal to read what the session outputs, and timestamp it. It's
+ * the only one writing to the terminal, so it also draws the lock screen, and takes it down,
+ * between two writes. While the session is locked, it waits: the lock screen is what the
+ * terminal shows.
+ */
+void *output_thread(void *arg)
+{
+    int shown_locked = 0; // what the terminal shows
+
+    (void)arg;
+    pthread_mutex_lock(&output_lock);
+    while (1)
+    {
+        size_t  chunk;
+        ssize_t n;
+        int     locked = locked_since != 0;
+
+        // lock_session() and unlock_session() only set locked_since and wake us up
+        if (locked != shown_locked)
+        {
+            pthread_mutex_unlock(&output_lock);
+            if (locked)
+            {
+                draw_lock_screen();
+            }
+            else
+            {
+                draw_unlock_screen();
+            }
+            pthread_mutex_lock(&output_lock);
+            shown_locked = locked;
+            continue;
+        }
+
+        if ((output_len == 0) || locked)
+        {
+            struct pollfd pfd = { output_wake[0], POLLIN, 0 };
+            char          buf[64];
+
+            // all of it, unless we're locked: then what's left is for a terminal that's gone
+            if (output_stopping)
+            {
+                break;
+            }
+            pthread_mutex_unlock(&output_lock);
+            (void)poll(&pfd, 1, -1);
+            pthread_mutex_lock(&output_lock);
+            while (read(output_wake[0], buf, sizeof(buf)) > 0)
+            {
+            }
+            output_woken = 0;
+            // output_write() may be waiting for room, and have to know we're locked now
+            pthread_cond_broadcast(&output_cond);
+            continue;
+        }
+
+        // output_write() only adds bytes after those waiting, so we write out of the lock
+        chunk = (size_t)opt_output_queue - output_head < output_len ? (size_t)opt_output_queue - output_head : output_len;
+        pthread_mutex_unlock(&output_lock);
+        n = write(1, output_queue + output_head, chunk);
+        pthread_mutex_lock(&output_lock);
+        if ((n < 0) && (errno != EINTR) && (errno != EAGAIN))
+        {
+            printdbg("write(output-thread,len=%zu): %s", chunk, strerror(errno));
+            output_failed = 1;
+            output_len    = 0;
+            break;
+        }
+        if (n > 0)
+        {
+            output_head = (output_head + n) % opt_output_queue;
+            output_len -= n;
+            pthread_cond_broadcast(&output_cond);
+        }
+    }
+    pthread_cond_broadcast(&output_cond);
+    pthread_mutex_unlock(&output_lock);
+    return NULL;
+}
+
+
+/*
+ * Called by child for what the session outputs, instead of writing it to the terminal:
+ * queue it for the output thread. When the terminal is more than --output-queue behind,
+ * either wait for room (block), or leave it out, and all that follows until the terminal
+ * has caught up with what's queued (drop). Returns -1 once the terminal's gone.
+ */
+int output_write(const char *buf, size_t len)
+{
+    size_t end, first;
+
+    pthread_mutex_lock(&output_lock);
+    if (opt_output_overflow == OUTPUT_OVERFLOW_DROP)
+    {
+        if (output_dropping && (output_len == 0))
+        {
+            output_dropping = 0;
+        }
+        if (!output_failed && (output_dropping || (output_len + len > (size_t)opt_output_queue)))
+        {
+            output_dropping = 1;
+            output_dropped += len;
+            pthread_mutex_unlock(&output_lock);
+            return 0;
+        }
+    }
+    else
+    {
+        while (!output_failed && !locked_since && (output_len + len > (size_t)opt_output_queue))
+        {
+            pthread_cond_wait(&output_cond, &output_lock);
+        }
+    }
+    if (output_failed)
+    {
+        pthread_mutex_unlock(&output_lock);
+        errno = EIO;
+        return -1;
+    }
+    // we got locked meanwhile: as without a queue, the terminal doesn't get it
+    if (locked_since)
+    {
+        pthread_mutex_unlock(&output_lock);
+        return 0;
+    }
+
+    end   = (output_head + output_len) % opt_output_queue;
+    first = (size_t)opt_output_queue - end < len ? (size_t)opt_output_queue - end : len;
+    memcpy(output_queue + end, buf, first);
+    memcpy(output_queue, buf + first, len - first);
+    if ((output_len == 0) && !output_woken)
+    {
+        output_woken = write(output_wake[1], "", 1) == 1;
+    }
+    output_len += len;
+    if (output_len > output_len_max)
+    {
+        output_len_max = output_len;
+    }
+    pthread_mutex_unlock(&output_lock);
+    return 0;
+}
+
+
+// called by child, also from signal handlers: have the output thread look at the lock again
+void output_kick(void)
+{
+    int saved_errno = errno;
+
+    if ((output_wake[1] >= 0) && (write(output_wake[1], "", 1) < 0))
+    {
+        // full: it has plenty to wake up to already
+    }
+    errno = saved_errno;
+}
+
+
+/*
+ * Called by child at the end of the session, and from done(): let the output thread write
+ * all that's queued, however long the terminal takes. As in sync_stop(), we may have
+ * interrupted the main thread while it held the lock: then we don't wait for the thread.
+ */
+void output_stop(void)
+{
+    int ret;
+
+    if (!output_started)
+    {
+        return;
+    }
+    output_started  = 0;
+    ret             = pthread_mutex_lock(&output_lock);
+    output_stopping = 1;
+    output_kick();
+    if (ret == 0)
+    {
+        pthread_mutex_unlock(&output_lock);
+        pthread_join(output_tid, NULL);
+    }
+}
+
+
+/*
+ * Called by child before waiting for output: how long it may take, as a timeout for select(),
+ * before what was compressed so far must be flushed for readers following the file (ttyplay -p)
+ * to get it, see writer_flush_due(). Returns NULL if we may wait as long as it takes.
+ */
+struct timeval *flush_timeout(struct timeval *tv)
+{
+    long due;
+
+    if (script.remote)
+    {
+        return NULL;
+    }
+    sync_hold();
+    due = writer_flush_due(script.writer);
+    sync_release(0);
+    if (due < 0)
+    {
+        return NULL;
+    }
+    tv->tv_sec  = due;
+    tv->tv_usec = 0;
+    return tv;
+}
+
+
+// called by child once the flush_timeout() is over, without any output meanwhile
+void flush_idle(void)
+{
+    sync_hold();
+    (void)writer_flush(script.writer);
+    sync_release(1);
+}
+
+
+/*
+ * Called by child after each record: once the file gets within half an extent of the
+ * end of the space reserved for it, reserve the next --prealloc bytes, so that it grows
+ * by large contiguous chunks instead of one small append at a time. The file size isn't
+ * changed (readers never see zeros), and what's left unused is given back on close,
+ * see trim_preallocated().
+ */
+void preallocate(Segment *seg)
+{
+#ifdef HAVE_fallocate
+    int         fd = fileno(writer_file(seg->writer));
+    struct stat st;
+
+    if ((fstat(fd, &st) != 0) || (st.st_size + opt_prealloc / 2 < seg->allocated))
+    {
+        return;
+    }
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, st.st_size, opt_prealloc) == 0)
+    {
+        seg->allocated = st.st_size + opt_prealloc;
+    }
+    else if ((errno == EOPNOTSUPP) || (errno == ENOSYS))
+    {
+        printdbg("preallocation not supported for %s, disabling it\r\n", seg->name);
+        opt_prealloc = 0;
+    }
+#else
+    (void)seg;
+#endif
+}
+
+
+// SIGUSR2
+void unlock_session(int signal)
+{
+    last_activity = now_ms();
+    lock_warned   = 0;
+    kill_warned   = 0;
+    // to avoid signal storm, abort if not locked
+    if (!locked_since)
+    {
+        return;
+    }
+
+    printdbg("%s("PID_T_FORMAT "): unlock_session()\r\n", me, getpid());
+    locked_since = 0;
+    watcher_wake();
+    // with --output-queue, the output thread restores the console, before what's queued
+    output_kick();
+
+    // in case only the parent or the child got the SIG,
+    // ensure the other also gets it
+    kill(subchild > 0 ? getppid() : child, signal);
+
+    if (subchild == 0)
+    {
+        // if we're the parent, force our children to redraw after unlock
+        usleep(1000 * 300);
+
+        struct winsize tmpwin;
+        memset(&tmpwin, 0, sizeof(tmpwin));
+        (void)ioctl(master, TIOCGWINSZ, (char *)&tmpwin);
+
+        // guard against ws_row == 0 (failed ioctl or bogus size) to avoid a div-by-zero
+        int pixels_per_row = (tmpwin.ws_row > 0) ? (tmpwin.ws_ypixel / tmpwin.ws_row) : 0;
+        tmpwin.ws_row++;
+        tmpwin.ws_ypixel += pixels_per_row;
+        (void)ioctl(master, TIOCSWINSZ, (char *)&tmpwin);
+        kill(child, SIGWINCH);
+
+        usleep(1000 * 300);
+
+        tmpwin.ws_row--;
+        tmpwin.ws_ypixel -= pixels_per_row;
+        (void)ioctl(master, TIOCSWINSZ, (char *)&tmpwin);
+        kill(child, SIGWINCH);
+    }
+    else if (!output_started)
+    {
+        draw_unlock_screen();
+    }
+}
+
+
+// called by child, from unlock_session() or the output thread: restore console, make cursor visible again, restore its position
+void draw_unlock_screen(void)
+{
+    (void)fputs(ansi_restore, stdout);
+    (void)fputs(ansi_restorecursor, stdout);
+    (void)fputs(ansi_showcursor, stdout);
+}
+
+
+// SIGURG
+void lock_session(int signal)
+{
+    (void)signal;
+    // to avoid signal storm, abort if locked
+    if (locked_since)
+    {
+        return;
+    }
+
+    printdbg("%s("PID_T_FORMAT "): lock_session()\r\n", me, getpid());
+    locked_since = now_ms();
+    watcher_wake();
+    // with --output-queue, the output thread draws the lock screen, once done with its write in progress
+    output_kick();
+
+    // in case only the parent or the child got the SIG,
+    // ensure the other also gets it
+    kill(subchild > 0 ? getppid() : child, signal);
+
+    // if we're the parent, nothing more to do
+    if ((subchild == 0) || output_started)
+    {
+        return;
+    }
+    draw_lock_screen();
+}
+
+
+// called by child, from lock_session() or the output thread
+void draw_lock_screen(void)
+{
+    const char *lock = "\033[31m" \
+                       "██╗      ██████╗  ██████╗██╗  ██╗███████╗██████╗ \r\n"
+                       "██║     ██╔═══██╗██╔════╝██║ ██╔╝██╔════╝██╔══██╗\r\n"
+                       "██║     ██║   ██║██║     █████╔╝ █████╗  ██║  ██║\r\n"
+                       "██║     ██║   ██║██║     ██╔═██╗ ██╔══╝  ██║  ██║\r\n"
+                       "███████╗╚██████╔╝╚██████╗██║  ██╗███████╗██████╔╝\r\n"
+                       "╚══════╝ ╚═════╝  ╚═════╝╚═╝  ╚═╝╚══════╝╚═════╝ \033[0m\r\n"                    \
+                       "     .--------.      \r\n"                                                       \
+                       "    / .------. \\     \r\n"                                                      \
+                       "   / /        \\ \\    \033[33mThe current session is \033[31mLOCKED\033[0m\r\n" \
+                       "   | |        | |    \r\n"                                                       \
+                       "  _| |________| |_   \033[33mSince %s\033[0m\r\n"                                \
+                       ".' |_|        |_| '. \r\n"                                                       \
+                       "'._____ ____ _____.' \033[33mDue to input inactivity timeout\033[0m\r\n"         \
+                       "|     .'____'.     | \r\n"                                                       \
+                       "'.__.'.'    '.'.__.' \r\n"                                                       \
+                       "'.__  |      |  __.' \r\n"                                                       \
+                       "|   '.'.____.'.'   | \033[33m%s,\033[0m\r\n"                                     \
+                       "'.____'.____.'____.' \r\n"                                                       \
+                       "'.________________.' \033[33m%s.\033[0m\r\n";
+
+    char           hostname[BUFSIZ];
+    struct utsname name;
+
+    if (uname(&name))
+    {
+        hostname[0] = '\0';
+    }
+    else
+    {
+        strncpy(hostname, name.nodename, BUFSIZ);
+        hostname[BUFSIZ - 1] = '\0';
+    }
+
     const char *salute[] =
     {
         "Kind regards",       "Your dearest friend",
@@ -1269,71 +2733,155 @@ void lock_session(int signal)
         (void)fputs("\r\n", stdout);
         (void)puts(opt_custom_message);
     }
-}
-
+}
+
+
+void do_lock(void)
+{
+    locked_since = now_ms();
+    watcher_wake();
+    kill(child, SIGURG);
+}
+
+
+// called by parent, also from signal handlers: have the watcher look at the deadlines again
+void watcher_wake(void)
+{
+    int saved_errno = errno;
+
+    if ((watcher_pipe[1] >= 0) && (write(watcher_pipe[1], "", 1) < 0))
+    {
+        // full: it has plenty to wake up to already
+    }
+    errno = saved_errno;
+}
+
+
+// the earliest of two deadlines, -1 standing for none
+static long long earliest(long long a, long long b)
+{
+    return (a < 0) || ((b >= 0) && (b < a)) ? b : a;
+}
+
+
+/*
+ * Called by parent, from timeout_watcher(): warn, lock or kill if it's time to, given the
+ * time now (see now_ms()). Returns when it'll be time to do something next, -1 for never.
+ */
+long long timeout_check(long long now)
+{
+    long long next = -1;
+
+    if (use_tty && !locked_since)
+    {
+        // handle warn: if input is idle and we didn't already, warn
+        if ((timeout_lock > 0) && (warn_before_lock_seconds > 0) && (lock_warned == 0))
+        {
+            long long warn_at = last_activity + (timeout_lock - warn_before_lock_seconds) * 1000;
+            if (now >= warn_at)
+            {
+                lock_warned = 1;
+                fprintf(stderr, "warning: your session will be locked in %lu seconds if no input activity is detected.", warn_before_lock_seconds);
+            }
+            else
+            {
+                next = earliest(next, warn_at);
+            }
+        }
+        // handle lock: if input is idle, and warn wasn't enough, lock
+        if (timeout_lock > 0)
+        {
+            if (now >= last_activity + timeout_lock * 1000)
+            {
+                printdbg("parent: timeout_watcher: do_lock()\r\n");
+                do_lock();
+            }
+            else
+            {
+                next = earliest(next, last_activity + timeout_lock * 1000);
+            }
+        }
+    }
+    // handle kill: if we're locked, check against locked_since (never happens if !use_tty),
+    // and against last_activity otherwise
+    if (timeout_kill > 0)
+    {
+        long long since   = locked_since ? locked_since : last_activity;
+        long long kill_at = since + (locked_since ? timeout_kill - timeout_lock : timeout_kill) * 1000;
+        long long warn_at = kill_at - warn_before_kill_seconds * 1000;
 
-void do_lock(void)
-{
-    locked_since = time(NULL);
-    kill(child, SIGURG);
+        if ((warn_before_kill_seconds > 0) && (kill_warned == 0) && (now >= warn_at))
+        {
+            kill_warned = 1;
+            fprintf(stderr, "warning: your session will be killed in %lu seconds if no input activity is detected.", warn_before_kill_seconds);
+            next = earliest(next, kill_at);
+        }
+        else if (now >= kill_at)
+        {
+            printdbg("parent: timeout_watcher: kill (%s), now=%lld since=%lld timeout_kill=%ld\r\n", locked_since ? "locked" : "unlocked", now, since, timeout_kill);
+            kill(child, SIGTERM);
+            // until it's gone, keep reminding it once a second
+            next = earliest(next, now + 1000);
+        }
+        else
+        {
+            next = earliest(next, (warn_before_kill_seconds > 0) && (kill_warned == 0) ? warn_at : kill_at);
+        }
+    }
+    return next;
 }
 
 
+/*
+ * Called by parent: the thread handling the lock and kill timeouts. It sleeps until
+ * the next deadline, or until woken up because the session was locked or unlocked
+ * meanwhile, see watcher_wake(). Activity only pushes the deadlines back: we find
+ * out when we wake up, and go back to sleep until the new ones.
+ */
 void *timeout_watcher(void *arg)
 {
     (void)arg;
     for ( ; ;)
     {
-        sleep(1);
-        time_t now = time(NULL);
-        if (use_tty && !locked_since)
+        long long     now  = now_ms();
+        long long     next = timeout_check(now);
+        struct pollfd pfd  = { watcher_pipe[0], POLLIN, 0 };
+        int           wait = -1;
+
+        if (next >= 0)
         {
-            // handle warn: if input is idle and we didn't already, warn
-            if ((warn_before_lock_seconds > 0) && (lock_warned == 0) && (now - last_activity + warn_before_lock_seconds > timeout_lock))
-            {
-                lock_warned = 1;
-                fprintf(stderr, "warning: your session will be locked in %lu seconds if no input activity is detected.", warn_before_lock_seconds);
-            }
-            // handle lock: if input is idle, and warn wasn't enough, lock
-            if ((timeout_lock > 0) && (now - last_activity > timeout_lock))
-            {
-                printdbg("parent: timeout_watcher: do_lock()\r\n");
-                do_lock();
-            }
+            wait = next - now > INT_MAX ? INT_MAX : (int)(next - now);
         }
-        // handle kill
-        if (timeout_kill > 0)
+        if ((poll(&pfd, 1, wait) > 0) && (pfd.revents & POLLIN))
         {
-            // if we're locked, check against the locked_since (never happens if !use_tty)
-            if (locked_since)
+            char buf[64];
+            if (read(watcher_pipe[0], buf, sizeof(buf)) < 0)
             {
-                if ((warn_before_kill_seconds > 0) && (kill_warned == 0) && (now - locked_since > timeout_kill - timeout_lock - warn_before_kill_seconds))
-                {
-                    kill_warned = 1;
-                    fprintf(stderr, "warning: your session will be killed in %lu seconds if no input activity is detected.", warn_before_kill_seconds);
-                }
-                else if (now - locked_since > timeout_kill - timeout_lock)
-                {
-                    printdbg("parent: timeout_watcher: kill (locked)\r\n");
-                    kill(child, SIGTERM);
-                }
+                // nothing to do about it, we'll look at the deadlines anyway
             }
-            // handle kill cont'd: if we're not locked, check against the last_activity
-            else
+        }
+    }
+}
+
+
+// called by child: write all of buf to fd, going on after signals, returns -1 on error
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
             {
-                if ((warn_before_kill_seconds > 0) && (kill_warned == 0) && (now - last_activity > timeout_kill - warn_before_kill_seconds))
-                {
-                    kill_warned = 1;
-                    fprintf(stderr, "warning: your session will be killed in %lu seconds if no input activity is detected.", warn_before_kill_seconds);
-                }
-                else if (now - last_activity > timeout_kill)
-                {
-                    printdbg("parent: timeout_watcher: kill (unlocked), now=%d last_activity=%d timeout_kill=%ld\r\n", (int)now, (int)last_activity, timeout_kill);
-                    kill(child, SIGTERM);
-                }
+                continue;
             }
+            return -1;
         }
+        buf += written;
+        len -= written;
     }
+    return 0;
 }
 
 
@@ -1367,6 +2915,39 @@ void dooutput(void)
         perror("sigaction");
         fail();
     }
+    // no SA_RESTART here: the read() we're waiting in must return, for us to rotate right away
+    memset(&act, '\0', sizeof(act));
+    act.sa_handler = &swing_output_file;
+    if (sigaction(SIGUSR1, &act, NULL))
+    {
+        perror("sigaction");
+        fail();
+    }
+
+    // each process draws its own jitter, see schedule_rotation()
+    srandom((unsigned int)getpid() ^ (unsigned int)time(NULL));
+    schedule_rotation(time(NULL));
+    if (opt_sync_interval > 0)
+    {
+        sync_start();
+    }
+    if (opt_shm != NULL)
+    {
+        live = live_create(opt_shm, opt_shm_size);
+        if (live == NULL)
+        {
+            fprintf(stderr, "Couldn't create the live view ring %s (%s), --shm will be ignored\r\n", opt_shm, strerror(errno));
+        }
+    }
+    if (opt_fanout != NULL)
+    {
+        fanout_start();
+    }
+    // the terminal is what may be slow, pipes are for callers that want to be waited on
+    if ((opt_output_queue > 0) && use_tty)
+    {
+        output_start();
+    }
 
     if (!use_tty)
     {
@@ -1385,9 +2966,32 @@ void dooutput(void)
         Header h;
         int    dont_write = 0;
 
+        if (rotate_requested)
+        {
+            rotation_requested();
+        }
+
         // we have a tty
         if (use_tty)
         {
+            struct timeval tv, *timeout = flush_timeout(&tv);
+            if (timeout != NULL)
+            {
+                fd_set rfds;
+                int    ret;
+                FD_ZERO(&rfds);
+                FD_SET(master, &rfds);
+                ret = select(master + 1, &rfds, NULL, NULL, timeout);
+                if (ret == 0)
+                {
+                    flush_idle();
+                    continue;
+                }
+                if ((ret < 0) && (errno == EINTR))
+                {
+                    continue;
+                }
+            }
             cc = read(master, obuf, BUFSIZ);
 
             if (cc == 0)
@@ -1428,8 +3032,9 @@ void dooutput(void)
                 }
             }
             printdbg2("[select:%d:%d]", stdout_pipe_opened, stderr_pipe_opened);
-            int retval     = select(nfds + 1, &rfds, NULL, NULL, NULL);
-            int current_fd = -1;
+            struct timeval tv;
+            int            retval     = select(nfds + 1, &rfds, NULL, NULL, flush_timeout(&tv));
+            int            current_fd = -1;
 
             cc = 0;
             if (retval == -1) // select failed
@@ -1440,7 +3045,12 @@ void dooutput(void)
                 }
                 continue;
             }
-            else if (retval)
+            else if (retval == 0) // flush_timeout() is over
+            {
+                flush_idle();
+                continue;
+            }
+            else
             {
                 const char *current_fd_name;
                 int        *pipe_flag;
@@ -1502,42 +3112,73 @@ void dooutput(void)
 
         if (!locked_since && (cc > 0))
         {
+            long long since;
+            int       ret;
+
+            // the time it was output at, whatever the terminal makes us wait below
             h.len = cc;
             gettimeofday(&h.tv, NULL);
-            if (write(target_fd, obuf, cc) == -1)
+            since           = now_ms();
+            ret             = output_started ? output_write(obuf, cc) : write_all(target_fd, obuf, cc);
+            output_blocked += now_ms() - since;
+            if (ret == -1)
             {
-                if (errno != EINTR)
+                printdbg("write(child-stdout,len=%d): %s", cc, strerror(errno));
+                if (stdout_pipe_opened)
                 {
-                    printdbg("write(child-stdout,len=%d): %s", cc, strerror(errno));
-                    if (stdout_pipe_opened)
-                    {
-                        close(stdout_pipe[0]);
-                    }
-                    if (stderr_pipe_opened)
-                    {
-                        close(stderr_pipe[0]);
-                    }
-                    break;
+                    close(stdout_pipe[0]);
+                }
+                if (stderr_pipe_opened)
+                {
+                    close(stderr_pipe[0]);
                 }
+                break;
             }
             if (!dont_write)
             {
-                (void)write_header(fscript, &h);
-                (void)fwrite_wrapper(obuf, 1, cc, fscript);
+                if (rotation_due(h.tv.tv_sec, h.len))
+                {
+                    rotate_output_file();
+                }
+                if (script.remote && (daemon_record(&h, obuf) != 0))
+                {
+                    // whatever ttyrecd didn't write is lost: go on by ourselves, in a new file
+                    daemon_lost();
+                    rotate_output_file();
+                }
+                if (!script.remote)
+                {
+                    // can't rely on the return value here: with zstd, it's the number of bytes flushed to disk
+                    sync_hold();
+                    (void)writer_record(script.writer, &h, obuf);
+                    sync_release(1);
+                }
+                if (live != NULL)
+                {
+                    live_write(live, &h, obuf);
+                }
+                fanout_publish(&h, obuf);
+                summary_add(&script.summary, &h);
+                rotate_written += HEADER_SIZE + h.len;
+                if ((opt_prealloc > 0) && !script.remote)
+                {
+                    preallocate(&script);
+                }
             }
             bytes_out    += cc;
-            last_activity = time(NULL);
+            last_activity = now_ms();
             lock_warned   = 0;
             kill_warned   = 0;
         }
     }
 
     printdbg("child: end dooutput, waiting can_exit (== %d)\r\n", can_exit);
+    output_stop();
 
     while (can_exit == 0)
     {
         waitedpid = waitpid(-1, &childexit, 0);
-        if (waitedpid < 0) // oops, all our children are already dead (ECHILD)
+        if ((waitedpid < 0) && (errno != EINTR)) // oops, all our children are already dead (ECHILD)
         {
             printdbg("child: oops, subchild is already dead!\r\n");
             can_exit = 1;
@@ -1547,7 +3188,23 @@ void dooutput(void)
     printdbg("child: end dooutput, can_exit done, status %d, exiting\r\n", childexit);
     if (opt_count_bytes)
     {
-        fprintf(stderr, "\r\nTTY_BYTES_OUT=%llu\r\n", bytes_out);
+        fprintf(stderr, "\r\nTTY_BYTES_OUT=%llu\r\nTTY_OUTPUT_BLOCKED_MS=%lld\r\n", bytes_out, output_blocked);
+        if (output_queue != NULL)
+        {
+            fprintf(stderr, "TTY_OUTPUT_QUEUE_MAX=%lu\r\nTTY_OUTPUT_DROPPED=%llu\r\n", (unsigned long)output_len_max, output_dropped);
+        }
+        if (sync_started)
+        {
+            pthread_mutex_lock(&sync_lock);
+            fprintf(stderr, "TTY_SYNC_COUNT=%lu\r\nTTY_SYNC_LAG_MAX_MS=%lld\r\n", sync_count, sync_lag_max);
+            pthread_mutex_unlock(&sync_lock);
+        }
+        if (fanout_started)
+        {
+            pthread_mutex_lock(&fanout_lock);
+            fprintf(stderr, "TTY_FANOUT_SUBSCRIBERS=%lu\r\nTTY_FANOUT_DROPPED=%llu\r\n", fanout_accepted, fanout_dropped);
+            pthread_mutex_unlock(&fanout_lock);
+        }
     }
     done(childexit);
 }
@@ -1556,7 +3213,7 @@ void dooutput(void)
 // called by subchild
 void doshell(const char *command, char **params)
 {
-    (void)fclose_wrapper(fscript);
+    forget_script();
     if (use_tty)
     {
         getslave();
@@ -1628,6 +3285,8 @@ void sigterm_handler(int signal)
         // our child is stuck writing to us, while we're writing to our stdout
         // read by our caller, stuck writing to our child
         kill(subchild, SIGTERM);
+        // and have the terminal get what it's still owed first
+        output_stop();
         (void)puts("\r\nttyrec: ending your session, sorry (kill timeout expired, you manually typed the kill key sequence, or we got a SIGTERM).\r");
     }
     done(EXIT_SUCCESS);
@@ -1645,6 +3304,363 @@ void sighup_handler(int signal)
 }
 
 
+/*
+ * When appending to an existing file, carry on with the summary it already has,
+ * if it's valid: otherwise, we can't write a correct one when we close it.
+ */
+void summary_open(const char *name)
+{
+    FILE        *fp = fopen(name, "r");
+    struct stat st;
+
+    memset(&script.summary, 0, sizeof(script.summary));
+    script.summary_known = 1;
+    if (fp == NULL)
+    {
+        // new file
+        return;
+    }
+    if (!summary_read(name, fp, &script.summary) && (fstat(fileno(fp), &st) == 0) && (st.st_size > 0))
+    {
+        memset(&script.summary, 0, sizeof(script.summary));
+        script.summary_known = 0;
+    }
+    fclose(fp);
+}
+
+
+/*
+ * Open a ttyrec file into seg, to be compressed as asked on the command line: by ttyrecd
+ * if we're connected to it and it takes it, by ourselves otherwise. Returns 0 on success,
+ * -1 on error (with errno set).
+ */
+int open_segment(Segment *seg, const char *name, const char *mode)
+{
+    FILE *fp = fopen(name, mode);
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    if ((daemon_sock >= 0) && (daemon_open(seg, name, fp) == 0))
+    {
+        // ttyrecd has its own copy of the file descriptor
+        fclose(fp);
+        seg->writer = NULL;
+        seg->remote = 1;
+        return 0;
+    }
+    setbuf(fp, NULL);
+    seg->writer = writer_new(fp, get_compress_mode());
+    seg->remote = 0;
+    if (seg->writer == NULL)
+    {
+        fclose(fp);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+
+/* connect to ttyrecd, returns the socket, or -1 on error (with errno set) */
+int daemon_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    struct timeval     timeout = { TTYRECD_TIMEOUT_SECONDS, 0 };
+    int                sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        return -1;
+    }
+    (void)fcntl(sock, F_SETFD, FD_CLOEXEC);
+    // if ttyrecd hangs, we'd rather write locally than hang the session along with it
+    (void)setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    (void)setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+    {
+        int one = 1;
+        (void)setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    }
+#endif
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        int err = errno;
+        (void)close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+
+/* send a whole message to ttyrecd, returns 0 on success, -1 on error */
+int daemon_send(const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t sent = send(daemon_sock, p, len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p   += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+
+/*
+ * Hand the ttyrec file name, just opened as fp, to ttyrecd (see ttyrecd.h), along with
+ * its sidecar when it needs one. Returns 0 if ttyrecd took it, -1 otherwise, in which
+ * case we're not connected to it anymore, and have to write by ourselves from now on.
+ */
+int daemon_open(Segment *seg, const char *name, FILE *fp)
+{
+    TtyrecdOpen    req;
+    unsigned char  msg[TTYRECD_MSG_HEADER_SIZE + sizeof(req)];
+    int            fds[2]  = { fileno(fp), -1 };
+    char           cbuf[CMSG_SPACE(sizeof(fds))];
+    struct msghdr  mh;
+    struct iovec   iov;
+    struct cmsghdr *cmsg;
+    unsigned char  reply = 0;
+    ssize_t        sent;
+
+    memset(&req, 0, sizeof(req));
+    req.version = TTYRECD_VERSION;
+    req.level   = (int32_t)opt_compress_level;
+    req.summary = seg->summary;
+    if (opt_fsync)
+    {
+        req.flags |= TTYRECD_OPEN_FSYNC;
+    }
+    if (get_compress_mode() == COMPRESS_ZSTD)
+    {
+        req.flags |= TTYRECD_OPEN_ZSTD | (seg->summary_known ? TTYRECD_OPEN_TRAILER : 0);
+    }
+    else if (opt_summary && seg->summary_known)
+    {
+        // ttyrecd won't open files itself, so it needs the sidecar open already
+        char sidecar[BUFSIZ];
+        snprintf(sidecar, sizeof(sidecar), "%s%s", name, SUMMARY_SIDECAR_SUFFIX);
+        if ((fds[1] = open(sidecar, O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0)
+        {
+            req.flags |= TTYRECD_OPEN_SIDECAR;
+        }
+    }
+
+    msg[0] = TTYRECD_MSG_OPEN;
+    put_le32(msg + 1, sizeof(req));
+    memcpy(msg + TTYRECD_MSG_HEADER_SIZE, &req, sizeof(req));
+    memset(&mh, 0, sizeof(mh));
+    memset(cbuf, 0, sizeof(cbuf));
+    iov.iov_base          = msg;
+    iov.iov_len           = sizeof(msg);
+    mh.msg_iov            = &iov;
+    mh.msg_iovlen         = 1;
+    mh.msg_control        = cbuf;
+    mh.msg_controllen     = CMSG_SPACE((fds[1] >= 0 ? 2 : 1) * sizeof(int));
+    cmsg                  = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level      = SOL_SOCKET;
+    cmsg->cmsg_type       = SCM_RIGHTS;
+    cmsg->cmsg_len        = CMSG_LEN((fds[1] >= 0 ? 2 : 1) * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, (fds[1] >= 0 ? 2 : 1) * sizeof(int));
+
+    do
+    {
+        sent = sendmsg(daemon_sock, &mh, MSG_NOSIGNAL);
+    } while ((sent < 0) && (errno == EINTR));
+    if (fds[1] >= 0)
+    {
+        (void)close(fds[1]);
+    }
+    if ((sent != (ssize_t)sizeof(msg)) || (recv(daemon_sock, &reply, 1, 0) != 1))
+    {
+        daemon_lost();
+        return -1;
+    }
+    if (reply != 0)
+    {
+        printdbg("ttyrecd won't write %s (%s), recording locally\r\n", name, strerror(reply));
+        daemon_lost();
+        return -1;
+    }
+    return 0;
+}
+
+
+/* called by child: send a record (of at most BUFSIZ bytes) to ttyrecd, returns 0 on success, -1 on error */
+int daemon_record(Header *h, const char *buf)
+{
+    unsigned char msg[TTYRECD_MSG_HEADER_SIZE + HEADER_SIZE + BUFSIZ];
+
+    msg[0] = TTYRECD_MSG_RECORD;
+    put_le32(msg + 1, HEADER_SIZE + h->len);
+    encode_header(msg + TTYRECD_MSG_HEADER_SIZE, h);
+    memcpy(msg + TTYRECD_MSG_HEADER_SIZE + HEADER_SIZE, buf, h->len);
+    return daemon_send(msg, TTYRECD_MSG_HEADER_SIZE + HEADER_SIZE + h->len);
+}
+
+
+// called by child on exit: have ttyrecd finish the current file, and wait until it's done
+void daemon_close(void)
+{
+    unsigned char msg[TTYRECD_MSG_HEADER_SIZE] = { TTYRECD_MSG_CLOSE, 0, 0, 0, 0 };
+    unsigned char reply;
+
+    if (daemon_sock < 0)
+    {
+        return;
+    }
+    if ((daemon_send(msg, sizeof(msg)) != 0) || (recv(daemon_sock, &reply, 1, 0) != 1) || (reply != 0))
+    {
+        printdbg("ttyrecd couldn't finish %s\r\n", script.name);
+    }
+    (void)close(daemon_sock);
+    daemon_sock = -1;
+}
+
+
+// ttyrecd is gone, or can't be trusted with our records anymore: we'll write them ourselves
+void daemon_lost(void)
+{
+    printdbg("lost ttyrecd (%s), recording locally\r\n", strerror(errno));
+    (void)close(daemon_sock);
+    daemon_sock = -1;
+}
+
+
+// called by parent and subchild: the ttyrec file is written by child (or ttyrecd), not by us
+void forget_script(void)
+{
+    if (script.writer != NULL)
+    {
+        (void)writer_close(script.writer);
+    }
+    if (daemon_sock >= 0)
+    {
+        (void)close(daemon_sock);
+    }
+}
+
+
+/*
+ * Give back the disk space reserved by preallocate() past the end of a ttyrec file
+ * we're about to close. Called from the closer thread for rotated files.
+ */
+void trim_preallocated(Segment *seg)
+{
+#ifdef HAVE_fallocate
+    int         fd = fileno(writer_file(seg->writer));
+    struct stat st;
+
+    (void)fflush(writer_file(seg->writer));
+    if ((fstat(fd, &st) != 0) || (st.st_size >= seg->allocated))
+    {
+        return;
+    }
+    // some filesystems (ext4) won't punch holes past the end of a file, but all of them
+    // drop the blocks past it when truncating it to its current size
+    (void)fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st.st_size, seg->allocated - st.st_size);
+    (void)ftruncate(fd, st.st_size);
+#else
+    (void)seg;
+#endif
+    seg->allocated = 0;
+}
+
+
+/*
+ * Close a ttyrec file, leaving its summary behind (see summary.h): as a trailing zstd
+ * skippable frame for compressed files, and if asked to, in a sidecar file for
+ * uncompressed ones. Called from the closer thread for rotated files.
+ */
+void close_segment(Segment *seg)
+{
+    if (seg->remote)
+    {
+        // ttyrecd does all that, see daemon_close()
+        free(seg->name);
+        seg->name = NULL;
+        return;
+    }
+    writer_end_frame(seg->writer);
+    if ((get_compress_mode() == COMPRESS_ZSTD) && seg->summary_known)
+    {
+        (void)summary_write_trailer(writer_file(seg->writer), &seg->summary);
+    }
+    if (seg->allocated > 0)
+    {
+        trim_preallocated(seg);
+    }
+    if (opt_fsync)
+    {
+        (void)fflush(writer_file(seg->writer));
+        (void)fsync(fileno(writer_file(seg->writer)));
+    }
+    else if (opt_sync_interval > 0)
+    {
+        // keep the promise of --sync-interval-ms up to the end of the file
+        (void)fflush(writer_file(seg->writer));
+#ifdef HAVE_fdatasync
+        (void)fdatasync(fileno(writer_file(seg->writer)));
+#else
+        (void)fsync(fileno(writer_file(seg->writer)));
+#endif
+    }
+    (void)writer_close(seg->writer);
+    seg->writer = NULL;
+    if (opt_summary && (get_compress_mode() == COMPRESS_NONE) && seg->summary_known && (seg->name != NULL))
+    {
+        (void)summary_write_sidecar(seg->name, &seg->summary);
+    }
+    free(seg->name);
+    seg->name = NULL;
+}
+
+
+// close the current ttyrec file, once the closer thread is done with the previous ones
+void close_script(void)
+{
+    closer_drain();
+    if (script.remote)
+    {
+        daemon_close();
+        close_segment(&script);
+    }
+    else if (script.writer != NULL)
+    {
+        close_segment(&script);
+    }
+}
+
+
 void done(int status)
 {
     // Sometimes (happens once every ~1 million executions in some environments), we might get a SIGHUP
@@ -1663,7 +3679,11 @@ void done(int status)
         printdbg("child: done, cleaning up and exiting with %d (child=%d subchild=%d)\r\n", WEXITSTATUS(status), child, subchild);
         // if we were locked, unlock before exiting to avoid leaving the real terminal of our user stuck in altscreen
         unlock_session(SIGUSR2);
-        (void)fclose_wrapper(fscript);
+        output_stop();
+        live_close(live);
+        fanout_stop();
+        sync_stop();
+        close_script();
         (void)close(master);
     }
     else
@@ -2137,7 +4157,32 @@ void help(void)
             "                              defaulting to working directory if both -f and -d are omitted)\n"                       \
             "  -F, --name-format FMT     custom strftime-compatible format string to qualify the full path of the output files,\n" \
             "                              including the SIGUSR1 rotated ones\n"                                                   \
-            "  -a, --append              open the ttyrec output file in append mode instead of write-clobber mode\n");
+            "  -a, --append              open the ttyrec output file in append mode instead of write-clobber mode\n"             \
+            "      --summary             on close, write a summary of uncompressed ttyrec files to FILE.sum, for quick lookups\n"  \
+            "                              (compressed files always get one, at their end)\n"                                     \
+            "      --rotate-size SIZE    close the ttyrec file and go on in a new one before it gets over SIZE bytes\n"          \
+            "                              (before compression, if any), K, M and G suffixes are accepted\n"                    \
+            "      --rotate-interval S   close the ttyrec file and go on in a new one after S seconds, minus up to %d%%\n"        \
+            "                              at random so that sessions started together don't rotate together\n"                  \
+            "      --fsync               make sure each ttyrec file is on disk before closing it (rotated files are closed\n"    \
+            "                              in the background, this doesn't hold the recording up)\n"                              \
+            "      --sync-interval-ms MS make sure what was recorded is on disk at most MS milliseconds later (synced by\n"       \
+            "                              a background thread, only when there is new data), -n also prints the actual lag\n"    \
+            "      --daemon[=SOCKET]     have ttyrecd (listening on SOCKET, default %s) write the ttyrec files,\n"                \
+            "                              falling back to writing them ourselves when it's not available\n"                      \
+            "      --prealloc SIZE       reserve disk space for the ttyrec file SIZE bytes at a time as it grows, to limit\n"     \
+            "                              fragmentation (K, M and G suffixes are accepted), unused space is freed on close\n"    \
+            "      --shm NAME            also publish the recent output to the shared-memory ring NAME, for ttyplay --shm\n"      \
+            "                              to watch the session live, without any disk I/O (ignored if NAME exists)\n"            \
+            "      --shm-size SIZE       size of that ring, default is 1M (K, M and G suffixes are accepted)\n"                   \
+            "      --fanout PATH         also stream the session live, in ttyrec format, to whoever connects to the unix\n"       \
+            "                              socket PATH, without ever waiting on them (-n also prints how much they missed)\n"     \
+            "      --fanout-queue SIZE   how much each of them may fall behind before missing records, default is 256K\n"         \
+            "      --output-queue SIZE   write to the terminal from a background thread, through a queue of up to SIZE\n"         \
+            "                              bytes, so that a slow terminal doesn't hold the session back (at least 64K)\n"         \
+            "      --output-overflow P   when that queue is full: 'block' the session until there's room (default), or\n"         \
+            "                              'drop' output from the terminal (never from the recording) until it caught up\n"       \
+            , ROTATE_JITTER_PERCENT, TTYRECD_SOCKET);
 #ifdef HAVE_zstd
     fprintf(stderr,                                                                                                                         \
             "  -Z                        enable on-the-fly compression if available, silently fallback to no compression if not\n"          \
@@ -9,5 +9,11 @@ typedef struct header
     int            len;
 } Header;
 
+// size of a record header on disk: tv_sec, tv_usec, len (3 x 32 bits)
+#define HEADER_SIZE       12
+
+// upper sanity bound on a record length read from a (possibly corrupt) file
+#define MAX_RECORD_LEN    (16 * 1024 * 1024)
+
 
 #endif
@@ -0,0 +1,987 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * ttyrecd: write the recordings of all the ttyrec sessions of a host (those started
+ * with --daemon), so that they share a few writer threads, rather than each having
+ * its own zstd context and doing its own small writes. See ttyrecd.h for what the
+ * sessions send us.
+ *
+ * The main thread only moves bytes around: it accepts sessions, reads their messages,
+ * and queues their records. A session is handed to the writer threads once it has
+ * BATCH_SIZE bytes queued, or once the oldest of them has waited --batch-ms: a writer
+ * thread then writes (and compresses) all it has at once, with a single write() for
+ * uncompressed files.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "configure.h"
+#include "ttyrec.h"
+#include "io.h"
+#include "compress.h"
+#include "summary.h"
+#include "ttyrecd.h"
+
+#define BATCH_SIZE    (64 * 1024)       // hand a session to a writer thread once it has that much queued
+#define MAX_QUEUED    (4 * 1024 * 1024) // stop reading from a session that has that much queued
+#define MAX_FDS       4                 // received, but not yet claimed by an OPEN
+
+// a piece of work queued for a session, done in order by a writer thread
+typedef struct item
+{
+    char        type;    // TTYRECD_MSG_*, or 'S' for a sync, see --sync-interval-ms
+    char        *data;   // RECORD: the records, back to back
+    size_t      len;
+    size_t      size;
+    int         fd;      // OPEN: the recording
+    int         sidecar; // OPEN: its sidecar, or -1
+    TtyrecdOpen req;     // OPEN
+    struct item *next;
+} Item;
+
+typedef enum
+{
+    SESSION_IDLE = 0, // nothing to do, or not yet worth it
+    SESSION_QUEUED,   // in the run queue
+    SESSION_BUSY,     // a writer thread is on it
+} session_state_t;
+
+typedef struct session
+{
+    int             sock;
+
+    // main thread only
+    char            *in;              // received, not yet parsed
+    size_t          inLen;
+    size_t          inSize;
+    int             fds[MAX_FDS];     // received, for the next OPENs
+    int             nfds;
+    long long       pendingSince;     // when the oldest record not yet handed over was queued, 0 if none
+    struct session  *nextAll;
+
+    // guarded by lock
+    Item            *items;
+    Item            *lastItem;
+    size_t          queued;           // bytes of records in items
+    session_state_t state;
+    int             gone;             // the client left: free the session once all is written
+    long long       dirtySince;       // when records were written that aren't synced yet, 0 if none
+    struct session  *next;            // in the run queue
+
+    // the writer thread on it only
+    Writer          *writer;
+    int             sidecar;
+    uint32_t        flags;
+    Summary         summary;
+    int             failed;           // couldn't write, the client was sent away
+} Session;
+
+void usage(void);
+long long now_ms(void);
+Item *item_new(char type);
+void item_free(Item *it);
+void session_queue(Session *s, Item *it);
+void session_run(Session *s);
+void session_free(Session *s);
+int session_read(Session *s);
+int session_parse(Session *s);
+int finish_file(Session *s);
+int sync_file(Session *s);
+void do_items(Session *s, Item *items);
+void *writer_thread(void *arg);
+void stop_handler(int signal);
+
+static const char *opt_socket        = TTYRECD_SOCKET; // -s
+static long       opt_batch_ms       = 50;             // --batch-ms
+static long       opt_sync_interval  = 0;              // --sync-interval-ms
+
+static pthread_mutex_t lock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work_cond  = PTHREAD_COND_INITIALIZER; // something in the run queue
+static pthread_cond_t  gone_cond  = PTHREAD_COND_INITIALIZER; // a session was freed
+static Session         *runq      = NULL;                     // oldest first
+static Session         *runqLast  = NULL;
+static unsigned long   live       = 0;                        // sessions not freed yet
+
+static volatile sig_atomic_t stopping = 0;
+
+
+void usage(void)
+{
+    printf("Usage: ttyrecd [OPTION]...\n");
+    printf("Write the recordings of the ttyrec sessions started with --daemon, in the foreground.\n\n");
+    printf("  -s, --socket PATH          Listen on PATH [%s]\n", TTYRECD_SOCKET);
+    printf("  -j, --jobs N               Write and compress with N threads [number of CPUs]\n");
+    printf("      --batch-ms MS          Let records wait up to MS milliseconds, to write them in batches [50]\n");
+    printf("      --sync-interval-ms MS  Sync recordings to disk at most MS milliseconds after they're written\n");
+    printf("  -h, --help                 Show this help\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/* current time in milliseconds, on a clock that doesn't jump if we have one */
+long long now_ms(void)
+{
+#ifdef HAVE_clock_gettime
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+Item *item_new(char type)
+{
+    Item *it = calloc(1, sizeof(*it));
+
+    if (it == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    it->type    = type;
+    it->fd      = -1;
+    it->sidecar = -1;
+    return it;
+}
+
+
+void item_free(Item *it)
+{
+    if (it->fd >= 0)
+    {
+        (void)close(it->fd);
+    }
+    if (it->sidecar >= 0)
+    {
+        (void)close(it->sidecar);
+    }
+    free(it->data);
+    free(it);
+}
+
+
+// called with the lock held
+void session_queue(Session *s, Item *it)
+{
+    if (s->lastItem == NULL)
+    {
+        s->items = it;
+    }
+    else
+    {
+        s->lastItem->next = it;
+    }
+    s->lastItem = it;
+}
+
+
+// called with the lock held: have a writer thread do what's queued for s, unless one already is
+void session_run(Session *s)
+{
+    if (s->state != SESSION_IDLE)
+    {
+        return;
+    }
+    s->state = SESSION_QUEUED;
+    s->next  = NULL;
+    if (runqLast == NULL)
+    {
+        runq = s;
+    }
+    else
+    {
+        runqLast->next = s;
+    }
+    runqLast = s;
+    pthread_cond_signal(&work_cond);
+}
+
+
+// called by a writer thread, once the client is gone and all it sent us is written
+void session_free(Session *s)
+{
+    if (s->writer != NULL)
+    {
+        (void)finish_file(s);
+    }
+    (void)close(s->sock);
+    for (int i = 0; i < s->nfds; i++)
+    {
+        (void)close(s->fds[i]);
+    }
+    free(s->in);
+    free(s);
+
+    pthread_mutex_lock(&lock);
+    live--;
+    pthread_cond_broadcast(&gone_cond);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/* read what the client sent us, returns -1 once it's gone (or has to be) */
+int session_read(Session *s)
+{
+    char            cbuf[CMSG_SPACE(MAX_FDS * sizeof(int))];
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr  *cmsg;
+    ssize_t         got;
+
+    if (s->inSize - s->inLen < BATCH_SIZE)
+    {
+        char *p = realloc(s->in, s->inSize + BATCH_SIZE);
+        if (p == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        s->in      = p;
+        s->inSize += BATCH_SIZE;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base       = s->in + s->inLen;
+    iov.iov_len        = s->inSize - s->inLen;
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    got                = recvmsg(s->sock, &msg, MSG_DONTWAIT);
+    if (got < 0)
+    {
+        return (errno == EAGAIN) || (errno == EINTR) ? 0 : -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+        {
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n; i++)
+            {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (s->nfds < MAX_FDS)
+                {
+                    s->fds[s->nfds++] = fd;
+                }
+                else
+                {
+                    (void)close(fd);
+                }
+            }
+        }
+    }
+    if (got == 0)
+    {
+        return -1;
+    }
+    s->inLen += got;
+    return session_parse(s);
+}
+
+
+/*
+ * Send a reply byte to s. Never waits: anyone may connect, so a client that doesn't read
+ * its replies must not hold up the others. Returns -1 if it couldn't take it, the client
+ * is then to be sent away.
+ */
+static int reply_to(Session *s, unsigned char reply)
+{
+    return send(s->sock, &reply, 1, MSG_NOSIGNAL | MSG_DONTWAIT) == 1 ? 0 : -1;
+}
+
+
+// take the oldest file descriptor received from s
+static int claim_fd(Session *s)
+{
+    int fd = s->fds[0];
+
+    memmove(s->fds, s->fds + 1, (s->nfds - 1) * sizeof(int));
+    s->nfds--;
+    return fd;
+}
+
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/* queue all the complete messages received from s, returns -1 if it sent garbage */
+int session_parse(Session *s)
+{
+    size_t pos = 0;
+    int    ret = 0;
+
+    while (s->inLen - pos >= TTYRECD_MSG_HEADER_SIZE)
+    {
+        const unsigned char *msg = (const unsigned char *)s->in + pos;
+        char                type = msg[0];
+        uint32_t            len  = get_le32(msg + 1);
+        Item                *it;
+
+        if (len > HEADER_SIZE + MAX_RECORD_LEN)
+        {
+            ret = -1;
+            break;
+        }
+        if (s->inLen - pos - TTYRECD_MSG_HEADER_SIZE < len)
+        {
+            // the rest is yet to come
+            break;
+        }
+        msg += TTYRECD_MSG_HEADER_SIZE;
+        pos += TTYRECD_MSG_HEADER_SIZE + len;
+
+        if (type == TTYRECD_MSG_RECORD)
+        {
+            Header h;
+            if (len < HEADER_SIZE)
+            {
+                ret = -1;
+                break;
+            }
+            decode_header(msg, &h);
+            if ((h.len < 0) || ((uint32_t)h.len != len - HEADER_SIZE))
+            {
+                ret = -1;
+                break;
+            }
+
+            pthread_mutex_lock(&lock);
+            it = s->lastItem;
+            if ((it == NULL) || (it->type != TTYRECD_MSG_RECORD) || (it->len + len > it->size))
+            {
+                it       = item_new(TTYRECD_MSG_RECORD);
+                it->size = len > BATCH_SIZE ? len : BATCH_SIZE;
+                if ((it->data = malloc(it->size)) == NULL)
+                {
+                    perror("malloc");
+                    exit(EXIT_FAILURE);
+                }
+                session_queue(s, it);
+            }
+            memcpy(it->data + it->len, msg, len);
+            it->len   += len;
+            s->queued += len;
+            if (s->pendingSince == 0)
+            {
+                s->pendingSince = now_ms();
+            }
+            if (s->queued >= BATCH_SIZE)
+            {
+                session_run(s);
+                s->pendingSince = 0;
+            }
+            pthread_mutex_unlock(&lock);
+        }
+        else if (type == TTYRECD_MSG_OPEN)
+        {
+            unsigned char reply = 0;
+            int           nfds;
+
+            if (len != sizeof(TtyrecdOpen))
+            {
+                ret = -1;
+                break;
+            }
+            it = item_new(TTYRECD_MSG_OPEN);
+            memcpy(&it->req, msg, sizeof(it->req));
+            nfds = (it->req.flags & TTYRECD_OPEN_SIDECAR) ? 2 : 1;
+            if (s->nfds < nfds)
+            {
+                item_free(it);
+                ret = -1;
+                break;
+            }
+            it->fd = claim_fd(s);
+            if (nfds > 1)
+            {
+                it->sidecar = claim_fd(s);
+            }
+
+            if (it->req.version != TTYRECD_VERSION)
+            {
+                reply = EPROTO;
+            }
+#ifndef HAVE_zstd
+            else if (it->req.flags & TTYRECD_OPEN_ZSTD)
+            {
+                reply = EPROTONOSUPPORT;
+            }
+#endif
+            if (reply_to(s, reply) != 0)
+            {
+                item_free(it);
+                ret = -1;
+                break;
+            }
+            if (reply != 0)
+            {
+                // the client will write the file itself
+                item_free(it);
+                continue;
+            }
+            pthread_mutex_lock(&lock);
+            session_queue(s, it);
+            pthread_mutex_unlock(&lock);
+        }
+        else if (type == TTYRECD_MSG_CLOSE)
+        {
+            pthread_mutex_lock(&lock);
+            session_queue(s, item_new(TTYRECD_MSG_CLOSE));
+            // the client is waiting for us
+            session_run(s);
+            s->pendingSince = 0;
+            pthread_mutex_unlock(&lock);
+        }
+        else
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    memmove(s->in, s->in + pos, s->inLen - pos);
+    s->inLen -= pos;
+    return ret;
+}
+
+
+/*
+ * Close the current file of s, leaving its summary behind: as a trailing zstd skippable
+ * frame, or in the sidecar we were given. Returns 0 on success, -1 on error.
+ */
+int finish_file(Session *s)
+{
+    FILE        *fp  = writer_file(s->writer);
+    int         ret  = 0;
+    struct stat st;
+
+    writer_end_frame(s->writer);
+    if (s->flags & TTYRECD_OPEN_TRAILER)
+    {
+        (void)summary_write_trailer(fp, &s->summary);
+    }
+    if (fflush(fp) != 0)
+    {
+        ret = -1;
+    }
+    if (s->flags & TTYRECD_OPEN_FSYNC)
+    {
+        (void)fsync(fileno(fp));
+    }
+    else if (opt_sync_interval > 0)
+    {
+#ifdef HAVE_fdatasync
+        (void)fdatasync(fileno(fp));
+#else
+        (void)fsync(fileno(fp));
+#endif
+    }
+    if (s->sidecar >= 0)
+    {
+        FILE *sc = fdopen(s->sidecar, "w");
+        if ((sc != NULL) && (fstat(fileno(fp), &st) == 0))
+        {
+            s->summary.file_size = st.st_size;
+            (void)summary_write_sidecar_fp(sc, &s->summary);
+        }
+        if (sc != NULL)
+        {
+            (void)fclose(sc);
+        }
+        else
+        {
+            (void)close(s->sidecar);
+        }
+        s->sidecar = -1;
+    }
+    if (writer_close(s->writer) != 0)
+    {
+        ret = -1;
+    }
+    s->writer = NULL;
+    return ret;
+}
+
+
+// have all that was written to the current file of s on disk
+int sync_file(Session *s)
+{
+    if (writer_flush(s->writer) != 0)
+    {
+        return -1;
+    }
+#ifdef HAVE_fdatasync
+    return fdatasync(fileno(writer_file(s->writer)));
+#else
+    return fsync(fileno(writer_file(s->writer)));
+#endif
+}
+
+
+static void open_file(Session *s, Item *it)
+{
+    FILE *fp = fdopen(it->fd, "a");
+
+    if (fp == NULL)
+    {
+        s->failed = 1;
+        return;
+    }
+    // we write whole batches at once, see do_items()
+    (void)setvbuf(fp, NULL, _IOFBF, BATCH_SIZE);
+    s->writer = writer_new(fp, (it->req.flags & TTYRECD_OPEN_ZSTD) ? COMPRESS_ZSTD : COMPRESS_NONE);
+    if (s->writer == NULL)
+    {
+        (void)fclose(fp);
+        it->fd    = -1;
+        s->failed = 1;
+        return;
+    }
+    if (it->req.level > 0)
+    {
+        writer_set_level(s->writer, it->req.level);
+    }
+    it->fd     = -1; // the writer has it now
+    s->sidecar = it->sidecar;
+    it->sidecar = -1;
+    s->flags   = it->req.flags;
+    s->summary = it->req.summary;
+}
+
+
+// account the records of a batch in the summary of the file they go to
+static void add_records(Session *s, const char *data, size_t len)
+{
+    Header h;
+
+    for (size_t pos = 0; pos + HEADER_SIZE <= len; pos += HEADER_SIZE + h.len)
+    {
+        decode_header(data + pos, &h);
+        summary_add(&s->summary, &h);
+    }
+}
+
+
+/* called by a writer thread: do the items taken from s, in order, then free them */
+void do_items(Session *s, Item *items)
+{
+    int wrote = 0;
+
+    while (items != NULL)
+    {
+        Item *it = items;
+        items = it->next;
+
+        if (s->failed)
+        {
+            // the client will notice it's been sent away, see below
+        }
+        else if (it->type == TTYRECD_MSG_OPEN)
+        {
+            if ((s->writer != NULL) && (finish_file(s) != 0))
+            {
+                fprintf(stderr, "ttyrecd: couldn't finish writing a file: %s\n", strerror(errno));
+            }
+            open_file(s, it);
+        }
+        else if (it->type == TTYRECD_MSG_RECORD)
+        {
+            if ((s->writer == NULL) || (writer_write(s->writer, it->data, it->len) != 0))
+            {
+                s->failed = 1;
+            }
+            else
+            {
+                add_records(s, it->data, it->len);
+                wrote = 1;
+            }
+        }
+        else if (it->type == TTYRECD_MSG_CLOSE)
+        {
+            unsigned char reply = 0;
+            if ((s->writer != NULL) && (finish_file(s) != 0))
+            {
+                reply = EIO;
+            }
+            if (reply_to(s, reply) != 0)
+            {
+                s->failed = 1;
+            }
+        }
+        else if (it->type == 'S')
+        {
+            if (s->writer != NULL)
+            {
+                (void)sync_file(s);
+            }
+            pthread_mutex_lock(&lock);
+            s->dirtySince = 0;
+            pthread_mutex_unlock(&lock);
+        }
+        item_free(it);
+    }
+
+    if (s->failed)
+    {
+        // the client's next message will fail, and it'll go on writing by itself
+        (void)shutdown(s->sock, SHUT_RDWR);
+        return;
+    }
+    if (wrote && (s->writer != NULL) && !(s->flags & TTYRECD_OPEN_ZSTD))
+    {
+        // uncompressed records are in the stdio buffer: hand them to the kernel at once
+        (void)fflush(writer_file(s->writer));
+    }
+    if (wrote && (opt_sync_interval > 0))
+    {
+        pthread_mutex_lock(&lock);
+        if (s->dirtySince == 0)
+        {
+            s->dirtySince = now_ms();
+        }
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+
+/* the writer threads: take the sessions with work queued, in turn */
+void *writer_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    while (1)
+    {
+        Session *s;
+        Item    *items;
+
+        while (runq == NULL)
+        {
+            pthread_cond_wait(&work_cond, &lock);
+        }
+        s    = runq;
+        runq = s->next;
+        if (runq == NULL)
+        {
+            runqLast = NULL;
+        }
+        s->state    = SESSION_BUSY;
+        items       = s->items;
+        s->items    = NULL;
+        s->lastItem = NULL;
+        s->queued   = 0;
+        pthread_mutex_unlock(&lock);
+
+        do_items(s, items);
+
+        pthread_mutex_lock(&lock);
+        s->state = SESSION_IDLE;
+        if (s->items != NULL)
+        {
+            session_run(s);
+        }
+        else if (s->gone)
+        {
+            pthread_mutex_unlock(&lock);
+            session_free(s);
+            pthread_mutex_lock(&lock);
+        }
+    }
+    return NULL;
+}
+
+
+void stop_handler(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct sigaction   act;
+    struct pollfd      *pfds    = NULL;
+    Session            **polled = NULL;
+    size_t             pollSize = 0;
+    Session            *sessions = NULL;
+    size_t             count    = 0;        // of sessions
+    long               jobs     = sysconf(_SC_NPROCESSORS_ONLN);
+    int                listener;
+
+    set_progname(argv[0]);
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            { "socket",           1, 0, 's' },
+            { "jobs",             1, 0, 'j' },
+            { "batch-ms",         1, 0, 0   },
+            { "sync-interval-ms", 1, 0, 0   },
+            { "help",             0, 0, 'h' },
+            { 0,                  0, 0, 0   }
+        };
+        int option_index = 0;
+        int ch           = getopt_long(argc, argv, "hs:j:", long_options, &option_index);
+        if (ch == -1)
+        {
+            break;
+        }
+        switch (ch)
+        {
+        case 0:
+            {
+                long *value = strcmp(long_options[option_index].name, "batch-ms") == 0 ? &opt_batch_ms : &opt_sync_interval;
+                errno  = 0;
+                *value = strtol(optarg, NULL, 10);
+                if ((errno != 0) || (*value <= 0))
+                {
+                    fprintf(stderr, "--%s option requires a strictly positive number\n", long_options[option_index].name);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+
+        case 's':
+            opt_socket = optarg;
+            break;
+
+        case 'j':
+            errno = 0;
+            jobs  = strtol(optarg, NULL, 10);
+            if ((errno != 0) || (jobs <= 0))
+            {
+                fprintf(stderr, "-j option requires a strictly positive number\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+    if (optind < argc)
+    {
+        usage();
+    }
+    if (jobs <= 0)
+    {
+        jobs = 1;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_IGN;
+    (void)sigaction(SIGPIPE, &act, NULL);
+    // no SA_RESTART: poll() must return for us to stop
+    act.sa_handler = stop_handler;
+    (void)sigaction(SIGTERM, &act, NULL);
+    (void)sigaction(SIGINT, &act, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(opt_socket) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "ttyrecd: socket path too long: %s\n", opt_socket);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, opt_socket);
+    if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    (void)fcntl(listener, F_SETFD, FD_CLOEXEC);
+    (void)unlink(opt_socket);
+    if ((bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listener, 128) != 0))
+    {
+        perror(opt_socket);
+        exit(EXIT_FAILURE);
+    }
+    // anyone may connect: we only ever write to the files they opened themselves
+    (void)chmod(opt_socket, 0666);
+
+    {
+        // writer threads get no signal, all of them are for the main one
+        sigset_t  all, saved;
+        pthread_t tid;
+
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &saved);
+        for (long i = 0; i < jobs; i++)
+        {
+            if (pthread_create(&tid, NULL, writer_thread, NULL) != 0)
+            {
+                perror("pthread_create");
+                exit(EXIT_FAILURE);
+            }
+            pthread_detach(tid);
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+
+    while (!stopping)
+    {
+        size_t    n = 1;
+        long long now;
+        int       timeout = (int)opt_batch_ms;
+
+        if ((opt_sync_interval > 0) && (opt_sync_interval < timeout))
+        {
+            timeout = (int)opt_sync_interval;
+        }
+
+        if (pollSize < count + 1)
+        {
+            pollSize = (count + 1) * 2;
+            pfds     = realloc(pfds, pollSize * sizeof(*pfds));
+            polled   = realloc(polled, pollSize * sizeof(*polled));
+            if ((pfds == NULL) || (polled == NULL))
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        pfds[0].fd     = listener;
+        pfds[0].events = POLLIN;
+        pthread_mutex_lock(&lock);
+        for (Session *s = sessions; s != NULL; s = s->nextAll)
+        {
+            // leave those that are too far ahead of their writer thread waiting
+            if (s->queued < MAX_QUEUED)
+            {
+                pfds[n].fd     = s->sock;
+                pfds[n].events = POLLIN;
+                polled[n++]    = s;
+            }
+        }
+        pthread_mutex_unlock(&lock);
+
+        if (poll(pfds, n, timeout) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (pfds[0].revents & POLLIN)
+        {
+            int sock = accept(listener, NULL, NULL);
+            if (sock >= 0)
+            {
+                Session *s = calloc(1, sizeof(*s));
+                if (s == NULL)
+                {
+                    (void)close(sock);
+                }
+                else
+                {
+                    (void)fcntl(sock, F_SETFD, FD_CLOEXEC);
+                    s->sock    = sock;
+                    s->sidecar = -1;
+                    s->nextAll = sessions;
+                    sessions   = s;
+                    count++;
+                    pthread_mutex_lock(&lock);
+                    live++;
+                    pthread_mutex_unlock(&lock);
+                }
+            }
+        }
+
+        for (size_t i = 1; i < n; i++)
+        {
+            Session *s = polled[i];
+            if ((pfds[i].revents != 0) && (session_read(s) != 0))
+            {
+                // hand it to the writer threads one last time, they'll free it
+                Session **p = &sessions;
+                while (*p != s)
+                {
+                    p = &(*p)->nextAll;
+                }
+                *p = s->nextAll;
+                count--;
+                pthread_mutex_lock(&lock);
+                s->gone = 1;
+                if (s->state == SESSION_IDLE)
+                {
+                    session_run(s);
+                }
+                pthread_mutex_unlock(&lock);
+            }
+        }
+
+        // hand over the records that waited long enough, and sync the files that need it
+        now = now_ms();
+        pthread_mutex_lock(&lock);
+        for (Session *s = sessions; s != NULL; s = s->nextAll)
+        {
+            if ((s->pendingSince != 0) && (now - s->pendingSince >= opt_batch_ms))
+            {
+                session_run(s);
+                s->pendingSince = 0;
+            }
+            if ((opt_sync_interval > 0) && (s->dirtySince != 0) && (now - s->dirtySince >= opt_sync_interval) &&
+                (s->state == SESSION_IDLE))
+            {
+                session_queue(s, item_new('S'));
+                session_run(s);
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+    // finish all the files, as if all the clients had left
+    (void)close(listener);
+    (void)unlink(opt_socket);
+    pthread_mutex_lock(&lock);
+    for (Session *s = sessions; s != NULL; s = s->nextAll)
+    {
+        s->gone = 1;
+        session_run(s);
+    }
+    sessions = NULL;
+    while (live > 0)
+    {
+        pthread_cond_wait(&gone_cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    free(pfds);
+    free(polled);
+    return EXIT_SUCCESS;
+}
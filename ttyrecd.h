@@ -0,0 +1,64 @@
+#ifndef __TTYRECD_H__
+#define __TTYRECD_H__
+
+/*
+ * What ttyrec (with --daemon) and ttyrecd say to each other, over a unix socket.
+ *
+ * ttyrec opens its recordings itself, and hands their file descriptors to ttyrecd
+ * (SCM_RIGHTS), which then writes (and compresses) the records it's sent to them:
+ * ttyrecd never opens a file on behalf of a client, so it can't be made to write
+ * anywhere the client couldn't.
+ *
+ * Every message is a type byte, the length of its payload (32 bits, little-endian),
+ * then the payload. Both ends run on the same machine, from the same build, so the
+ * payload of an OPEN is a plain struct, and TTYRECD_VERSION is bumped when it changes.
+ */
+
+#include <stdint.h>
+
+#include "summary.h"
+
+#define TTYRECD_SOCKET             "/run/ttyrecd.sock"
+#define TTYRECD_VERSION            1
+#define TTYRECD_MSG_HEADER_SIZE    5
+
+// where it's missing (macOS), SIGPIPE is ignored or disabled on the socket instead
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL    0
+#endif
+
+// how long ttyrec waits on ttyrecd (to take a message, or to reply) before writing locally
+#define TTYRECD_TIMEOUT_SECONDS    10
+
+/*
+ * OPEN: from now on, write to the file passed along (and the sidecar passed after
+ * it, if any). If a file was already open, it's closed first, as for a CLOSE but
+ * without a reply. ttyrecd replies with a byte: 0 if it takes the file, an errno
+ * value otherwise (then ttyrec goes on by itself).
+ */
+#define TTYRECD_MSG_OPEN      'O'
+
+// RECORD: a ttyrec record, header included, to write to the current file
+#define TTYRECD_MSG_RECORD    'R'
+
+/*
+ * CLOSE: finish the current file (summary, sync, see the flags of its OPEN). ttyrecd
+ * replies with a byte once done: 0 on success, an errno value otherwise.
+ */
+#define TTYRECD_MSG_CLOSE     'C'
+
+// flags of an OPEN
+#define TTYRECD_OPEN_ZSTD       0x1 // compress the records with zstd
+#define TTYRECD_OPEN_FSYNC      0x2 // sync the file to disk before closing it
+#define TTYRECD_OPEN_TRAILER    0x4 // end a zstd file with a summary trailer, starting from .summary
+#define TTYRECD_OPEN_SIDECAR    0x8 // a second file is passed, to write the summary of an uncompressed one to
+
+typedef struct ttyrecd_open
+{
+    uint32_t version;
+    uint32_t flags;
+    int32_t  level;   // zstd compression level, 0 for the default
+    Summary  summary; // of what the file already holds, when appending to it
+} TtyrecdOpen;
+
+#endif
@@ -41,50 +41,439 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <getopt.h>
 
 #include "ttyrec.h"
 #include "io.h"
+#include "compress.h"
+#include "pool.h"
+#include "summary.h"
+
+// profile of a session, see calc_stats()
+typedef struct stats
+{
+    double   duration;     // between the first and last records
+    double   active;       // sum of the gaps between records shorter than idle_threshold
+    uint64_t records;
+    uint64_t bytes;        // of output
+    uint64_t peak_rate;    // most bytes output during a single second
+    double   longest_idle; // longest gap between two records
+} Stats;
 
 int calc_time(const char *filename);
+void calc_stats(const char *filename, Stats *st);
+char *time_job(size_t i, void *arg);
+char *stats_job(size_t i, void *arg);
+void usage(void);
+
+static double idle_threshold = 5;    // -i
+static int    opt_json       = 0;    // --json
+static Stats  *file_stats    = NULL; // -s, of each file
 
 int calc_time(const char *filename)
 {
-    Header start, end;
-    FILE   *fp = efopen(filename, "r");
+    Header  start, end;
+    Summary s;
+    Reader  *r;
+    FILE    *fp = efopen(filename, "r");
 
-    // empty or corrupt file: no first record, so no duration to compute
-    if ((read_header(fp, &start) == 0) || (start.len < 0))
+    // closed by a recent ttyrec, the file might come with its summary: no need to read it all
+    if (summary_read(filename, fp, &s))
+    {
+        fclose(fp);
+        return s.last.tv_sec - s.first.tv_sec;
+    }
+
+    // our own reader rather than the global wrappers, as we may be running in several threads
+    r = reader_new(fp, detect_compress_mode(filename, fp));
+    if (r == NULL)
     {
         fclose(fp);
         return 0;
     }
+
+    // empty or corrupt file: no first record, so no duration to compute
+    if ((reader_header(r, &start) == 0) || (start.len < 0))
+    {
+        reader_close(r);
+        return 0;
+    }
     end = start;
-    fseek(fp, start.len, SEEK_CUR);
-    while (1)
+    // payloads are skipped without being copied anywhere (just seeked over when uncompressed)
+    if (reader_skip(r, start.len) == 0)
     {
-        Header h;
-        // stop on EOF or on a negative length (which would seek backwards and loop forever)
-        if ((read_header(fp, &h) == 0) || (h.len < 0))
+        while (1)
         {
-            break;
+            Header h;
+            // stop on EOF or on a negative length (which would seek backwards and loop forever)
+            if ((reader_header(r, &h) == 0) || (h.len < 0))
+            {
+                break;
+            }
+            end = h;
+            if (reader_skip(r, h.len) != 0)
+            {
+                break;
+            }
         }
-        end = h;
-        fseek(fp, h.len, SEEK_CUR);
     }
-    fclose(fp);
+    reader_close(r);
     return end.tv.tv_sec - start.tv.tv_sec;
 }
 
 
+static double tv_diff(const struct timeval *a, const struct timeval *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_usec - b->tv_usec) / 1000000.0;
+}
+
+
+/*
+ * Profile the session recorded in filename, in a single pass over its headers
+ * (summaries don't hold enough to spare us that).
+ */
+void calc_stats(const char *filename, Stats *st)
+{
+    Header   h, prev = { { 0, 0 }, 0 };
+    Reader   *r;
+    FILE     *fp    = efopen(filename, "r");
+    time_t   second = 0; // second of the records counted in rate
+    uint64_t rate   = 0;
+
+    memset(st, 0, sizeof(*st));
+    r = reader_new(fp, detect_compress_mode(filename, fp));
+    if (r == NULL)
+    {
+        fclose(fp);
+        return;
+    }
+
+    while ((reader_header(r, &h) != 0) && (h.len >= 0))
+    {
+        if (st->records > 0)
+        {
+            // the clock may have gone backwards: that's no time spent
+            double gap = tv_diff(&h.tv, &prev.tv);
+            if (gap < 0)
+            {
+                gap = 0;
+            }
+            if (gap < idle_threshold)
+            {
+                st->active += gap;
+            }
+            if (gap > st->longest_idle)
+            {
+                st->longest_idle = gap;
+            }
+            st->duration += gap;
+        }
+        if ((st->records == 0) || (h.tv.tv_sec != second))
+        {
+            second = h.tv.tv_sec;
+            rate   = 0;
+        }
+        rate += h.len;
+        if (rate > st->peak_rate)
+        {
+            st->peak_rate = rate;
+        }
+        st->records++;
+        st->bytes += h.len;
+        prev       = h;
+
+        if (reader_skip(r, h.len) != 0)
+        {
+            break;
+        }
+    }
+    reader_close(r);
+}
+
+
+// length of the valid UTF-8 sequence s starts with (shortest form, no surrogates), 0 if none
+static size_t utf8_length(const unsigned char *s)
+{
+    size_t   len;
+    uint32_t cp;
+
+    if (s[0] < 0x80)
+    {
+        return 1;
+    }
+    else if ((s[0] & 0xe0) == 0xc0)
+    {
+        len = 2;
+        cp  = s[0] & 0x1f;
+    }
+    else if ((s[0] & 0xf0) == 0xe0)
+    {
+        len = 3;
+        cp  = s[0] & 0x0f;
+    }
+    else if ((s[0] & 0xf8) == 0xf0)
+    {
+        len = 4;
+        cp  = s[0] & 0x07;
+    }
+    else
+    {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++)
+    {
+        // also stops at the terminating '\0'
+        if ((s[i] & 0xc0) != 0x80)
+        {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    if (((len == 2) && (cp < 0x80)) || ((len == 3) && (cp < 0x800)) || ((len == 4) && (cp < 0x10000)) ||
+        (cp > 0x10ffff) || ((cp >= 0xd800) && (cp <= 0xdfff)))
+    {
+        return 0;
+    }
+    return len;
+}
+
+
+// file names are just bytes: those that aren't valid UTF-8 become U+FFFD, for the output to be valid JSON
+static void json_string(FILE *out, const char *s)
+{
+    const unsigned char *p = (const unsigned char *)s;
+
+    fputc('"', out);
+    while (*p != '\0')
+    {
+        size_t len = utf8_length(p);
+        if ((*p == '"') || (*p == '\\'))
+        {
+            fprintf(out, "\\%c", *p);
+        }
+        else if (*p < 0x20)
+        {
+            fprintf(out, "\\u%04x", *p);
+        }
+        else if (len == 0)
+        {
+            fputs("\\ufffd", out);
+            len = 1;
+        }
+        else
+        {
+            fwrite(p, 1, len, out);
+        }
+        p += len;
+    }
+    fputc('"', out);
+}
+
+
+static void print_stats(FILE *out, const Stats *st, const char *name)
+{
+    if (opt_json)
+    {
+        fprintf(out, "{ \"duration\": %.3f, \"active\": %.3f, \"records\": %llu, \"bytes\": %llu, "
+                "\"peak_bytes_per_second\": %llu, \"longest_idle\": %.3f",
+                st->duration, st->active, (unsigned long long)st->records, (unsigned long long)st->bytes,
+                (unsigned long long)st->peak_rate, st->longest_idle);
+        if (name != NULL)
+        {
+            fprintf(out, ", \"file\": ");
+            json_string(out, name);
+        }
+        fprintf(out, " }");
+    }
+    else
+    {
+        fprintf(out, "%10.3f\t%10.3f\t%9llu\t%12llu\t%9llu\t%10.3f\t%s\n", st->duration, st->active,
+                (unsigned long long)st->records, (unsigned long long)st->bytes, (unsigned long long)st->peak_rate,
+                st->longest_idle, name == NULL ? "total" : name);
+    }
+}
+
+
+char *stats_job(size_t i, void *arg)
+{
+    const char *filename = ((FileList *)arg)->names[i];
+    char       *line     = NULL;
+    size_t     len       = 0;
+    FILE       *mem      = open_memstream(&line, &len);
+
+    if (mem == NULL)
+    {
+        perror("open_memstream");
+        exit(EXIT_FAILURE);
+    }
+    calc_stats(filename, &file_stats[i]);
+    if (opt_json)
+    {
+        fprintf(mem, "%s\n    ", i > 0 ? "," : "");
+    }
+    print_stats(mem, &file_stats[i], filename);
+    fclose(mem);
+    return line;
+}
+
+
+char *time_job(size_t i, void *arg)
+{
+    const char *filename = ((FileList *)arg)->names[i];
+    int        seconds   = calc_time(filename);
+    size_t     len       = strlen(filename) + 32;
+    char       *line     = malloc(len);
+
+    if (line == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(line, len, "%7d\t%s\n", seconds, filename);
+    return line;
+}
+
+
+void usage(void)
+{
+    printf("Usage: ttytime [OPTION] FILE...\n");
+    printf("  -s, --stats            Print a profile of each session, and their totals\n");
+    printf("  -i, --idle-threshold S With -s, gaps of S seconds or more don't count as active time [5]\n");
+    printf("      --json             Print the profiles as JSON (implies -s)\n");
+    printf("  -j, --jobs N           Process N files at a time [1]\n");
+    printf("  -r, --recursive        Process all the files found in the directories given, recursively\n");
+    exit(EXIT_FAILURE);
+}
+
+
 int main(int argc, char **argv)
 {
-    int i;
+    FileList files     = { NULL, 0, 0 };
+    int      jobs      = 1;
+    int      recursive = 0;
+    int      stats     = 0;
 
     set_progname(argv[0]);
-    for (i = 1; i < argc; i++)
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            { "stats",          0, 0, 's' },
+            { "idle-threshold", 1, 0, 'i' },
+            { "json",           0, 0, 'J' },
+            { "jobs",           1, 0, 'j' },
+            { "recursive",      0, 0, 'r' },
+            { "help",           0, 0, 'h' },
+            { 0,                0, 0, 0   }
+        };
+        int option_index = 0;
+        int ch           = getopt_long(argc, argv, "hsi:j:r", long_options, &option_index);
+        if (ch == -1)
+        {
+            break;
+        }
+        switch (ch)
+        {
+        case 'j':
+            if ((optarg == NULL) || (sscanf(optarg, "%d", &jobs) != 1) || (jobs <= 0))
+            {
+                fprintf(stderr, "-j option requires a strictly positive number\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'r':
+            recursive = 1;
+            break;
+
+        case 's':
+            stats = 1;
+            break;
+
+        case 'i':
+            if ((optarg == NULL) || (sscanf(optarg, "%lf", &idle_threshold) != 1) || (idle_threshold <= 0))
+            {
+                fprintf(stderr, "-i option requires a strictly positive number of seconds\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'J':
+            opt_json = 1;
+            stats    = 1;
+            break;
+
+        case 'h':
+        default:
+            usage();
+        }
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        if (filelist_add(&files, argv[i], recursive) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (stats)
+    {
+        Stats total;
+
+        file_stats = calloc(files.count + 1, sizeof(Stats));
+        if (file_stats == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        if (opt_json)
+        {
+            printf("{\n  \"files\": [\n    ");
+        }
+        else
+        {
+            printf("  duration\t    active\t  records\t       bytes\t peak B/s\t  max idle\tfile\n");
+        }
+        if (pool_run(files.count, jobs, stats_job, &files, stdout) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        // files of a same archive are usually separate sessions: their durations add up, their peaks don't
+        memset(&total, 0, sizeof(total));
+        for (size_t i = 0; i < files.count; i++)
+        {
+            total.duration += file_stats[i].duration;
+            total.active   += file_stats[i].active;
+            total.records  += file_stats[i].records;
+            total.bytes    += file_stats[i].bytes;
+            if (file_stats[i].peak_rate > total.peak_rate)
+            {
+                total.peak_rate = file_stats[i].peak_rate;
+            }
+            if (file_stats[i].longest_idle > total.longest_idle)
+            {
+                total.longest_idle = file_stats[i].longest_idle;
+            }
+        }
+        if (opt_json)
+        {
+            printf("\n  ],\n  \"total\": ");
+            print_stats(stdout, &total, NULL);
+            printf("\n}\n");
+        }
+        else
+        {
+            print_stats(stdout, &total, NULL);
+        }
+        free(file_stats);
+    }
+    // results are printed in the order of the files, whatever the number of jobs
+    else if (pool_run(files.count, jobs, time_job, &files, stdout) != 0)
     {
-        char *filename = argv[i];
-        printf("%7d	%s\n", calc_time(filename), filename);
+        exit(EXIT_FAILURE);
     }
+    filelist_free(&files);
     return 0;
 }
@@ -0,0 +1,1134 @@
+// vim: noai:ts=4:sw=4:expandtab:
+
+/* Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ * Copyright 2019 The ovh-ttyrec Authors. All rights reserved.
+ */
+
+/*
+ * A small headless VT100/xterm screen model, enough to turn a recording
+ * back into the text a viewer would have seen: cursor motion, erasing,
+ * scrolling regions, line insertion/deletion, the alternate screen and
+ * UTF-8. Colors and other attributes are parsed but dropped.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vt.h"
+
+#define VT_MAX_PARAMS    16
+#define VT_MAX_PARAM     65535
+#define VT_TAB_WIDTH     8
+
+enum
+{
+    VT_GROUND = 0,
+    VT_ESCAPE,
+    VT_ESCAPE_INTERMEDIATE,
+    VT_CSI,
+    VT_STRING,        // OSC, DCS, SOS, PM, APC: swallowed up to BEL or ST
+    VT_STRING_ESCAPE,
+};
+
+typedef struct screen
+{
+    uint32_t      *cells;   // rows * cols code points, blanks are spaces
+    unsigned char *wrapped; // 1 if the row was continued on the next one by autowrap
+} Screen;
+
+struct terminal
+{
+    int      cols;
+    int      rows;
+    Screen   main;
+    Screen   alt;
+    Screen   *screen;       // the one being displayed, main or alt
+    int      x;
+    int      y;
+    int      wrap_pending;  // cursor sits past the last column, wrap on the next character
+    int      autowrap;
+    int      origin;
+    int      top;           // scrolling region, inclusive
+    int      bottom;
+    int      saved_x;
+    int      saved_y;
+
+    int      state;
+    int      params[VT_MAX_PARAMS];
+    int      nparams;
+    char     private;       // '?', '>', ... leading the parameters of a CSI sequence
+    char     intermediate;
+    uint32_t codepoint;     // UTF-8 sequence being decoded
+    int      utf8_left;
+    uint32_t last;          // last printed character, for REP
+
+    FILE     *transcript;   // where lines scrolled off the main screen go, if not NULL
+    char     *line;         // UTF-8 encoding buffer for one row
+};
+
+
+static uint32_t *row(Terminal *t, int y)
+{
+    return t->screen->cells + (size_t)y * t->cols;
+}
+
+
+static void blank(uint32_t *cells, size_t n)
+{
+    while (n--)
+    {
+        *cells++ = ' ';
+    }
+}
+
+
+static int screen_init(Screen *s, int cols, int rows)
+{
+    s->cells   = malloc(sizeof(uint32_t) * cols * rows);
+    s->wrapped = calloc(rows, 1);
+    if ((s->cells == NULL) || (s->wrapped == NULL))
+    {
+        return 0;
+    }
+    blank(s->cells, (size_t)cols * rows);
+    return 1;
+}
+
+
+static void screen_clear(Terminal *t, Screen *s)
+{
+    blank(s->cells, (size_t)t->cols * t->rows);
+    memset(s->wrapped, 0, t->rows);
+}
+
+
+/*
+ * Encode a row as UTF-8 into t->line, trailing blanks stripped if asked to.
+ * Returns the encoded length.
+ */
+static size_t encode_row(Terminal *t, const uint32_t *cells, int trim)
+{
+    int    n   = t->cols;
+    size_t len = 0;
+
+    while (trim && n > 0 && cells[n - 1] == ' ')
+    {
+        n--;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t cp = cells[i];
+        if (cp < 0x80)
+        {
+            t->line[len++] = cp;
+        }
+        else if (cp < 0x800)
+        {
+            t->line[len++] = 0xc0 | (cp >> 6);
+            t->line[len++] = 0x80 | (cp & 0x3f);
+        }
+        else if (cp < 0x10000)
+        {
+            t->line[len++] = 0xe0 | (cp >> 12);
+            t->line[len++] = 0x80 | ((cp >> 6) & 0x3f);
+            t->line[len++] = 0x80 | (cp & 0x3f);
+        }
+        else
+        {
+            t->line[len++] = 0xf0 | (cp >> 18);
+            t->line[len++] = 0x80 | ((cp >> 12) & 0x3f);
+            t->line[len++] = 0x80 | ((cp >> 6) & 0x3f);
+            t->line[len++] = 0x80 | (cp & 0x3f);
+        }
+    }
+    return len;
+}
+
+
+/*
+ * Append rows [first, first + n) of screen s to the transcript. Rows that were
+ * wrapped by the terminal are joined back to the next one, unless 'last' is set
+ * and it's the final row: the next one is going away without being output.
+ */
+static void transcript_rows(Terminal *t, Screen *s, int first, int n, int last)
+{
+    for (int y = first; y < first + n; y++)
+    {
+        int    joined = s->wrapped[y] && !(last && y == first + n - 1);
+        size_t len    = encode_row(t, s->cells + (size_t)y * t->cols, !joined);
+
+        if (!joined)
+        {
+            t->line[len++] = '\n';
+        }
+        fwrite(t->line, 1, len, t->transcript);
+    }
+}
+
+
+static int last_used_row(Terminal *t, Screen *s)
+{
+    for (int y = t->rows - 1; y >= 0; y--)
+    {
+        const uint32_t *cells = s->cells + (size_t)y * t->cols;
+        for (int x = 0; x < t->cols; x++)
+        {
+            if (cells[x] != ' ')
+            {
+                return y;
+            }
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Push whatever is on the main screen to the transcript, before it gets wiped.
+ */
+static void transcript_screen(Terminal *t)
+{
+    if ((t->transcript != NULL) && (t->screen == &t->main))
+    {
+        transcript_rows(t, &t->main, 0, last_used_row(t, &t->main) + 1, 1);
+    }
+}
+
+
+/*
+ * Scroll rows [top, bottom] up by n. If save is set and the rows leave the
+ * top of the main screen, they go to the transcript, as they would go to the
+ * scrollback buffer of a real terminal.
+ */
+static void scroll_up(Terminal *t, int top, int bottom, int n, int save)
+{
+    int height = bottom - top + 1;
+
+    if (n > height)
+    {
+        n = height;
+    }
+    if (n <= 0)
+    {
+        return;
+    }
+    if (save && (top == 0) && (t->transcript != NULL) && (t->screen == &t->main))
+    {
+        transcript_rows(t, t->screen, 0, n, 0);
+    }
+    memmove(row(t, top), row(t, top + n), sizeof(uint32_t) * t->cols * (height - n));
+    memmove(t->screen->wrapped + top, t->screen->wrapped + top + n, height - n);
+    blank(row(t, bottom - n + 1), (size_t)t->cols * n);
+    memset(t->screen->wrapped + bottom - n + 1, 0, n);
+}
+
+
+static void scroll_down(Terminal *t, int top, int bottom, int n)
+{
+    int height = bottom - top + 1;
+
+    if (n > height)
+    {
+        n = height;
+    }
+    if (n <= 0)
+    {
+        return;
+    }
+    memmove(row(t, top + n), row(t, top), sizeof(uint32_t) * t->cols * (height - n));
+    memmove(t->screen->wrapped + top + n, t->screen->wrapped + top, height - n);
+    blank(row(t, top), (size_t)t->cols * n);
+    memset(t->screen->wrapped + top, 0, n);
+}
+
+
+static void move_to(Terminal *t, int x, int y)
+{
+    int min_y = t->origin ? t->top : 0;
+    int max_y = t->origin ? t->bottom : t->rows - 1;
+
+    t->x            = x < 0 ? 0 : (x >= t->cols ? t->cols - 1 : x);
+    t->y            = y < min_y ? min_y : (y > max_y ? max_y : y);
+    t->wrap_pending = 0;
+}
+
+
+static void linefeed(Terminal *t)
+{
+    t->wrap_pending = 0;
+    if (t->y == t->bottom)
+    {
+        scroll_up(t, t->top, t->bottom, 1, 1);
+    }
+    else if (t->y < t->rows - 1)
+    {
+        t->y++;
+    }
+}
+
+
+static void reverse_index(Terminal *t)
+{
+    t->wrap_pending = 0;
+    if (t->y == t->top)
+    {
+        scroll_down(t, t->top, t->bottom, 1);
+    }
+    else if (t->y > 0)
+    {
+        t->y--;
+    }
+}
+
+
+static void wrap(Terminal *t)
+{
+    t->screen->wrapped[t->y] = 1;
+    t->x                     = 0;
+    linefeed(t);
+}
+
+
+static void put_char(Terminal *t, uint32_t cp)
+{
+    if (t->wrap_pending)
+    {
+        wrap(t);
+    }
+    row(t, t->y)[t->x] = cp;
+    t->last            = cp;
+    if (t->x == t->cols - 1)
+    {
+        t->wrap_pending = t->autowrap;
+    }
+    else
+    {
+        t->x++;
+    }
+}
+
+
+/*
+ * Fast path for a run of printable ASCII characters, see vt_printable_run().
+ */
+static void put_ascii(Terminal *t, const unsigned char *p, size_t n)
+{
+    t->last = p[n - 1];
+    while (n > 0)
+    {
+        if (t->wrap_pending)
+        {
+            wrap(t);
+        }
+
+        uint32_t *cells = row(t, t->y) + t->x;
+        size_t   k      = (size_t)(t->cols - t->x);
+        if (k > n)
+        {
+            k = n;
+        }
+        for (size_t i = 0; i < k; i++)
+        {
+            cells[i] = p[i];
+        }
+        p    += k;
+        n    -= k;
+        t->x += k;
+
+        if (t->x == t->cols)
+        {
+            t->x = t->cols - 1;
+            if (t->autowrap)
+            {
+                t->wrap_pending = 1;
+            }
+            else if (n > 0)
+            {
+                // without autowrap, the last column gets overwritten over and over
+                cells[k - 1] = p[n - 1];
+                n            = 0;
+            }
+        }
+    }
+}
+
+
+static void erase_display(Terminal *t, int mode)
+{
+    uint32_t *cur = row(t, t->y);
+
+    switch (mode)
+    {
+    case 0:
+        blank(cur + t->x, t->cols - t->x);
+        if (t->y < t->rows - 1)
+        {
+            blank(row(t, t->y + 1), (size_t)t->cols * (t->rows - t->y - 1));
+            memset(t->screen->wrapped + t->y, 0, t->rows - t->y);
+        }
+        break;
+
+    case 1:
+        blank(row(t, 0), (size_t)t->cols * t->y + t->x + 1);
+        memset(t->screen->wrapped, 0, t->y);
+        break;
+
+    case 2:
+    case 3:
+        transcript_screen(t);
+        screen_clear(t, t->screen);
+        break;
+    }
+    t->wrap_pending = 0;
+}
+
+
+static void erase_line(Terminal *t, int mode)
+{
+    uint32_t *cur = row(t, t->y);
+
+    switch (mode)
+    {
+    case 0:
+        blank(cur + t->x, t->cols - t->x);
+        t->screen->wrapped[t->y] = 0;
+        break;
+
+    case 1:
+        blank(cur, t->x + 1);
+        break;
+
+    case 2:
+        blank(cur, t->cols);
+        t->screen->wrapped[t->y] = 0;
+        break;
+    }
+    t->wrap_pending = 0;
+}
+
+
+static void insert_chars(Terminal *t, int n)
+{
+    uint32_t *cur = row(t, t->y);
+
+    if (n > t->cols - t->x)
+    {
+        n = t->cols - t->x;
+    }
+    memmove(cur + t->x + n, cur + t->x, sizeof(uint32_t) * (t->cols - t->x - n));
+    blank(cur + t->x, n);
+    t->wrap_pending = 0;
+}
+
+
+static void delete_chars(Terminal *t, int n)
+{
+    uint32_t *cur = row(t, t->y);
+
+    if (n > t->cols - t->x)
+    {
+        n = t->cols - t->x;
+    }
+    memmove(cur + t->x, cur + t->x + n, sizeof(uint32_t) * (t->cols - t->x - n));
+    blank(cur + t->cols - n, n);
+    t->wrap_pending = 0;
+}
+
+
+static void erase_chars(Terminal *t, int n)
+{
+    if (n > t->cols - t->x)
+    {
+        n = t->cols - t->x;
+    }
+    blank(row(t, t->y) + t->x, n);
+    t->wrap_pending = 0;
+}
+
+
+static void save_cursor(Terminal *t)
+{
+    t->saved_x = t->x;
+    t->saved_y = t->y;
+}
+
+
+static void restore_cursor(Terminal *t)
+{
+    t->x            = t->saved_x;
+    t->y            = t->saved_y;
+    t->wrap_pending = 0;
+}
+
+
+static void use_alt_screen(Terminal *t, int alt)
+{
+    if (alt && (t->screen != &t->alt))
+    {
+        t->screen = &t->alt;
+        screen_clear(t, &t->alt);
+    }
+    else if (!alt)
+    {
+        t->screen = &t->main;
+    }
+}
+
+
+static void reset(Terminal *t)
+{
+    if (t->screen == &t->main)
+    {
+        transcript_screen(t);
+    }
+    t->screen = &t->main;
+    screen_clear(t, &t->main);
+    screen_clear(t, &t->alt);
+    t->x            = 0;
+    t->y            = 0;
+    t->saved_x      = 0;
+    t->saved_y      = 0;
+    t->wrap_pending = 0;
+    t->autowrap     = 1;
+    t->origin       = 0;
+    t->top          = 0;
+    t->bottom       = t->rows - 1;
+}
+
+
+/* i-th CSI parameter, or def if it's missing or zero */
+static int param(Terminal *t, int i, int def)
+{
+    if ((i >= t->nparams) || (t->params[i] == 0))
+    {
+        return def;
+    }
+    return t->params[i];
+}
+
+
+static void set_private_modes(Terminal *t, int set)
+{
+    for (int i = 0; i < t->nparams; i++)
+    {
+        switch (t->params[i])
+        {
+        case 6:
+            t->origin = set;
+            move_to(t, 0, set ? t->top : 0);
+            break;
+
+        case 7:
+            t->autowrap = set;
+            if (!set)
+            {
+                t->wrap_pending = 0;
+            }
+            break;
+
+        case 47:
+        case 1047:
+            use_alt_screen(t, set);
+            break;
+
+        case 1048:
+            if (set)
+            {
+                save_cursor(t);
+            }
+            else
+            {
+                restore_cursor(t);
+            }
+            break;
+
+        case 1049:
+            if (set)
+            {
+                save_cursor(t);
+                use_alt_screen(t, 1);
+            }
+            else
+            {
+                use_alt_screen(t, 0);
+                restore_cursor(t);
+            }
+            break;
+        }
+    }
+}
+
+
+static void csi_dispatch(Terminal *t, unsigned char c)
+{
+    int n = param(t, 0, 1);
+
+    if (t->private == '?')
+    {
+        if ((c == 'h') || (c == 'l'))
+        {
+            set_private_modes(t, c == 'h');
+        }
+        return;
+    }
+    if ((t->private != 0) || (t->intermediate != 0))
+    {
+        // xterm extensions (CSI > ... c, CSI ! p, ...), nothing that touches the screen
+        return;
+    }
+
+    switch (c)
+    {
+    case '@':
+        insert_chars(t, n);
+        break;
+
+    case 'A':
+        move_to(t, t->x, t->y - n < t->top && t->y >= t->top ? t->top : t->y - n);
+        break;
+
+    case 'B':
+        move_to(t, t->x, t->y + n > t->bottom && t->y <= t->bottom ? t->bottom : t->y + n);
+        break;
+
+    case 'C':
+    case 'a':
+        move_to(t, t->x + n, t->y);
+        break;
+
+    case 'D':
+        move_to(t, t->x - n, t->y);
+        break;
+
+    case 'E':
+        move_to(t, 0, t->y + n > t->bottom && t->y <= t->bottom ? t->bottom : t->y + n);
+        break;
+
+    case 'F':
+        move_to(t, 0, t->y - n < t->top && t->y >= t->top ? t->top : t->y - n);
+        break;
+
+    case 'G':
+    case '`':
+        move_to(t, n - 1, t->y);
+        break;
+
+    case 'H':
+    case 'f':
+        move_to(t, param(t, 1, 1) - 1, (t->origin ? t->top : 0) + n - 1);
+        break;
+
+    case 'I':
+        while (n-- > 0 && t->x < t->cols - 1)
+        {
+            move_to(t, (t->x / VT_TAB_WIDTH + 1) * VT_TAB_WIDTH, t->y);
+        }
+        break;
+
+    case 'Z':
+        while (n-- > 0 && t->x > 0)
+        {
+            move_to(t, (t->x - 1) / VT_TAB_WIDTH * VT_TAB_WIDTH, t->y);
+        }
+        break;
+
+    case 'J':
+        erase_display(t, param(t, 0, 0));
+        break;
+
+    case 'K':
+        erase_line(t, param(t, 0, 0));
+        break;
+
+    case 'L':
+        if ((t->y >= t->top) && (t->y <= t->bottom))
+        {
+            scroll_down(t, t->y, t->bottom, n);
+            move_to(t, 0, t->y);
+        }
+        break;
+
+    case 'M':
+        if ((t->y >= t->top) && (t->y <= t->bottom))
+        {
+            scroll_up(t, t->y, t->bottom, n, 0);
+            move_to(t, 0, t->y);
+        }
+        break;
+
+    case 'P':
+        delete_chars(t, n);
+        break;
+
+    case 'S':
+        scroll_up(t, t->top, t->bottom, n, 1);
+        break;
+
+    case 'T':
+        // with more parameters, this is a mouse tracking request
+        if (t->nparams <= 1)
+        {
+            scroll_down(t, t->top, t->bottom, n);
+        }
+        break;
+
+    case 'X':
+        erase_chars(t, n);
+        break;
+
+    case 'b':
+        if (t->last != 0)
+        {
+            if (n > t->cols * t->rows)
+            {
+                n = t->cols * t->rows;
+            }
+            while (n-- > 0)
+            {
+                put_char(t, t->last);
+            }
+        }
+        break;
+
+    case 'd':
+        move_to(t, t->x, (t->origin ? t->top : 0) + n - 1);
+        break;
+
+    case 'e':
+        move_to(t, t->x, t->y + n);
+        break;
+
+    case 'r':
+    {
+        int top    = param(t, 0, 1) - 1;
+        int bottom = param(t, 1, t->rows) - 1;
+        if (bottom >= t->rows)
+        {
+            bottom = t->rows - 1;
+        }
+        if (top < bottom)
+        {
+            t->top    = top;
+            t->bottom = bottom;
+            move_to(t, 0, t->origin ? t->top : 0);
+        }
+        break;
+    }
+
+    case 's':
+        save_cursor(t);
+        break;
+
+    case 'u':
+        restore_cursor(t);
+        break;
+    }
+}
+
+
+static void execute(Terminal *t, unsigned char c)
+{
+    switch (c)
+    {
+    case '\b':
+        if (t->x > 0)
+        {
+            t->x--;
+        }
+        t->wrap_pending = 0;
+        break;
+
+    case '\t':
+        move_to(t, (t->x / VT_TAB_WIDTH + 1) * VT_TAB_WIDTH, t->y);
+        break;
+
+    case '\n':
+    case '\v':
+    case '\f':
+        linefeed(t);
+        break;
+
+    case '\r':
+        t->x            = 0;
+        t->wrap_pending = 0;
+        break;
+
+    case 0x18: // CAN
+    case 0x1a: // SUB
+        t->state = VT_GROUND;
+        break;
+
+    case 0x1b: // ESC
+        t->state        = VT_ESCAPE;
+        t->intermediate = 0;
+        break;
+    }
+}
+
+
+static void escape_dispatch(Terminal *t, unsigned char c)
+{
+    t->state = VT_GROUND;
+    switch (c)
+    {
+    case '[':
+        t->state        = VT_CSI;
+        t->nparams      = 0;
+        t->private      = 0;
+        t->intermediate = 0;
+        memset(t->params, 0, sizeof(t->params));
+        break;
+
+    case ']':
+    case 'P':
+    case 'X':
+    case '^':
+    case '_':
+        t->state = VT_STRING;
+        break;
+
+    case '7':
+        save_cursor(t);
+        break;
+
+    case '8':
+        restore_cursor(t);
+        break;
+
+    case 'D':
+        linefeed(t);
+        break;
+
+    case 'E':
+        t->x = 0;
+        linefeed(t);
+        break;
+
+    case 'M':
+        reverse_index(t);
+        break;
+
+    case 'c':
+        reset(t);
+        break;
+
+    default:
+        if ((c >= 0x20) && (c <= 0x2f))
+        {
+            t->state        = VT_ESCAPE_INTERMEDIATE;
+            t->intermediate = c;
+        }
+        break;
+    }
+}
+
+
+static void utf8_byte(Terminal *t, unsigned char c)
+{
+    if ((c & 0xc0) == 0x80)
+    {
+        if (t->utf8_left == 0)
+        {
+            put_char(t, 0xfffd);
+            return;
+        }
+        t->codepoint = (t->codepoint << 6) | (c & 0x3f);
+        if (--t->utf8_left == 0)
+        {
+            put_char(t, t->codepoint);
+        }
+        return;
+    }
+
+    if (t->utf8_left > 0)
+    {
+        // sequence cut short
+        t->utf8_left = 0;
+        put_char(t, 0xfffd);
+    }
+    if ((c >= 0xc2) && (c <= 0xdf))
+    {
+        t->codepoint = c & 0x1f;
+        t->utf8_left = 1;
+    }
+    else if ((c >= 0xe0) && (c <= 0xef))
+    {
+        t->codepoint = c & 0x0f;
+        t->utf8_left = 2;
+    }
+    else if ((c >= 0xf0) && (c <= 0xf4))
+    {
+        t->codepoint = c & 0x07;
+        t->utf8_left = 3;
+    }
+    else
+    {
+        put_char(t, 0xfffd);
+    }
+}
+
+
+static void vt_byte(Terminal *t, unsigned char c)
+{
+    if ((t->utf8_left > 0) && ((c & 0xc0) != 0x80))
+    {
+        t->utf8_left = 0;
+        put_char(t, 0xfffd);
+    }
+
+    switch (t->state)
+    {
+    case VT_GROUND:
+        if (c >= 0x80)
+        {
+            utf8_byte(t, c);
+        }
+        else if (c < 0x20)
+        {
+            execute(t, c);
+        }
+        else if (c != 0x7f)
+        {
+            put_char(t, c);
+        }
+        break;
+
+    case VT_ESCAPE:
+        if (c < 0x20)
+        {
+            execute(t, c);
+        }
+        else
+        {
+            escape_dispatch(t, c);
+        }
+        break;
+
+    case VT_ESCAPE_INTERMEDIATE:
+        if (c < 0x20)
+        {
+            execute(t, c);
+        }
+        else if (c >= 0x30 && c < 0x7f)
+        {
+            if ((t->intermediate == '#') && (c == '8'))
+            {
+                // DECALN, fill the screen with E's
+                for (int y = 0; y < t->rows; y++)
+                {
+                    uint32_t *cells = row(t, y);
+                    for (int x = 0; x < t->cols; x++)
+                    {
+                        cells[x] = 'E';
+                    }
+                }
+            }
+            // otherwise, charset designation and the like
+            t->state = VT_GROUND;
+        }
+        break;
+
+    case VT_CSI:
+        if ((c >= '0') && (c <= '9'))
+        {
+            if (t->nparams == 0)
+            {
+                t->nparams = 1;
+            }
+            int *p = &t->params[t->nparams - 1];
+            *p = *p * 10 + (c - '0');
+            if (*p > VT_MAX_PARAM)
+            {
+                *p = VT_MAX_PARAM;
+            }
+        }
+        else if ((c == ';') || (c == ':'))
+        {
+            if (t->nparams == 0)
+            {
+                t->nparams = 1;
+            }
+            if (t->nparams < VT_MAX_PARAMS)
+            {
+                t->params[t->nparams++] = 0;
+            }
+        }
+        else if ((c >= 0x3c) && (c <= 0x3f))
+        {
+            t->private = c;
+        }
+        else if ((c >= 0x20) && (c <= 0x2f))
+        {
+            t->intermediate = c;
+        }
+        else if ((c >= 0x40) && (c <= 0x7e))
+        {
+            t->state = VT_GROUND;
+            csi_dispatch(t, c);
+        }
+        else if (c < 0x20)
+        {
+            execute(t, c);
+        }
+        break;
+
+    case VT_STRING:
+        if ((c == 0x07) || (c == 0x18) || (c == 0x1a))
+        {
+            t->state = VT_GROUND;
+        }
+        else if (c == 0x1b)
+        {
+            t->state = VT_STRING_ESCAPE;
+        }
+        break;
+
+    case VT_STRING_ESCAPE:
+        if (c == '\\')
+        {
+            t->state = VT_GROUND;
+        }
+        else
+        {
+            // not a string terminator, but the start of a new sequence
+            t->state = VT_ESCAPE;
+            vt_byte(t, c);
+        }
+        break;
+    }
+}
+
+
+/*
+ * Length of the leading run of printable ASCII (0x20-0x7e) in buf.
+ *
+ * That's where the bulk of terminal output lives, so we check it a 64-bit word
+ * at a time: a word only holds printable characters if none of its bytes is
+ * below 0x20 (the subtraction borrows into its high bit) nor above 0x7e
+ * (adding 1 sets its high bit, or it was already set).
+ */
+size_t vt_printable_run(const char *buf, size_t len)
+{
+    const uint64_t ones  = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    size_t         i     = 0;
+
+    for ( ; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t w;
+        memcpy(&w, buf + i, sizeof(w));
+        if ((((w - ones * 0x20) & ~w) | (w + ones) | w) & highs)
+        {
+            break;
+        }
+    }
+    while (i < len && (unsigned char)buf[i] >= 0x20 && (unsigned char)buf[i] < 0x7f)
+    {
+        i++;
+    }
+    return i;
+}
+
+
+void vt_feed(Terminal *t, const char *buf, size_t len)
+{
+    const unsigned char *p   = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+
+    while (p < end)
+    {
+        if ((t->state == VT_GROUND) && (t->utf8_left == 0))
+        {
+            size_t run = vt_printable_run((const char *)p, end - p);
+            if (run > 0)
+            {
+                put_ascii(t, p, run);
+                p += run;
+                continue;
+            }
+        }
+        vt_byte(t, *p++);
+    }
+}
+
+
+/*
+ * Write the current screen to out, one line per row, trailing blanks stripped.
+ */
+void vt_dump(Terminal *t, FILE *out)
+{
+    for (int y = 0; y < t->rows; y++)
+    {
+        size_t len = encode_row(t, row(t, y), 1);
+        t->line[len++] = '\n';
+        fwrite(t->line, 1, len, out);
+    }
+}
+
+
+/*
+ * Lines scrolled off the top of the main screen (or wiped by a clear screen) are
+ * written to out as they go, so that the transcript holds everything that was
+ * displayed, with all the cursor movements and overwrites already resolved.
+ */
+void vt_set_transcript(Terminal *t, FILE *out)
+{
+    t->transcript = out;
+}
+
+
+/*
+ * Flush the lines still on the main screen to the transcript, at the end of the session.
+ */
+void vt_end_transcript(Terminal *t)
+{
+    if (t->transcript != NULL)
+    {
+        transcript_rows(t, &t->main, 0, last_used_row(t, &t->main) + 1, 1);
+    }
+}
+
+
+Terminal *vt_new(int cols, int rows)
+{
+    Terminal *t;
+
+    if ((cols <= 0) || (rows <= 0))
+    {
+        return NULL;
+    }
+    t = calloc(1, sizeof(*t));
+    if (t == NULL)
+    {
+        return NULL;
+    }
+    t->cols = cols;
+    t->rows = rows;
+    t->line = malloc((size_t)cols * 4 + 1);
+    if ((t->line == NULL) || !screen_init(&t->main, cols, rows) || !screen_init(&t->alt, cols, rows))
+    {
+        vt_free(t);
+        return NULL;
+    }
+    t->screen = &t->main;
+    reset(t);
+    return t;
+}
+
+
+void vt_free(Terminal *t)
+{
+    if (t == NULL)
+    {
+        return;
+    }
+    free(t->main.cells);
+    free(t->main.wrapped);
+    free(t->alt.cells);
+    free(t->alt.wrapped);
+    free(t->line);
+    free(t);
+}
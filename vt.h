@@ -0,0 +1,17 @@
+#ifndef __TTYREC_VT_H__
+#define __TTYREC_VT_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct terminal Terminal;
+
+Terminal *vt_new(int cols, int rows);
+void vt_free(Terminal *t);
+void vt_set_transcript(Terminal *t, FILE *out);
+void vt_feed(Terminal *t, const char *buf, size_t len);
+void vt_dump(Terminal *t, FILE *out);
+void vt_end_transcript(Terminal *t);
+size_t vt_printable_run(const char *buf, size_t len);
+
+#endif